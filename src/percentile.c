@@ -35,6 +35,7 @@
 #include <memory.h>
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
 
 /*
  * Given a number, return the index of the corresponding bucket in
@@ -109,6 +110,28 @@ uint32_t procstat_percentile_idx_to_val(unsigned int idx)
 }
 
 
+/*
+ * Largest value counted by the bucket @idx, values with MSB above the last group are all
+ * counted by the last bucket
+ */
+uint32_t procstat_percentile_idx_to_max(unsigned int idx)
+{
+	unsigned int error_bits, k, base;
+
+	assert(idx < PROCSTAT_PERCENTILE_ARR_NR);
+
+	if (idx == PROCSTAT_PERCENTILE_ARR_NR - 1)
+		return UINT32_MAX;
+	if (idx < (PROCSTAT_BUCKET_VALUES << 1))
+		return idx;
+
+	error_bits = (idx >> PROCSTAT_BUCKET_BITS) - 1;
+	base = 1 << (error_bits + PROCSTAT_BUCKET_BITS);
+	k = idx % PROCSTAT_BUCKET_VALUES;
+
+	return base + ((k + 1) << error_bits) - 1;
+}
+
 void procstat_hist_add_point(uint32_t *histogram, uint32_t value)
 {
 	unsigned int index = percentile_value_to_index(value);
@@ -116,22 +139,688 @@ void procstat_hist_add_point(uint32_t *histogram, uint32_t value)
 	++histogram[index];
 }
 
+/*
+ * Sparse histogram groups are PROCSTAT_BUCKET_VALUES counters aligned to a cache line. The low bits
+ * of the group entry hold log2 of the counter width in bytes, the width only grows until the
+ * histogram is freed. The writer widens a group by copying its counters and publishing the new
+ * entry with a single store, so a reader sees either the old or the new counters.
+ */
+#define SPARSE_GROUP_ALIGN 64
+#define SPARSE_WIDTH_MASK ((uintptr_t)SPARSE_GROUP_ALIGN - 1)
+
+static inline void *sparse_group_counters(uintptr_t group)
+{
+	return (void *)(group & ~SPARSE_WIDTH_MASK);
+}
+
+static inline unsigned int sparse_group_shift(uintptr_t group)
+{
+	return group & SPARSE_WIDTH_MASK;
+}
+
+static inline uint32_t sparse_group_get(uintptr_t group, unsigned int k)
+{
+	void *counters = sparse_group_counters(group);
+
+	switch (sparse_group_shift(group)) {
+	case 0:
+		return ((uint8_t *)counters)[k];
+	case 1:
+		return ((uint16_t *)counters)[k];
+	default:
+		return ((uint32_t *)counters)[k];
+	}
+}
+
+static uintptr_t sparse_group_alloc(unsigned int shift)
+{
+	void *counters;
+
+	if (posix_memalign(&counters, SPARSE_GROUP_ALIGN, PROCSTAT_BUCKET_VALUES << shift))
+		return 0;
+	memset(counters, 0, PROCSTAT_BUCKET_VALUES << shift);
+	return (uintptr_t)counters | shift;
+}
+
+static uintptr_t sparse_group_widen(struct procstat_hist_sparse *hist, uintptr_t group, unsigned int shift)
+{
+	void **retired;
+	uintptr_t wide;
+	uint32_t *wide32;
+	uint16_t *wide16;
+	unsigned int k;
+
+	retired = realloc(hist->retired, (hist->nretired + 1) * sizeof(*retired));
+	if (!retired)
+		return 0;
+	hist->retired = retired;
+
+	wide = sparse_group_alloc(shift);
+	if (!wide)
+		return 0;
+
+	wide16 = sparse_group_counters(wide);
+	wide32 = sparse_group_counters(wide);
+	for (k = 0; k < PROCSTAT_BUCKET_VALUES; ++k) {
+		if (shift == 1)
+			wide16[k] = sparse_group_get(group, k);
+		else
+			wide32[k] = sparse_group_get(group, k);
+	}
+	hist->retired[hist->nretired++] = sparse_group_counters(group);
+	return wide;
+}
+
+/*
+ * All the groups of a histogram are widened together, so the writer branch on the counter width
+ * stays predictable. This happens at most twice in the lifetime of a histogram.
+ */
+static void sparse_widen(struct procstat_hist_sparse *hist)
+{
+	unsigned int shift = hist->shift + 1;
+	unsigned int g;
+
+	for (g = 0; g < PROCSTAT_GROUP_NR; ++g) {
+		uintptr_t group = hist->groups[g];
+
+		if (!group || sparse_group_shift(group) >= shift)
+			continue;
+		group = sparse_group_widen(hist, group, shift);
+		if (!group)
+			return;
+		__atomic_store_n(&hist->groups[g], group, __ATOMIC_RELEASE);
+	}
+	hist->shift = shift;
+}
+
+/* adds @count points to bucket @index, widening its group as long as the counter would overflow */
+static inline void sparse_add(struct procstat_hist_sparse *hist, unsigned int index, uint32_t count)
+{
+	unsigned int g = index / PROCSTAT_BUCKET_VALUES;
+	unsigned int k = index % PROCSTAT_BUCKET_VALUES;
+	uintptr_t group = hist->groups[g];
+	void *counters;
+
+	if (__builtin_expect(!group, 0)) {
+		group = sparse_group_alloc(hist->shift);
+		if (!group)
+			return;
+		__atomic_store_n(&hist->groups[g], group, __ATOMIC_RELEASE);
+	}
+
+	for (;;) {
+		counters = sparse_group_counters(group);
+		switch (sparse_group_shift(group)) {
+		case 0:
+			if (__builtin_expect(count <= UINT8_MAX - ((uint8_t *)counters)[k], 1)) {
+				((uint8_t *)counters)[k] += count;
+				return;
+			}
+			break;
+		case 1:
+			if (__builtin_expect(count <= UINT16_MAX - ((uint16_t *)counters)[k], 1)) {
+				((uint16_t *)counters)[k] += count;
+				return;
+			}
+			break;
+		default:
+			((uint32_t *)counters)[k] += count;
+			return;
+		}
+
+		sparse_widen(hist);
+		if (sparse_group_shift(hist->groups[g]) == sparse_group_shift(group))
+			return;
+		group = hist->groups[g];
+	}
+}
+
+void procstat_hist_sparse_add_point(struct procstat_hist_sparse *hist, uint32_t value)
+{
+	sparse_add(hist, percentile_value_to_index(value), 1);
+}
+
+void procstat_hist_sparse_add_point_n(struct procstat_hist_sparse *hist, uint32_t value, uint32_t count)
+{
+	if (count)
+		sparse_add(hist, percentile_value_to_index(value), count);
+}
+
+void procstat_hist_sparse_read(const struct procstat_hist_sparse *hist, uint32_t *histogram)
+{
+	unsigned int g, k;
+
+	for (g = 0; g < PROCSTAT_GROUP_NR; ++g) {
+		uintptr_t group = __atomic_load_n(&hist->groups[g], __ATOMIC_ACQUIRE);
+		uint32_t *dense = histogram + g * PROCSTAT_BUCKET_VALUES;
+
+		if (!group) {
+			memset(dense, 0, PROCSTAT_BUCKET_VALUES * sizeof(*dense));
+			continue;
+		}
+		for (k = 0; k < PROCSTAT_BUCKET_VALUES; ++k)
+			dense[k] = sparse_group_get(group, k);
+	}
+}
+
+void procstat_hist_sparse_clear(struct procstat_hist_sparse *hist)
+{
+	unsigned int g;
+
+	for (g = 0; g < PROCSTAT_GROUP_NR; ++g) {
+		uintptr_t group = hist->groups[g];
+
+		if (group)
+			memset(sparse_group_counters(group), 0, PROCSTAT_BUCKET_VALUES << sparse_group_shift(group));
+	}
+}
+
+void procstat_hist_sparse_free(struct procstat_hist_sparse *hist)
+{
+	unsigned int g;
+
+	for (g = 0; g < PROCSTAT_GROUP_NR; ++g) {
+		free(sparse_group_counters(hist->groups[g]));
+		hist->groups[g] = 0;
+	}
+	while (hist->nretired)
+		free(hist->retired[--hist->nretired]);
+	free(hist->retired);
+	hist->retired = NULL;
+	hist->shift = 0;
+}
+
+size_t procstat_hist_sparse_size(const struct procstat_hist_sparse *hist)
+{
+	size_t size = 0;
+	unsigned int g;
+
+	for (g = 0; g < PROCSTAT_GROUP_NR; ++g) {
+		uintptr_t group = __atomic_load_n(&hist->groups[g], __ATOMIC_RELAXED);
+
+		if (group)
+			size += PROCSTAT_BUCKET_VALUES << sparse_group_shift(group);
+	}
+	return size;
+}
+
+/*
+ * Bucket array kernels. The buckets of a group are summed up (block sums) with AVX2 or SSE4.1
+ * when the cpu supports it, and with the portable loop otherwise. The implementation is picked
+ * on the first call. Batches of series points are reduced to their sum, min, max and squared
+ * deviations by the same kernels, AVX2 only since 64 bit compares need SSE4.2.
+ */
+struct percentile_kernels {
+	void (*group_sums)(const uint32_t *histogram, uint64_t *group_sums);
+	void (*merge)(uint32_t *dst, const uint32_t *src);
+	uint64_t (*index)(const uint32_t *values, unsigned int n, uint32_t *indexes);
+	uint64_t (*min_max_sum)(const uint64_t *values, size_t n, uint64_t *min, uint64_t *max);
+	double (*squared_deviations)(const uint64_t *values, size_t n, double mean);
+};
+
+static void group_sums_generic(const uint32_t *histogram, uint64_t *group_sums)
+{
+	unsigned int group, i;
+
+	for (group = 0; group < PROCSTAT_GROUP_NR; ++group) {
+		uint64_t sum = 0;
+
+		for (i = 0; i < PROCSTAT_BUCKET_VALUES; ++i)
+			sum += histogram[i];
+		group_sums[group] = sum;
+		histogram += PROCSTAT_BUCKET_VALUES;
+	}
+}
+
+static void merge_generic(uint32_t *dst, const uint32_t *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROCSTAT_PERCENTILE_ARR_NR; ++i)
+		dst[i] += src[i];
+}
+
+/* computes bucket indexes of @values, @return sum of @values */
+static uint64_t index_generic(const uint32_t *values, unsigned int n, uint32_t *indexes)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		sum += values[i];
+		indexes[i] = percentile_value_to_index(values[i]);
+	}
+	return sum;
+}
+
+static uint64_t min_max_sum_generic(const uint64_t *values, size_t n, uint64_t *min, uint64_t *max)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		sum += values[i];
+		if (values[i] < *min)
+			*min = values[i];
+		if (values[i] > *max)
+			*max = values[i];
+	}
+	return sum;
+}
+
+static double squared_deviations_generic(const uint64_t *values, size_t n, double mean)
+{
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		sum += ((double)values[i] - mean) * ((double)values[i] - mean);
+	return sum;
+}
+
+static const struct percentile_kernels generic_kernels = {
+	.group_sums = group_sums_generic,
+	.merge = merge_generic,
+	.index = index_generic,
+	.min_max_sum = min_max_sum_generic,
+	.squared_deviations = squared_deviations_generic,
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PERCENTILE_SIMD_X86
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+static void group_sums_sse4(const uint32_t *histogram, uint64_t *group_sums)
+{
+	unsigned int group, i;
+
+	for (group = 0; group < PROCSTAT_GROUP_NR; ++group) {
+		__m128i acc = _mm_setzero_si128();
+
+		for (i = 0; i < PROCSTAT_BUCKET_VALUES; i += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(histogram + i));
+
+			acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(v));
+			acc = _mm_add_epi64(acc, _mm_cvtepu32_epi64(_mm_srli_si128(v, 8)));
+		}
+		group_sums[group] = _mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1);
+		histogram += PROCSTAT_BUCKET_VALUES;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void merge_sse4(uint32_t *dst, const uint32_t *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROCSTAT_PERCENTILE_ARR_NR; i += 4) {
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(d, v));
+	}
+}
+
+__attribute__((target("avx2")))
+static void group_sums_avx2(const uint32_t *histogram, uint64_t *group_sums)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int group, i;
+
+	for (group = 0; group < PROCSTAT_GROUP_NR; ++group) {
+		__m256i acc = zero;
+		__m128i sum;
+
+		for (i = 0; i < PROCSTAT_BUCKET_VALUES; i += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(histogram + i));
+
+			/* widen to u64 lanes, a group may hold more than 2^32 samples */
+			acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+			acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+		}
+		sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		group_sums[group] = _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+		histogram += PROCSTAT_BUCKET_VALUES;
+	}
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2(uint32_t *dst, const uint32_t *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < PROCSTAT_PERCENTILE_ARR_NR; i += 8) {
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(d, v));
+	}
+}
+
+/*
+ * The MSB of 8 values at once: the upper and lower 16 bits are converted to floats exactly, and
+ * the float exponent of the non zero half gives the MSB.
+ */
+__attribute__((target("avx2")))
+static uint64_t index_avx2(const uint32_t *values, unsigned int n, uint32_t *indexes)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i bias = _mm256_set1_epi32(127);
+	const __m256i bucket_bits = _mm256_set1_epi32(PROCSTAT_BUCKET_BITS);
+	const __m256i bucket_mask = _mm256_set1_epi32(PROCSTAT_BUCKET_VALUES - 1);
+	const __m256i last_index = _mm256_set1_epi32(PROCSTAT_PERCENTILE_ARR_NR - 1);
+	__m256i acc = zero;
+	__m128i sum;
+	uint64_t total;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+		__m256i hi = _mm256_srli_epi32(v, 16);
+		__m256i lo = _mm256_and_si256(v, _mm256_set1_epi32(0xffff));
+		__m256i msb_hi = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(hi)), 23);
+		__m256i msb_lo = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(lo)), 23);
+		__m256i msb, error_bits, index;
+
+		msb_hi = _mm256_add_epi32(_mm256_sub_epi32(msb_hi, bias), _mm256_set1_epi32(16));
+		msb_lo = _mm256_sub_epi32(msb_lo, bias);
+		msb = _mm256_blendv_epi8(msb_lo, msb_hi, _mm256_cmpgt_epi32(hi, zero));
+
+		/* same computation as percentile_value_to_index() */
+		error_bits = _mm256_sub_epi32(msb, bucket_bits);
+		index = _mm256_slli_epi32(_mm256_add_epi32(error_bits, _mm256_set1_epi32(1)), PROCSTAT_BUCKET_BITS);
+		index = _mm256_add_epi32(index, _mm256_and_si256(_mm256_srlv_epi32(v, error_bits), bucket_mask));
+		index = _mm256_min_epu32(index, last_index);
+		index = _mm256_blendv_epi8(v, index, _mm256_cmpgt_epi32(msb, bucket_bits));
+		_mm256_storeu_si256((__m256i *)(indexes + i), index);
+
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	total = _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+	/* the tail and the caller run SSE code, leave no dirty upper halves behind */
+	_mm256_zeroupper();
+	return total + index_generic(values + i, n - i, indexes + i);
+}
+
+/* unsigned compares flip the sign bit of both sides and compare signed */
+__attribute__((target("avx2")))
+static uint64_t min_max_sum_avx2(const uint64_t *values, size_t n, uint64_t *min, uint64_t *max)
+{
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	__m256i acc = _mm256_setzero_si256();
+	__m256i lo = _mm256_set1_epi64x(*min ^ INT64_MIN);
+	__m256i hi = _mm256_set1_epi64x(*max ^ INT64_MIN);
+	uint64_t lanes[4], sum;
+	size_t i;
+	int k;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+		__m256i flipped = _mm256_xor_si256(v, sign);
+
+		acc = _mm256_add_epi64(acc, v);
+		lo = _mm256_blendv_epi8(lo, flipped, _mm256_cmpgt_epi64(lo, flipped));
+		hi = _mm256_blendv_epi8(hi, flipped, _mm256_cmpgt_epi64(flipped, hi));
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, acc);
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm256_storeu_si256((__m256i *)lanes, lo);
+	for (k = 0; k < 4; ++k)
+		if ((lanes[k] ^ INT64_MIN) < *min)
+			*min = lanes[k] ^ INT64_MIN;
+	_mm256_storeu_si256((__m256i *)lanes, hi);
+	for (k = 0; k < 4; ++k)
+		if ((lanes[k] ^ INT64_MIN) > *max)
+			*max = lanes[k] ^ INT64_MIN;
+	_mm256_zeroupper();
+	return sum + min_max_sum_generic(values + i, n - i, min, max);
+}
+
+/*
+ * u64 lanes are converted to doubles without AVX-512: both 32 bit halves are converted exactly
+ * through the 2^52 and 2^84 exponent tricks, so their sum rounds once like a scalar conversion.
+ * The deviations are summed in four lanes, which only changes the rounding of the total.
+ */
+__attribute__((target("avx2")))
+static double squared_deviations_avx2(const uint64_t *values, size_t n, double mean)
+{
+	const __m256i low_mask = _mm256_set1_epi64x(0xffffffff);
+	const __m256i exp52 = _mm256_castpd_si256(_mm256_set1_pd(0x1p52));
+	const __m256i exp84 = _mm256_castpd_si256(_mm256_set1_pd(0x1p84));
+	const __m256d bias = _mm256_set1_pd(0x1p84 + 0x1p52);
+	const __m256d mean4 = _mm256_set1_pd(mean);
+	__m256d acc = _mm256_setzero_pd();
+	double lanes[4], sum;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+		__m256d lo = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(v, low_mask), exp52));
+		__m256d hi = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(v, 32), exp84));
+		__m256d d = _mm256_add_pd(_mm256_sub_pd(hi, bias), lo);
+
+		d = _mm256_sub_pd(d, mean4);
+		acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+	}
+
+	_mm256_storeu_pd(lanes, acc);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	_mm256_zeroupper();
+	return sum + squared_deviations_generic(values + i, n - i, mean);
+}
+
+static const struct percentile_kernels sse4_kernels = {
+	.group_sums = group_sums_sse4,
+	.merge = merge_sse4,
+	.index = index_generic,
+	.min_max_sum = min_max_sum_generic,
+	.squared_deviations = squared_deviations_generic,
+};
+
+static const struct percentile_kernels avx2_kernels = {
+	.group_sums = group_sums_avx2,
+	.merge = merge_avx2,
+	.index = index_avx2,
+	.min_max_sum = min_max_sum_avx2,
+	.squared_deviations = squared_deviations_avx2,
+};
+#endif
+
+static const struct percentile_kernels *kernels;
+
+static const struct percentile_kernels *supported_kernels(enum procstat_kernels type)
+{
+	switch (type) {
+	case PROCSTAT_KERNELS_GENERIC:
+		return &generic_kernels;
+#ifdef PERCENTILE_SIMD_X86
+	case PROCSTAT_KERNELS_SSE4:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.1") ? &sse4_kernels : NULL;
+	case PROCSTAT_KERNELS_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+	case PROCSTAT_KERNELS_AUTO:
+		if (supported_kernels(PROCSTAT_KERNELS_AVX2))
+			return supported_kernels(PROCSTAT_KERNELS_AVX2);
+		if (supported_kernels(PROCSTAT_KERNELS_SSE4))
+			return supported_kernels(PROCSTAT_KERNELS_SSE4);
+		return &generic_kernels;
+	default:
+		return NULL;
+	}
+}
+
+static const struct percentile_kernels *percentile_kernels(void)
+{
+	const struct percentile_kernels *selected = __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+
+	if (selected)
+		return selected;
+
+	selected = supported_kernels(PROCSTAT_KERNELS_AUTO);
+	__atomic_store_n(&kernels, selected, __ATOMIC_RELAXED);
+	return selected;
+}
+
+int procstat_select_kernels(enum procstat_kernels type)
+{
+	const struct percentile_kernels *selected = supported_kernels(type);
+
+	if (!selected)
+		return -1;
+	__atomic_store_n(&kernels, selected, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void procstat_hist_block_prefix_sum(const uint32_t *histogram, uint64_t *prefix)
+{
+	unsigned int group;
+
+	percentile_kernels()->group_sums(histogram, prefix);
+	for (group = 1; group < PROCSTAT_GROUP_NR; ++group)
+		prefix[group] += prefix[group - 1];
+}
+
+void procstat_hist_merge(uint32_t *dst, const uint32_t *src)
+{
+	percentile_kernels()->merge(dst, src);
+}
+
+uint64_t procstat_u64_min_max_sum(const uint64_t *values, size_t n, uint64_t *min, uint64_t *max)
+{
+	return percentile_kernels()->min_max_sum(values, n, min, max);
+}
+
+double procstat_u64_squared_deviations(const uint64_t *values, size_t n, double mean)
+{
+	return percentile_kernels()->squared_deviations(values, n, mean);
+}
+
+#define SPARSE_BATCH 64
+
+uint64_t procstat_hist_sparse_add_points(struct procstat_hist_sparse *hist, const uint32_t *values, size_t n)
+{
+	const struct percentile_kernels *kernels = percentile_kernels();
+	uint32_t indexes[SPARSE_BATCH];
+	uint64_t sum = 0;
+	unsigned int batch, i;
+
+	while (n) {
+		batch = n < SPARSE_BATCH ? n : SPARSE_BATCH;
+		sum += kernels->index(values, batch, indexes);
+		for (i = 0; i < batch; ++i)
+			sparse_add(hist, indexes[i], 1);
+		values += batch;
+		n -= batch;
+	}
+	return sum;
+}
+
+/*
+ * All the percentiles are located in a single pass: whole groups below the percentile rank are
+ * skipped using the block prefix sums, and only the buckets of the group holding the rank are
+ * walked. Ranks are compared as floats exactly like the bucket by bucket walk did, so the results
+ * do not change.
+ */
 void procstat_percentile_calculate(uint32_t *histogram,
 				   uint64_t samples_count,
 				   struct procstat_percentile_result *result,
 				   unsigned result_len)
 {
-	unsigned long num_points = 0;
-	unsigned int  i, j = 0;
+	uint64_t prefix[PROCSTAT_GROUP_NR];
+	uint64_t num_points = 0;
+	unsigned int group = 0, i = 0, j;
+
+	procstat_hist_block_prefix_sum(histogram, prefix);
+	for (j = 0; j < result_len; ++j) {
+		float rank = result[j].fraction * samples_count;
 
+		assert(result[j].fraction <= 1.0);
+		while (group < PROCSTAT_GROUP_NR && prefix[group] < rank)
+			++group;
+		if (group == PROCSTAT_GROUP_NR)
+			break;
+
+		if (i < group * PROCSTAT_BUCKET_VALUES) {
+			i = group * PROCSTAT_BUCKET_VALUES;
+			num_points = group ? prefix[group - 1] : 0;
+		}
+		/* several percentiles might be anwered with same bucket*/
+		while (num_points + histogram[i] < rank)
+			num_points += histogram[i++];
+
+		result[j].value = procstat_percentile_idx_to_val(i);
+	}
+}
+
+void procstat_hist_u64_add_point(uint64_t *histogram, unsigned bits, uint64_t value)
+{
+	unsigned int error_bits, idx;
+
+	if (value < (2ULL << bits)) {
+		idx = value;
+	} else {
+		error_bits = (63 - __builtin_clzll(value)) - bits;
+		idx = ((error_bits + 1) << bits) + ((value >> error_bits) & ((1U << bits) - 1));
+	}
+	++histogram[idx];
+}
+
+uint64_t procstat_percentile_u64_idx_to_val(unsigned bits, unsigned int idx)
+{
+	unsigned int error_bits, k;
+
+	assert(idx < PROCSTAT_U64_BUCKETS_NR(bits));
+
+	if (idx < (2U << bits))
+		return idx;
+
+	error_bits = (idx >> bits) - 1;
+	k = idx & ((1U << bits) - 1);
+
+	/* mean of the bucket range, computed in integers so that the top buckets do not overflow */
+	return (1ULL << (error_bits + bits)) + ((uint64_t)k << error_bits) + (1ULL << (error_bits - 1));
+}
+
+uint64_t procstat_percentile_u64_idx_to_max(unsigned bits, unsigned int idx)
+{
+	unsigned int error_bits, k;
+
+	assert(idx < PROCSTAT_U64_BUCKETS_NR(bits));
+
+	if (idx < (2U << bits))
+		return idx;
+
+	error_bits = (idx >> bits) - 1;
+	k = idx & ((1U << bits) - 1);
+
+	/* the last bucket wraps around to UINT64_MAX */
+	return (1ULL << (error_bits + bits)) + ((uint64_t)(k + 1) << error_bits) - 1;
+}
+
+void procstat_percentile_u64_calculate(const uint64_t *histogram,
+				       unsigned bits,
+				       uint64_t samples_count,
+				       struct procstat_percentile_u64_result *result,
+				       unsigned result_len)
+{
+	unsigned int nr = PROCSTAT_U64_BUCKETS_NR(bits);
+	uint64_t num_points = 0;
+	unsigned int i, j = 0;
 
-	for (i = 0; i < PROCSTAT_PERCENTILE_ARR_NR && j < result_len; ++i) {
+	for (i = 0; i < nr && j < result_len; ++i) {
 		num_points += histogram[i];
 
 		/* several percentiles might be anwered with same bucket*/
-		while (num_points >= result[j].fraction * samples_count) {
+		while (num_points >= (double)result[j].fraction * samples_count) {
 			assert(result[j].fraction <= 1.0);
-			result[j].value = procstat_percentile_idx_to_val(i);
+			result[j].value = procstat_percentile_u64_idx_to_val(bits, i);
 
 			++j;
 			if (j == result_len)
@@ -97,6 +97,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #define PROCSTAT_BUCKET_BITS 6
 #define PROCSTAT_BUCKET_VALUES (1 << PROCSTAT_BUCKET_BITS)
 #define PROCSTAT_GROUP_NR 19
@@ -113,6 +114,107 @@ struct procstat_percentile_result {
  */
 void procstat_hist_add_point(uint32_t *histogram, uint32_t value);
 
+/**
+ * @return value represented by bucket @idx of histogram
+ */
+uint32_t procstat_percentile_idx_to_val(unsigned int idx);
+
+/**
+ * @return largest value counted by bucket @idx of histogram
+ */
+uint32_t procstat_percentile_idx_to_max(unsigned int idx);
+
+/**
+ * @brief computes cumulative number of samples at the end of every bucket group of @histogram.
+ * @prefix array of at least @PROCSTAT_GROUP_NR entries
+ */
+void procstat_hist_block_prefix_sum(const uint32_t *histogram, uint64_t *prefix);
+
+/**
+ * @brief adds buckets of @src histogram to @dst histogram
+ */
+void procstat_hist_merge(uint32_t *dst, const uint32_t *src);
+
+/*
+ * Implementations of the bucket array and batch kernels, PROCSTAT_KERNELS_AUTO is the widest one
+ * the cpu supports and is used unless other kernels are selected.
+ */
+enum procstat_kernels {
+	PROCSTAT_KERNELS_AUTO = 0,
+	PROCSTAT_KERNELS_GENERIC = 1,
+	PROCSTAT_KERNELS_SSE4 = 2,
+	PROCSTAT_KERNELS_AVX2 = 3,
+};
+
+/**
+ * @brief switches the whole process to @type kernels, meant for tests and benchmarks
+ * @return 0 on success, -1 in case the cpu or the build does not support them
+ */
+int procstat_select_kernels(enum procstat_kernels type);
+
+/**
+ * @brief folds @n @values into @min and @max, with AVX2 when the cpu supports it
+ * @return sum of @values
+ */
+uint64_t procstat_u64_min_max_sum(const uint64_t *values, size_t n, uint64_t *min, uint64_t *max);
+
+/**
+ * @return sum of squared differences of @n @values from @mean
+ */
+double procstat_u64_squared_deviations(const uint64_t *values, size_t n, double mean);
+
+/**
+ * @brief compact storage of a u32 histogram. Groups of PROCSTAT_BUCKET_VALUES buckets are allocated
+ * on their first point, with u8 counters that are widened to u16 and u32 on overflow, so a histogram
+ * touching a few buckets takes a few cache lines. Every group entry holds the counters pointer with
+ * the counter width encoded in its low bits, @shift is the width of newly allocated groups.
+ * Narrower copies replaced by a widened group are @retired and freed together with the histogram,
+ * as readers might still access them. Single writer, must be zero initialized.
+ */
+struct procstat_hist_sparse {
+	uintptr_t 	groups[PROCSTAT_GROUP_NR];
+	void 		**retired;
+	uint32_t 	nretired;
+	uint32_t 	shift;
+};
+
+/**
+ * @brief adds @value point to @hist
+ */
+void procstat_hist_sparse_add_point(struct procstat_hist_sparse *hist, uint32_t value);
+
+/**
+ * @brief adds @count points of @value to @hist
+ */
+void procstat_hist_sparse_add_point_n(struct procstat_hist_sparse *hist, uint32_t value, uint32_t count);
+
+/**
+ * @brief adds @n points of @values to @hist. Bucket indexes are computed in batches with AVX2
+ * when the cpu supports it.
+ * @return sum of @values
+ */
+uint64_t procstat_hist_sparse_add_points(struct procstat_hist_sparse *hist, const uint32_t *values, size_t n);
+
+/**
+ * @brief expands @hist into dense @histogram of length at least @PROCSTAT_PERCENTILE_ARR_NR
+ */
+void procstat_hist_sparse_read(const struct procstat_hist_sparse *hist, uint32_t *histogram);
+
+/**
+ * @brief zeroes all the counters of @hist, keeping the allocated groups
+ */
+void procstat_hist_sparse_clear(struct procstat_hist_sparse *hist);
+
+/**
+ * @brief releases all memory held by @hist
+ */
+void procstat_hist_sparse_free(struct procstat_hist_sparse *hist);
+
+/**
+ * @return number of bytes allocated for counters of @hist
+ */
+size_t procstat_hist_sparse_size(const struct procstat_hist_sparse *hist);
+
 /**
  * @brief calculates percentiles on histogram
  */
@@ -120,3 +222,42 @@ void procstat_percentile_calculate(uint32_t *histogram,
 				   uint64_t samples_count,
 				   struct procstat_percentile_result *result,
 				   unsigned result_len);
+
+/*
+ * u64 histograms use the same layout over the full 64 bit range, with the number of index bits
+ * M chosen per histogram (@bits). Values below 2^(M+1) get a bucket each, every higher power of
+ * two range is split into 2^M buckets, so the error is bounded by 1/2^(M+1) and the histogram
+ * takes (65 - M) * 2^M buckets.
+ */
+#define PROCSTAT_U64_BUCKET_BITS_MIN 1
+#define PROCSTAT_U64_BUCKET_BITS_MAX 10
+#define PROCSTAT_U64_BUCKETS_NR(bits) ((65U - (bits)) << (bits))
+
+struct procstat_percentile_u64_result {
+	float 	 fraction;
+	uint64_t value;
+};
+
+/**
+ * @brief adds @value point to @histogram of length at least @PROCSTAT_U64_BUCKETS_NR(@bits)
+ */
+void procstat_hist_u64_add_point(uint64_t *histogram, unsigned bits, uint64_t value);
+
+/**
+ * @return value represented by bucket @idx of u64 histogram with @bits index bits
+ */
+uint64_t procstat_percentile_u64_idx_to_val(unsigned bits, unsigned int idx);
+
+/**
+ * @return largest value counted by bucket @idx of u64 histogram with @bits index bits
+ */
+uint64_t procstat_percentile_u64_idx_to_max(unsigned bits, unsigned int idx);
+
+/**
+ * @brief calculates percentiles on u64 histogram with @bits index bits
+ */
+void procstat_percentile_u64_calculate(const uint64_t *histogram,
+				       unsigned bits,
+				       uint64_t samples_count,
+				       struct procstat_percentile_u64_result *result,
+				       unsigned result_len);
@@ -32,8 +32,8 @@
  */
 
 
-#define FUSE_USE_VERSION 26
-#include <fuse/fuse_lowlevel.h>
+#define FUSE_USE_VERSION 35
+#include <fuse3/fuse_lowlevel.h>
 #include <dirent.h>
 #include <stdbool.h>
 #include <errno.h>
@@ -49,6 +49,22 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <zlib.h>
 #include "procstat.h"
 #include "basic_formatters.h"
 
@@ -61,11 +77,18 @@ enum {
 	STATS_ENTRY_FLAG_DIR	     = 1 << 1,
 	STATS_ENTRY_FLAG_HISTOGRAM   = 1 << 2,
 	STATS_ENTRY_FLAG_AGGREGATOR  = 1 << 3,
+	STATS_ENTRY_FLAG_SHARDED_SERIES    = 1 << 4,
+	STATS_ENTRY_FLAG_SHARDED_HISTOGRAM = 1 << 5,
+	STATS_ENTRY_FLAG_PERCPU 	   = 1 << 6,
+	STATS_ENTRY_FLAG_HISTOGRAM_U64     = 1 << 7,
+	STATS_ENTRY_FLAG_CACHEABLE	   = 1 << 8,
 };
 
 #define SERIES_RESET_CLOCK CLOCK_MONOTONIC_COARSE
 
 #define ATTRIBUTES_TIMEOUT_SEC (60.0 * 60)
+#define READ_BUFFER_SIZE 100
+#define READ_BUFFER_MAX_SIZE (16 << 20)
 #define DNAME_INLINE_LEN 32
 struct procstat_dynamic_name {
 	unsigned zero:8;
@@ -81,13 +104,24 @@ struct procstat_item {
 	struct procstat_directory *parent;
 	uint32_t 	       name_hash;
 	struct list_head       entry;
+	struct procstat_item   *hash_next;
 	int 		       refcnt;
 	unsigned 	       flags;
 };
 
+/*
+ * Children are kept in registration order on @children for readdir and the aggregator. Once a
+ * directory holds DIRECTORY_INDEX_THRESHOLD children, lookups go through @index, a power of two
+ * array of hash chains linked by hash_next, which doubles whenever it holds more children than
+ * buckets.
+ */
+#define DIRECTORY_INDEX_THRESHOLD 32
 struct procstat_directory {
 	struct procstat_item base;
 	struct list_head       children;
+	struct procstat_item   **index;
+	uint32_t 	       index_mask;
+	uint32_t 	       nchildren;
 };
 
 struct procstat_file {
@@ -98,27 +132,69 @@ struct procstat_file {
 	procstats_formatter  	writer;
 };
 
+/*
+ * Entries removed while the kernel may cache them, the notifications are sent once the tree lock
+ * is released: the kernel locks the parent directory to drop the entry, and a lookup in progress
+ * there may wait for the tree lock.
+ */
+struct entry_invalidation {
+	struct entry_invalidation *next;
+	fuse_ino_t 		  parent;
+	size_t 			  namelen;
+	char 			  name[0];
+};
+
+struct reset_ticker {
+	pthread_t 	thread;
+	pthread_mutex_t lock;
+	pthread_cond_t 	cond;
+	bool 		stop;
+	bool 		running;
+};
+
 struct procstat_context {
 	struct procstat_directory root;
 	char *mountpoint;
 	struct fuse_session *session;
 	gid_t	gid;
 	uid_t   uid;
-	pthread_mutex_t global_lock;
+	/* FUSE ops walk the tree as readers, registration and removal are writers */
+	pthread_rwlock_t tree_lock;
+	struct entry_invalidation *invalidations;
+	struct shm_export *shm;
+	struct stat_server *unix_server;
+	struct stat_server *http_server;
+	struct inode_invalidator *invalidator;
+	struct pending_mount *pending_mount;
+	/* both under the tree lock, a loop only serves the session unless a stop came first */
+	bool stop_pending;
+	bool serving;
+	struct reset_ticker ticker;
+	/* registered histograms, under the tree lock, the ticker recycles their standby values */
+	struct list_head histograms;
 };
 
 struct procstat_series {
 	struct procstat_directory root;
 	void  	    		  *private;
+	struct list_head 	  standby_entry;
 };
 
+/* FNV-1a with the murmur3 finalizer, so that the low bits used by the index are well mixed */
 static uint32_t string_hash(const char *string)
 {
-	uint32_t hash = 0;
+	uint32_t hash = 2166136261U;
 	unsigned char *i;
 
-	for (i = (unsigned char*)string; *i; ++i)
-	hash = 31 * hash + *i;
+	for (i = (unsigned char*)string; *i; ++i) {
+		hash ^= *i;
+		hash *= 16777619U;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
 	return hash;
 }
 
@@ -147,6 +223,11 @@ static bool root_directory(struct procstat_context *context, struct procstat_dir
 	return &context->root == directory;
 }
 
+static fuse_ino_t item_to_fuse_inode(struct procstat_context *context, struct procstat_item *item)
+{
+	return (item == &context->root.base) ? FUSE_ROOT_ID : (uintptr_t)item;
+}
+
 static bool stats_item_short_name(struct procstat_item *item)
 {
 	/* file name cannot start with \0, so in case
@@ -176,17 +257,38 @@ static void free_histogram(struct procstat_series *series)
 {
 	struct procstat_histogram_u32 *hist = series->private;
 
-	if (!hist->histogram)
-		return;
-	free(hist->histogram);
+	if (hist->buffers) {
+		procstat_hist_sparse_free(&hist->buffers[0].buckets);
+		procstat_hist_sparse_free(&hist->buffers[1].buckets);
+	}
+	free(hist->buffers);
+	hist->buffers = NULL;
+	hist->active = NULL;
+	hist->standby = NULL;
+}
+
+static void free_histogram_u64(struct procstat_series *series)
+{
+	struct procstat_histogram_u64 *hist = series->private;
+
+	/* both bucket arrays are a single allocation */
+	free(hist->buffers[0].histogram);
+	hist->buffers[0].histogram = NULL;
+	hist->buffers[1].histogram = NULL;
+	hist->active = NULL;
+	hist->standby = NULL;
 }
 
+static void free_sharded(struct procstat_series *series);
+static void free_percpu(struct procstat_file *file);
+static void free_aggregator(struct procstat_file *file);
 static void free_item(struct procstat_item *item)
 {
 	list_del(&item->entry);
 	if (item_type_directory(item)) {
 		struct procstat_directory *directory = (struct procstat_directory *)item;
 		assert(list_empty(&directory->children));
+		free(directory->index);
 	}
 
 	if (!stats_item_short_name(item))
@@ -195,6 +297,18 @@ static void free_item(struct procstat_item *item)
 	if (item->flags & STATS_ENTRY_FLAG_HISTOGRAM)
 		free_histogram((struct procstat_series *)item);
 
+	if (item->flags & STATS_ENTRY_FLAG_HISTOGRAM_U64)
+		free_histogram_u64((struct procstat_series *)item);
+
+	if (item->flags & (STATS_ENTRY_FLAG_SHARDED_SERIES | STATS_ENTRY_FLAG_SHARDED_HISTOGRAM))
+		free_sharded((struct procstat_series *)item);
+
+	if (item->flags & STATS_ENTRY_FLAG_PERCPU)
+		free_percpu(container_of(item, struct procstat_file, base));
+
+	if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
+		free_aggregator(container_of(item, struct procstat_file, base));
+
 	free(item);
 }
 
@@ -203,6 +317,54 @@ static void free_directory(struct procstat_directory *directory)
 	free_item(&directory->base);
 }
 
+/*
+ * Item references are atomic, so they are taken under the tree lock held for reading. Only the
+ * last reference needs the tree lock held for writing, as dropping it frees the item.
+ */
+static inline void item_get(struct procstat_item *item)
+{
+	__atomic_add_fetch(&item->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static bool item_put_unless_last(struct procstat_item *item, int count)
+{
+	int refcnt = __atomic_load_n(&item->refcnt, __ATOMIC_RELAXED);
+
+	while (refcnt > count) {
+		if (__atomic_compare_exchange_n(&item->refcnt, &refcnt, refcnt - count, true,
+						__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+static void item_unref_locked(struct procstat_item *item, int count)
+{
+	if (item_put_unless_last(item, count))
+		return;
+
+	/* these are the last references, nobody can take a new one with the lock held */
+	assert(__atomic_load_n(&item->refcnt, __ATOMIC_ACQUIRE) == count);
+	item->refcnt = 0;
+	free_item(item);
+}
+
+/*
+ * Drop @count references of @item as part of a batch, the tree lock is taken for writing the first
+ * time the last references of an item are dropped and kept in @locked for the rest of the batch.
+ */
+static void item_unref_batched(struct procstat_context *context, struct procstat_item *item, int count,
+			       bool *locked)
+{
+	if (item_put_unless_last(item, count))
+		return;
+	if (!*locked) {
+		pthread_rwlock_wrlock(&context->tree_lock);
+		*locked = true;
+	}
+	item_unref_locked(item, count);
+}
+
 #define INODE_BLK_SIZE 4096
 static void fill_item_stats(struct procstat_context *context, struct procstat_item *item, struct stat *stat)
 {
@@ -227,6 +389,82 @@ static void fill_item_stats(struct procstat_context *context, struct procstat_it
 	stat->st_size = 0;
 	stat->st_blocks = 0;
 	stat->st_blksize = INODE_BLK_SIZE;
+
+	/* the kernel serves cached pages up to st_size, so it has to be the formatted size */
+	if ((item->flags & STATS_ENTRY_FLAG_CACHEABLE) && file->fmt) {
+		char buffer[READ_BUFFER_SIZE];
+		ssize_t size;
+
+		size = file->fmt(file->private, file->arg, buffer, sizeof(buffer));
+		stat->st_size = MIN(MAX(size, 0), READ_BUFFER_MAX_SIZE - 1);
+	}
+}
+
+/* only the names of cacheable files are cached by the kernel, removals invalidate them */
+static double item_entry_timeout(struct procstat_item *item)
+{
+	return (item->flags & STATS_ENTRY_FLAG_CACHEABLE) ? ATTRIBUTES_TIMEOUT_SEC : 0;
+}
+
+static void directory_index_insert(struct procstat_directory *directory, struct procstat_item *item)
+{
+	struct procstat_item **bucket = &directory->index[item->name_hash & directory->index_mask];
+
+	item->hash_next = *bucket;
+	*bucket = item;
+}
+
+/*
+ * (Re)build the index with @buckets chains. In case there is no memory the previous index is
+ * kept, lookups just walk longer chains (or the children list).
+ * @return false in case the previous index was kept
+ */
+static bool directory_index_rebuild(struct procstat_directory *directory, uint32_t buckets)
+{
+	struct procstat_item **index;
+	struct procstat_item *child;
+
+	index = calloc(buckets, sizeof(*index));
+	if (!index)
+		return false;
+
+	free(directory->index);
+	directory->index = index;
+	directory->index_mask = buckets - 1;
+	list_for_each_entry(child, &directory->children, entry)
+		directory_index_insert(directory, child);
+	return true;
+}
+
+static void directory_add_child_locked(struct procstat_directory *directory, struct procstat_item *item)
+{
+	list_add_tail(&item->entry, &directory->children);
+	++directory->nchildren;
+
+	if (directory->index && directory->nchildren <= directory->index_mask + 1)
+		directory_index_insert(directory, item);
+	else if (directory->index) {
+		/* the kept index must still find the new child */
+		if (!directory_index_rebuild(directory, 2 * (directory->index_mask + 1)))
+			directory_index_insert(directory, item);
+	} else if (directory->nchildren >= DIRECTORY_INDEX_THRESHOLD)
+		directory_index_rebuild(directory, 2 * DIRECTORY_INDEX_THRESHOLD);
+}
+
+static void directory_del_child_locked(struct procstat_directory *directory, struct procstat_item *item)
+{
+	list_del_init(&item->entry);
+	--directory->nchildren;
+
+	if (directory->index) {
+		struct procstat_item **link = &directory->index[item->name_hash & directory->index_mask];
+
+		while (*link && *link != item)
+			link = &(*link)->hash_next;
+		if (*link)
+			*link = item->hash_next;
+	}
+	item->hash_next = NULL;
 }
 
 static struct procstat_item *lookup_item_locked(struct procstat_directory *parent,
@@ -235,6 +473,16 @@ static struct procstat_item *lookup_item_locked(struct procstat_directory *paren
 {
 	struct procstat_item *item;
 
+	if (parent->index) {
+		for (item = parent->index[name_hash & parent->index_mask]; item; item = item->hash_next) {
+			if (item->name_hash != name_hash)
+				continue;
+			if (strcmp(procstat_item_name(item), name) == 0)
+				return item;
+		}
+		return NULL;
+	}
+
 	list_for_each_entry(item, &parent->children, entry) {
 		if (item->name_hash != name_hash)
 			continue;
@@ -248,27 +496,28 @@ static struct procstat_item *lookup_item_locked(struct procstat_directory *paren
 static void fuse_lookup(fuse_req_t req, fuse_ino_t parent_inode, const char *name)
 {
 	struct procstat_context *context = request_context(req);
-	static struct procstat_directory *parent;
+	struct procstat_directory *parent;
 	struct procstat_item *item;
 	struct fuse_entry_param fuse_entry;
 
 	memset(&fuse_entry, 0, sizeof(fuse_entry));
 
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
 	parent = fuse_inode_to_dir(request_context(req), parent_inode);
 
 	item = lookup_item_locked(parent, name, string_hash(name));
 	if ((!item) || (!item_registered(item))) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
 	fuse_entry.ino = (uintptr_t)item;
-	item->refcnt++;
+	item_get(item);
 	fuse_entry.attr_timeout = ATTRIBUTES_TIMEOUT_SEC;
+	fuse_entry.entry_timeout = item_entry_timeout(item);
 	fill_item_stats(context, item, &fuse_entry.attr);
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
 	fuse_reply_entry(req, &fuse_entry);
 }
 
@@ -277,16 +526,26 @@ static void fuse_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
 	struct procstat_context *context = request_context(req);
 	struct procstat_item *item;
 
-	pthread_mutex_lock(&context->global_lock);
 	item = (struct procstat_item *)(ino);
-	assert(nlookup <= item->refcnt);
-	if (nlookup == item->refcnt) {
-		item->refcnt = 1;
-		item_put_locked(item);
-	} else {
-		item->refcnt -= nlookup;
+	if (!item_put_unless_last(item, nlookup)) {
+		pthread_rwlock_wrlock(&context->tree_lock);
+		item_unref_locked(item, nlookup);
+		pthread_rwlock_unlock(&context->tree_lock);
 	}
-	pthread_mutex_unlock(&context->global_lock);
+	fuse_reply_none(req);
+}
+
+/* batched forgets take the tree lock at most once, only when some item loses its last reference */
+static void fuse_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	struct procstat_context *context = request_context(req);
+	bool locked = false;
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		item_unref_batched(context, (struct procstat_item *)(forgets[i].ino), forgets[i].nlookup, &locked);
+	if (locked)
+		pthread_rwlock_unlock(&context->tree_lock);
 	fuse_reply_none(req);
 }
 
@@ -297,41 +556,296 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
 	struct procstat_item *item;
 
 	memset(&stat, 0, sizeof(stat));
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
 	item = fuse_inode_to_item(context, ino);
 	if (!item_registered(item)) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
 	fill_item_stats(context, item, &stat);
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
 	fuse_reply_attr(req, &stat, ATTRIBUTES_TIMEOUT_SEC);
 }
 
+/*
+ * Directory listings are built once on opendir: the listed children are pinned together with
+ * their attributes, so readdir and readdirplus format replies without walking the tree. Offsets
+ * are entry indexes, and releasedir drops the pinned references.
+ */
+struct readdir_entry {
+	struct procstat_item 	*item;
+	struct stat 		stat;
+};
+
+struct readdir_snapshot {
+	size_t 			count;
+	struct readdir_entry	entries[0];
+};
+
+static bool readdir_listed(struct procstat_item *item)
+{
+	return item_registered(item) && !(item->flags & STATS_ENTRY_FLAG_AGGREGATOR);
+}
+
+static struct readdir_snapshot *readdir_snapshot_build(struct procstat_context *context,
+						       struct procstat_directory *dir)
+{
+	struct readdir_snapshot *snapshot;
+	struct procstat_item *iter;
+	size_t count = 0;
+
+	list_for_each_entry(iter, &dir->children, entry) {
+		if (readdir_listed(iter))
+			++count;
+	}
+
+	snapshot = calloc(1, sizeof(*snapshot) + count * sizeof(snapshot->entries[0]));
+	if (!snapshot)
+		return NULL;
+
+	list_for_each_entry(iter, &dir->children, entry) {
+		struct readdir_entry *entry = &snapshot->entries[snapshot->count];
+
+		if (!readdir_listed(iter))
+			continue;
+		item_get(iter);
+		entry->item = iter;
+		fill_item_stats(context, iter, &entry->stat);
+		++snapshot->count;
+	}
+	return snapshot;
+}
+
+static void readdir_snapshot_free(struct procstat_context *context, struct readdir_snapshot *snapshot)
+{
+	bool locked = false;
+	size_t i;
+
+	for (i = 0; i < snapshot->count; ++i)
+		item_unref_batched(context, snapshot->entries[i].item, 1, &locked);
+	if (locked)
+		pthread_rwlock_unlock(&context->tree_lock);
+	free(snapshot);
+}
+
+static void readdir_reply(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi, bool plus)
+{
+	struct readdir_snapshot *snapshot = (struct readdir_snapshot *)fi->fh;
+	size_t offset = 0;
+	char *buffer;
+	size_t i;
+
+	if (!snapshot) {
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+
+	if (off < 0 || (size_t)off >= snapshot->count) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	buffer = malloc(size);
+	if (!buffer) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	for (i = off; i < snapshot->count; ++i) {
+		struct readdir_entry *entry = &snapshot->entries[i];
+		const char *fname = procstat_item_name(entry->item);
+		size_t entry_size;
+
+		if (plus) {
+			struct fuse_entry_param fuse_entry;
+
+			memset(&fuse_entry, 0, sizeof(fuse_entry));
+			fuse_entry.ino = (uintptr_t)entry->item;
+			fuse_entry.attr = entry->stat;
+			fuse_entry.attr_timeout = ATTRIBUTES_TIMEOUT_SEC;
+			fuse_entry.entry_timeout = item_entry_timeout(entry->item);
+			entry_size = fuse_add_direntry_plus(req, buffer + offset, size - offset, fname,
+							    &fuse_entry, i + 1);
+		} else {
+			entry_size = fuse_add_direntry(req, buffer + offset, size - offset, fname,
+						       &entry->stat, i + 1);
+		}
+		if (entry_size > size - offset)
+			break;
+		/* every entry returned by readdirplus counts as a lookup, balanced by forget */
+		if (plus)
+			item_get(entry->item);
+		offset += entry_size;
+	}
+
+	fuse_reply_buf(req, buffer, offset);
+	free(buffer);
+}
+
+static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	readdir_reply(req, size, off, fi, false);
+}
+
+static void fuse_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	readdir_reply(req, size, off, fi, true);
+}
+
 static void fuse_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	struct procstat_context *context = request_context(req);
+	struct readdir_snapshot *snapshot;
 	struct procstat_item *item;
 
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
 	item = fuse_inode_to_item(context, ino);
 
 	if (!item_registered(item)) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		fuse_reply_err(req, ENOENT);
 		return;
 	}
-	++item->refcnt;
-	pthread_mutex_unlock(&context->global_lock);
-	fi->fh = 0;
+
+	snapshot = readdir_snapshot_build(context, (struct procstat_directory *)item);
+	if (!snapshot) {
+		pthread_rwlock_unlock(&context->tree_lock);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	item_get(item);
+	pthread_rwlock_unlock(&context->tree_lock);
+	fi->fh = (uint64_t)snapshot;
 	fuse_reply_open(req, fi);
 }
 
-static void fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
-		       size_t size, off_t off, struct fuse_file_info *fi)
+/*
+ * Dropping the cached pages of an inode waits for the page locks held by reads in flight, and a
+ * read may be waiting for the very thread that serves the single threaded loop. Handlers queue
+ * the inode instead, and the invalidations are sent by a helper thread started on mount. Queued
+ * items are pinned until their invalidation was sent.
+ */
+struct inode_invalidation {
+	struct inode_invalidation *next;
+	struct procstat_item 	  *item;
+};
+
+struct inode_invalidator {
+	pthread_t 		  thread;
+	pthread_mutex_t 	  lock;
+	pthread_cond_t 		  cond;
+	struct inode_invalidation *queue;
+	bool 			  stop;
+};
+
+static void *inode_invalidator_run(void *arg)
+{
+	struct procstat_context *context = arg;
+	struct inode_invalidator *invalidator = context->invalidator;
+	struct inode_invalidation *queue;
+	bool stop;
+
+	pthread_mutex_lock(&invalidator->lock);
+	do {
+		while (!invalidator->queue && !invalidator->stop)
+			pthread_cond_wait(&invalidator->cond, &invalidator->lock);
+		queue = invalidator->queue;
+		invalidator->queue = NULL;
+		stop = invalidator->stop;
+		pthread_mutex_unlock(&invalidator->lock);
+
+		while (queue) {
+			struct inode_invalidation *next = queue->next;
+			struct procstat_item *item = queue->item;
+
+			/* nothing is served past the stop, the pages go away with the unmount */
+			if (!stop)
+				fuse_lowlevel_notify_inval_inode(context->session, (uintptr_t)item, 0, 0);
+			if (!item_put_unless_last(item, 1)) {
+				pthread_rwlock_wrlock(&context->tree_lock);
+				item_unref_locked(item, 1);
+				pthread_rwlock_unlock(&context->tree_lock);
+			}
+			free(queue);
+			queue = next;
+		}
+		pthread_mutex_lock(&invalidator->lock);
+	} while (!stop);
+	pthread_mutex_unlock(&invalidator->lock);
+	return NULL;
+}
+
+static void inode_invalidator_start(struct procstat_context *context)
+{
+	struct inode_invalidator *invalidator;
+	sigset_t all, old;
+	int error;
+
+	invalidator = calloc(1, sizeof(*invalidator));
+	if (!invalidator)
+		return;
+	pthread_mutex_init(&invalidator->lock, NULL);
+	pthread_cond_init(&invalidator->cond, NULL);
+	context->invalidator = invalidator;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	error = pthread_create(&invalidator->thread, NULL, inode_invalidator_run, context);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error) {
+		context->invalidator = NULL;
+		pthread_cond_destroy(&invalidator->cond);
+		pthread_mutex_destroy(&invalidator->lock);
+		free(invalidator);
+	}
+}
+
+/* must be called without the tree lock, the pending items are released */
+static void inode_invalidator_stop(struct procstat_context *context)
+{
+	struct inode_invalidator *invalidator = context->invalidator;
+
+	if (!invalidator)
+		return;
+
+	pthread_mutex_lock(&invalidator->lock);
+	invalidator->stop = true;
+	pthread_cond_signal(&invalidator->cond);
+	pthread_mutex_unlock(&invalidator->lock);
+	pthread_join(invalidator->thread, NULL);
+
+	context->invalidator = NULL;
+	pthread_cond_destroy(&invalidator->cond);
+	pthread_mutex_destroy(&invalidator->lock);
+	free(invalidator);
+}
+
+/* @item must be pinned by the caller */
+static void queue_inode_invalidation(struct procstat_context *context, struct procstat_item *item)
+{
+	struct inode_invalidator *invalidator = context->invalidator;
+	struct inode_invalidation *invalidation;
+
+	if (!invalidator)
+		return;
+	invalidation = malloc(sizeof(*invalidation));
+	if (!invalidation)
+		return;
+
+	item_get(item);
+	invalidation->item = item;
+	pthread_mutex_lock(&invalidator->lock);
+	invalidation->next = invalidator->queue;
+	invalidator->queue = invalidation;
+	pthread_cond_signal(&invalidator->cond);
+	pthread_mutex_unlock(&invalidator->lock);
+}
+
+static void write_item(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size)
 {
+	struct procstat_context *context = request_context(req);
 	struct procstat_file *file = fuse_inode_to_file(ino);
 	int num_objects;
 
@@ -342,79 +856,30 @@ static void fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 
 	num_objects = file->writer(file->private, file->arg, (char *)buf, size);
 	/* we currently only support single format parameter */
-	if (num_objects == 1)
-		fuse_reply_write(req, size);
-	else
+	if (num_objects != 1) {
 		fuse_reply_err(req, EINVAL);
-	return;
-}
-
-#define DEFAULT_BUFER_SIZE 1024
-static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
-{
-	struct procstat_context *context = request_context(req);
-	static struct procstat_directory *dir;
-	static struct procstat_item *iter;
-	char *reply_buffer = NULL;
-	size_t bufsize;
-	size_t offset;
-	int alloc_factor = 0;
-
-	pthread_mutex_lock(&context->global_lock);
-	dir = fuse_inode_to_dir(context, ino);
-
-	if (!item_registered(&dir->base)) {
-		pthread_mutex_unlock(&context->global_lock);
-		fuse_reply_err(req, ENOENT);
 		return;
 	}
+	fuse_reply_write(req, size);
 
-	/* FIXME: currently it is very naive implementation which requires lots of reallocations
-	 * this can be improved with iovec. */
-	/**
-	 * FIXME: This is very inefficient since for every lookup this is called twice with offset 0 and with
-	 * offset past last, We need to "rebuild" it and save it between "opendir" and "releasedir"
-	 */
+	/* cached pages and size of the new value are dropped outside of the handler */
+	if (file->base.flags & STATS_ENTRY_FLAG_CACHEABLE)
+		queue_inode_invalidation(context, &file->base);
+}
 
-	bufsize = 0;
-	offset = 0;
-	list_for_each_entry(iter, &dir->children, entry) {
-		const char *fname;
-		size_t entry_size;
-		struct stat stat;
+static void fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+		       size_t size, off_t off, struct fuse_file_info *fi)
+{
+	write_item(req, ino, buf, size);
+}
 
-		if (!item_registered(iter))
-			continue;
-		if (iter->flags & STATS_ENTRY_FLAG_AGGREGATOR)
-			continue;
-		memset(&stat, 0, sizeof(stat));
-		fname = procstat_item_name(iter);
-		fill_item_stats(context, iter, &stat);
-		entry_size = fuse_add_direntry(req, NULL, 0, fname, NULL, 0);
-		if (bufsize <= entry_size + offset) {
-			bufsize = DEFAULT_BUFER_SIZE * (1 << alloc_factor);
-			char *new_buffer = realloc(reply_buffer, bufsize);
-
-			++alloc_factor;
-			if (!new_buffer) {
-				pthread_mutex_unlock(&context->global_lock);
-				fuse_reply_err(req, ENOMEM);
-				goto done;
-			}
-			reply_buffer = new_buffer;
-		}
-		fuse_add_direntry(req, reply_buffer + offset, entry_size, fname, &stat, offset + entry_size);
-		offset += entry_size;
-	}
+/* without splice reads the written data always arrives in a single memory buffer */
+static void fuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+			   off_t off, struct fuse_file_info *fi)
+{
+	struct fuse_buf *buf = &bufv->buf[bufv->idx];
 
-	pthread_mutex_unlock(&context->global_lock);
-	if (off < offset)
-		fuse_reply_buf(req, reply_buffer + off, MIN(size, offset - off));
-	else
-		fuse_reply_buf(req, NULL, 0);
-done:
-	free(reply_buffer);
-	return;
+	write_item(req, ino, (const char *)buf->mem + bufv->off, buf->size - bufv->off);
 }
 
 static bool allowed_open(struct procstat_item *item, struct fuse_file_info *fi)
@@ -429,13 +894,73 @@ static bool allowed_open(struct procstat_item *item, struct fuse_file_info *fi)
 	return false;
 }
 
-#define READ_BUFFER_SIZE 100
+/*
+ * Per open output of a file, formatted on the first read and served in slices to the following
+ * reads. Values start in @inline_buffer, and as formatters return the length of the whole value
+ * like snprintf does, a truncated value is formatted again into a buffer of that size. The pool
+ * threads may serve several reads of one handle at once, so reads hold @lock.
+ */
 struct read_struct {
-	ssize_t size;
-	char buffer[READ_BUFFER_SIZE];
-	void *ext;
+	ssize_t 	size;
+	size_t 		capacity;
+	char 		*buffer;
+	void 		*ext;
+	pthread_mutex_t lock;
+	char 		inline_buffer[READ_BUFFER_SIZE];
 };
 
+static void read_struct_init(struct read_struct *rs)
+{
+	rs->size = -1;
+	rs->capacity = sizeof(rs->inline_buffer);
+	rs->buffer = rs->inline_buffer;
+	rs->ext = NULL;
+	pthread_mutex_init(&rs->lock, NULL);
+}
+
+static void read_struct_free(struct read_struct *rs)
+{
+	if (rs->buffer != rs->inline_buffer)
+		free(rs->buffer);
+	free(rs->ext);
+	pthread_mutex_destroy(&rs->lock);
+	free(rs);
+}
+
+static int read_struct_format(struct read_struct *rs, struct procstat_file *file)
+{
+	ssize_t size;
+
+	for (;;) {
+		size_t capacity;
+		char *buffer;
+
+		size = file->fmt(file->private, file->arg, rs->buffer, rs->capacity);
+		if (size < 0 || (size_t)size < rs->capacity || rs->capacity == READ_BUFFER_MAX_SIZE)
+			break;
+
+		/* doubling bounds the retries of formatters that only report the length they were given */
+		capacity = MIN(MAX(size + 1, 2 * rs->capacity), READ_BUFFER_MAX_SIZE);
+		buffer = malloc(capacity);
+		if (!buffer)
+			return ENOMEM;
+		if (rs->buffer != rs->inline_buffer)
+			free(rs->buffer);
+		rs->buffer = buffer;
+		rs->capacity = capacity;
+	}
+
+	rs->size = MIN(MAX(size, 0), (ssize_t)rs->capacity);
+	return 0;
+}
+
+/* the arg of aggregator files holds the output mode and format */
+#define AGGREGATOR_ARG(mode, format) ((uint64_t)(mode) | ((uint64_t)(format) << 8))
+#define AGGREGATOR_MODE(arg) ((enum procstat_aggregator_mode)((arg) & 0xff))
+#define AGGREGATOR_FORMAT(arg) ((enum procstat_aggregator_format)((arg) >> 8))
+
+static int aggregator_snapshot_build(struct procstat_context *context, struct procstat_file *aggregator,
+				     struct read_struct *rs);
 static void fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	struct procstat_context *context = request_context(req);
@@ -449,7 +974,7 @@ static void fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 		return;
 	}
 
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
 	item = (struct procstat_item *)(ino);
 
 	if (!item_registered(item))
@@ -458,23 +983,44 @@ static void fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	if (!allowed_open(item, fi))
 		goto out_locked;
 
-	read_buffer->ext = NULL;
+	read_struct_init(read_buffer);
 	fi->fh = (uint64_t)read_buffer;
 
-	/* we dont know size of file in advance so use directio*/
-	fi->direct_io = true;
+	/*
+	 * we dont know size of file in advance so use directio, unless the file is cacheable and its
+	 * pages stay valid until the value changes
+	 */
+	if (item->flags & STATS_ENTRY_FLAG_CACHEABLE)
+		fi->keep_cache = true;
+	else
+		fi->direct_io = true;
 
-	++item->refcnt;
+	item_get(item);
 	if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
-		++item->parent->base.refcnt;
+		item_get(&item->parent->base);
 
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
+
+	if ((item->flags & STATS_ENTRY_FLAG_AGGREGATOR) &&
+	    AGGREGATOR_MODE(container_of(item, struct procstat_file, base)->arg) != PROCSTAT_AGGREGATOR_STREAM) {
+		ret = aggregator_snapshot_build(context, container_of(item, struct procstat_file, base),
+						read_buffer);
+		if (ret) {
+			pthread_rwlock_wrlock(&context->tree_lock);
+			item_unref_locked(&item->parent->base, 1);
+			item_unref_locked(item, 1);
+			pthread_rwlock_unlock(&context->tree_lock);
+			read_struct_free(read_buffer);
+			fuse_reply_err(req, ret);
+			return;
+		}
+	}
 	fuse_reply_open(req, fi);
 
 	return;
 
 out_locked:
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
 	free(read_buffer);
 	fuse_reply_err(req, ret);
 }
@@ -579,6 +1125,7 @@ static void aggregator_read(fuse_req_t req, struct procstat_file *file, struct r
 	struct procstat_directory *dir = file->base.parent;
 	struct list_head *last = &dir->children;
 	struct list_head *self = &file->base.entry;
+	struct procstat_item *orphan = NULL;
 	struct out_stream out;
 	char path[MAX_PATH_LEN];
 
@@ -628,17 +1175,19 @@ static void aggregator_read(fuse_req_t req, struct procstat_file *file, struct r
 	/*
 	 * While the aggregator node is open, the node and the parent directory node cannot be freed, so setting "last" above was safe.
 	 */
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
 
 	if (!as->c.current) {
 		as->c.current = dir->children.next;
 	} else if (as->c.current != last) {
 		struct procstat_item *current = container_of(as->c.current, struct procstat_item, entry);
-		--current->refcnt;
+
 		/* If this node has been deleted it is removed from parent's children list */
-		if (list_empty(&current->entry)) {
+		if (list_empty(&current->entry))
 			as->c.current = last;
-		}
+		/* the last reference of a deleted node is dropped once the read lock is released */
+		if (!item_put_unless_last(current, 1))
+			orphan = current;
 	}
 
 	for (; as->c.current != last; as->c.current = as->c.current->next) {
@@ -667,29 +1216,669 @@ static void aggregator_read(fuse_req_t req, struct procstat_file *file, struct r
 
 	/* Protect the current item from being freed, so we can safely access it next time */
 	if (as->c.current != last)
-		++(container_of(as->c.current, struct procstat_item, entry)->refcnt);
+		item_get(container_of(as->c.current, struct procstat_item, entry));
 
 	as->c.off += out.total;
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
+	if (orphan) {
+		pthread_rwlock_wrlock(&context->tree_lock);
+		item_unref_locked(orphan, 1);
+		pthread_rwlock_unlock(&context->tree_lock);
+	}
 	fuse_reply_buf(req, &out.buf[0], out.total);
 }
 
-static void aggregator_release_locked(struct procstat_item *item, struct fuse_file_info *fi)
-{
-	struct read_struct *rs = (struct read_struct *)fi->fh;
+/*
+ * Snapshot aggregators format the tree once per open into the read buffer of the handle, so reads
+ * can come at any offset and all of them see the same generation of values. The files are only
+ * collected and pinned under the tree lock, formatting takes the lock for a batch of files at a
+ * time so that registration is not stalled behind a large tree, and big trees are formatted by
+ * several threads.
+ */
+#define AGGREGATOR_BATCH_SIZE 256
+#define AGGREGATOR_FILES_PER_THREAD 4096
+#define AGGREGATOR_MAX_THREADS 8
+#define AGGREGATOR_TRAILER_SIZE 4
+
+struct aggregator_entry {
+	struct procstat_item 	*item;  /* a file, or a histogram directory output as one entry */
+	size_t 			prefix; /* offset of the prefix of the format in the prefixes arena */
+	uint64_t 		key;    /* hashes of the prefix and of the formatted value, 0 if not formatted */
+	uint64_t 		value;
+};
 
-	if (rs) {
-		struct aggregator_struct *as = (struct aggregator_struct *)rs->ext;
+/*
+ * Changes aggregators keep a cursor with the hashes of the values of the last complete read, keyed
+ * by the hashes of their paths, and output only the lines whose value hash differs. The values of
+ * a read are committed to the cursor on release, in case the whole output was read.
+ */
+struct aggregator_value {
+	uint64_t key;
+	uint64_t value;
+};
+
+struct aggregator_values {
+	bool 			complete;
+	size_t 			mask;
+	struct aggregator_value slots[0];
+};
+
+struct aggregator_cursor {
+	pthread_mutex_t 	 lock;
+	struct aggregator_values *values;
+};
+
+static uint64_t aggregator_hash(const char *data, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	/* 0 marks empty slots and entries that were not formatted */
+	return hash ? hash : 1;
+}
+
+static struct aggregator_value *aggregator_values_slot(struct aggregator_values *values, uint64_t key)
+{
+	size_t i = key & values->mask;
+
+	while (values->slots[i].key && values->slots[i].key != key)
+		i = (i + 1) & values->mask;
+	return &values->slots[i];
+}
+
+struct aggregator_snapshot {
+	enum procstat_aggregator_format format;
+	bool 			raw; /* text snapshot of "dir/name" prefixes with histograms as one entry */
+	struct aggregator_entry *entries;
+	size_t 			count;
+	size_t 			capacity;
+	char 			*prefixes;
+	size_t 			prefixes_size;
+	size_t 			prefixes_capacity;
+};
+
+struct aggregator_chunk {
+	struct procstat_context 	*context;
+	enum procstat_aggregator_format format;
+	struct aggregator_entry 	*entries;
+	size_t 				count;
+	const char 			*prefixes;
+	struct aggregator_values 	*previous;
+	char 				*buf;
+	size_t 				size;
+	size_t 				capacity;
+	int 				error;
+	bool 				threaded;
+	pthread_t 			thread;
+};
+
+/*
+ * Histogram directories are output as a single entry of their raw buckets by the JSON and
+ * Prometheus formats. Every bucket up to the highest non empty one is output, so the set of
+ * bucket bounds of a histogram only grows between scrapes.
+ */
+#define AGGREGATOR_HISTOGRAM_FLAGS \
+	(STATS_ENTRY_FLAG_HISTOGRAM | STATS_ENTRY_FLAG_HISTOGRAM_U64 | STATS_ENTRY_FLAG_SHARDED_HISTOGRAM)
+
+struct histogram_bucket {
+	uint64_t le;    /* largest value counted by the bucket */
+	uint64_t count; /* cumulative number of samples up to @le */
+};
+
+static ssize_t histogram_export(struct procstat_item *item, uint64_t *sum, struct histogram_bucket **buckets,
+				bool dense_layout);
+
+/* @out must have room for 6 * @len bytes */
+static size_t json_escape(char *out, const char *raw, size_t len)
+{
+	size_t pos = 0;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		unsigned char c = raw[i];
+
+		if (c == '"' || c == '\\') {
+			out[pos++] = '\\';
+			out[pos++] = c;
+		} else if (c < 0x20) {
+			pos += sprintf(&out[pos], "\\u%04x", c);
+		} else {
+			out[pos++] = c;
+		}
+	}
+	return pos;
+}
+
+/* Prometheus metric names match [a-zA-Z_:][a-zA-Z0-9_:]*, @out must have room for @len + 1 bytes */
+static size_t prometheus_name(char *out, const char *raw, size_t len)
+{
+	size_t pos = 0;
+	size_t i;
+
+	if (len && isdigit((unsigned char)raw[0]))
+		out[pos++] = '_';
+	for (i = 0; i < len; ++i)
+		out[pos++] = (isalnum((unsigned char)raw[i]) || raw[i] == ':') ? raw[i] : '_';
+	return pos;
+}
+
+/*
+ * The prefix of an entry is "path/name:" for the text format, "\"path/name\":" for JSON and the
+ * metric name for Prometheus, which gets suffixes for histograms.
+ */
+static int aggregator_snapshot_add(struct aggregator_snapshot *snapshot, const char *path,
+				   struct procstat_item *item)
+{
+	const char *fname = procstat_item_name(item);
+	size_t raw_len = strlen(path) + strlen(fname) + 1;
+	size_t prefix_len;
+	char raw[raw_len + 1];
+	char *prefix;
+
+	if (snapshot->count == snapshot->capacity) {
+		size_t capacity = MAX(2 * snapshot->capacity, 64);
+		struct aggregator_entry *entries;
+
+		entries = realloc(snapshot->entries, capacity * sizeof(*entries));
+		if (!entries)
+			return ENOMEM;
+		snapshot->entries = entries;
+		snapshot->capacity = capacity;
+	}
+
+	/* room for the escaped path, quotes and colon */
+	if (snapshot->prefixes_capacity - snapshot->prefixes_size < 6 * raw_len + 4) {
+		size_t capacity = MAX(2 * snapshot->prefixes_capacity, snapshot->prefixes_size + 6 * raw_len + 4096);
+		char *prefixes;
+
+		prefixes = realloc(snapshot->prefixes, capacity);
+		if (!prefixes)
+			return ENOMEM;
+		snapshot->prefixes = prefixes;
+		snapshot->prefixes_capacity = capacity;
+	}
+
+	prefix = &snapshot->prefixes[snapshot->prefixes_size];
+	switch (snapshot->format) {
+	case PROCSTAT_FORMAT_JSON:
+		/* files directly under the aggregator directory have an empty path */
+		raw_len = sprintf(raw, path[0] ? "%s/%s" : "%s%s", path, fname);
+		prefix[0] = '"';
+		prefix_len = 1 + json_escape(&prefix[1], raw, raw_len);
+		prefix[prefix_len++] = '"';
+		prefix[prefix_len++] = ':';
+		break;
+	case PROCSTAT_FORMAT_PROMETHEUS:
+		raw_len = sprintf(raw, path[0] ? "%s/%s" : "%s%s", path, fname);
+		prefix_len = prometheus_name(prefix, raw, raw_len);
+		break;
+	default:
+		if (snapshot->raw)
+			prefix_len = sprintf(prefix, path[0] ? "%s/%s" : "%s%s", path, fname);
+		else
+			prefix_len = sprintf(prefix, "%s/%s:", path, fname);
+		break;
+	}
+	prefix[prefix_len] = 0;
+
+	snapshot->entries[snapshot->count].item = item;
+	snapshot->entries[snapshot->count].prefix = snapshot->prefixes_size;
+	snapshot->entries[snapshot->count].key = aggregator_hash(prefix, prefix_len);
+	snapshot->entries[snapshot->count].value = 0;
+	snapshot->prefixes_size += prefix_len + 1;
+	++snapshot->count;
+	item_get(item);
+	return 0;
+}
+
+/* collect the files under @dir in the order out_item() emits them */
+static int aggregator_collect_locked(struct aggregator_snapshot *snapshot, char *path,
+				     struct procstat_directory *dir, struct procstat_item *self)
+{
+	struct procstat_item *child;
+	int error = 0;
+
+	list_for_each_entry(child, &dir->children, entry) {
+		if (child == self || !item_registered(child))
+			continue;
+
+		if (item_type_directory(child) && (child->flags & AGGREGATOR_HISTOGRAM_FLAGS) &&
+		    (snapshot->format != PROCSTAT_FORMAT_TEXT || snapshot->raw)) {
+			error = aggregator_snapshot_add(snapshot, path, child);
+		} else if (item_type_directory(child)) {
+			int path_len = strlen(path);
+			int pos = path_len;
+			int p_space = MAX_PATH_LEN - path_len;
+
+			if (pos && p_space) {
+				path[pos++] = '/';
+				--p_space;
+			}
+			strncpy(path + pos, procstat_item_name(child), p_space);
+			path[MAX_PATH_LEN - 1] = 0;
+			error = aggregator_collect_locked(snapshot, path, (struct procstat_directory *)child, self);
+			path[path_len] = 0;
+		} else if (container_of(child, struct procstat_file, base)->fmt) {
+			error = aggregator_snapshot_add(snapshot, path, child);
+		}
+		if (error)
+			break;
+	}
+	return error;
+}
+
+static int aggregator_chunk_reserve(struct aggregator_chunk *chunk, size_t size)
+{
+	size_t capacity;
+	char *buf;
+
+	if (chunk->capacity - chunk->size >= size)
+		return 0;
+
+	capacity = MAX(2 * chunk->capacity, chunk->size + size + 4096);
+	buf = realloc(chunk->buf, capacity);
+	if (!buf)
+		return ENOMEM;
+	chunk->buf = buf;
+	chunk->capacity = capacity;
+	return 0;
+}
+
+/* strips the whitespace around the formatted value, e.g. the trailing newline */
+static size_t aggregator_trim(char *value, size_t len)
+{
+	size_t begin = 0;
+
+	while (len && isspace((unsigned char)value[len - 1]))
+		--len;
+	while (begin < len && isspace((unsigned char)value[begin]))
+		++begin;
+	memmove(value, &value[begin], len - begin);
+	return len - begin;
+}
+
+/* JSON number grammar, which the Prometheus text format accepts as well */
+static bool aggregator_is_number(const char *value, size_t len)
+{
+	size_t i = (len && value[0] == '-');
+
+	if (i == len || !isdigit((unsigned char)value[i]))
+		return false;
+	if (value[i] == '0')
+		++i;
+	else
+		while (i < len && isdigit((unsigned char)value[i]))
+			++i;
+	if (i < len && value[i] == '.') {
+		if (++i == len || !isdigit((unsigned char)value[i]))
+			return false;
+		while (i < len && isdigit((unsigned char)value[i]))
+			++i;
+	}
+	if (i < len && (value[i] == 'e' || value[i] == 'E')) {
+		if (++i < len && (value[i] == '+' || value[i] == '-'))
+			++i;
+		if (i == len || !isdigit((unsigned char)value[i]))
+			return false;
+		while (i < len && isdigit((unsigned char)value[i]))
+			++i;
+	}
+	return i == len;
+}
+
+/* sets @written to the number of bytes output at the end of @chunk, left 0 in case the value is dropped */
+static int aggregator_format_file(struct aggregator_chunk *chunk, struct procstat_file *file,
+				  const char *prefix, size_t *written)
+{
+	size_t prefix_len = strlen(prefix) + (chunk->format == PROCSTAT_FORMAT_PROMETHEUS);
+	ssize_t len;
+	char *value;
+	char *raw;
+
+	if (aggregator_chunk_reserve(chunk, prefix_len + READ_BUFFER_SIZE))
+		return ENOMEM;
+	memcpy(&chunk->buf[chunk->size], prefix, prefix_len);
+	if (chunk->format == PROCSTAT_FORMAT_PROMETHEUS)
+		chunk->buf[chunk->size + prefix_len - 1] = ' ';
+
+	for (;;) {
+		size_t space = chunk->capacity - chunk->size - prefix_len;
+
+		len = file->fmt(file->private, file->arg, &chunk->buf[chunk->size + prefix_len], space);
+		if (len < 0)
+			return 0; /* the line is dropped */
+		if ((size_t)len < space)
+			break;
+		/* like FUSE reads, values are bounded, which also stops formatters reporting the space given */
+		if ((size_t)len >= READ_BUFFER_MAX_SIZE)
+			return EFBIG;
+		if (aggregator_chunk_reserve(chunk, prefix_len + len + 1))
+			return ENOMEM;
+	}
+
+	if (chunk->format == PROCSTAT_FORMAT_TEXT) {
+		*written = prefix_len + len;
+		return 0;
+	}
+
+	len = aggregator_trim(&chunk->buf[chunk->size + prefix_len], len);
+	if (!aggregator_is_number(&chunk->buf[chunk->size + prefix_len], len)) {
+		/* Prometheus has no string values, JSON gets the value as a string */
+		if (chunk->format == PROCSTAT_FORMAT_PROMETHEUS)
+			return 0;
+		if (aggregator_chunk_reserve(chunk, prefix_len + 6 * len + 4))
+			return ENOMEM;
+		value = &chunk->buf[chunk->size + prefix_len];
+		raw = strndup(value, len);
+		if (!raw)
+			return ENOMEM;
+		value[0] = '"';
+		len = 1 + json_escape(&value[1], raw, len);
+		value[len++] = '"';
+		free(raw);
+	} else if (chunk->format == PROCSTAT_FORMAT_PROMETHEUS) {
+		/* numbers are output as gauges, the TYPE line goes in front of the sample */
+		size_t type_len = sizeof("# TYPE  gauge\n") - 1 + prefix_len - 1;
+
+		if (aggregator_chunk_reserve(chunk, type_len + prefix_len + len + 1))
+			return ENOMEM;
+		memmove(&chunk->buf[chunk->size + type_len], &chunk->buf[chunk->size], prefix_len + len);
+		sprintf(&chunk->buf[chunk->size], "# TYPE %.*s gauge", (int)(prefix_len - 1), prefix);
+		chunk->buf[chunk->size + type_len - 1] = '\n';
+		prefix_len += type_len;
+	} else if (aggregator_chunk_reserve(chunk, prefix_len + len + 2)) {
+		return ENOMEM;
+	}
+
+	value = &chunk->buf[chunk->size + prefix_len];
+	if (chunk->format == PROCSTAT_FORMAT_JSON)
+		value[len++] = ',';
+	value[len++] = '\n';
+	*written = prefix_len + len;
+	return 0;
+}
+
+static int aggregator_format_histogram(struct aggregator_chunk *chunk, struct procstat_item *item,
+				       const char *name, size_t *written)
+{
+	struct histogram_bucket *buckets;
+	uint64_t count = 0;
+	uint64_t sum;
+	ssize_t nbuckets;
+	size_t name_len = strlen(name);
+	char *out;
+	int pos = 0;
+	ssize_t i;
+
+	nbuckets = histogram_export(item, &sum, &buckets, true);
+	if (nbuckets < 0)
+		return ENOMEM;
+	if (nbuckets)
+		count = buckets[nbuckets - 1].count;
+
+	/* 20 digits per u64 number */
+	if (aggregator_chunk_reserve(chunk, (name_len + 64) * (nbuckets + 4))) {
+		free(buckets);
+		return ENOMEM;
+	}
+	out = &chunk->buf[chunk->size];
+
+	if (chunk->format == PROCSTAT_FORMAT_JSON) {
+		pos += sprintf(&out[pos], "%s{\"count\":%lu,\"sum\":%lu,\"buckets\":[", name, count, sum);
+		for (i = 0; i < nbuckets; ++i)
+			pos += sprintf(&out[pos], "%s[%lu,%lu]", i ? "," : "", buckets[i].le, buckets[i].count);
+		pos += sprintf(&out[pos], "]},\n");
+	} else {
+		pos += sprintf(&out[pos], "# TYPE %s histogram\n", name);
+		for (i = 0; i < nbuckets; ++i)
+			pos += sprintf(&out[pos], "%s_bucket{le=\"%lu\"} %lu\n", name, buckets[i].le, buckets[i].count);
+		pos += sprintf(&out[pos], "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+		pos += sprintf(&out[pos], "%s_sum %lu\n%s_count %lu\n", name, sum, name, count);
+	}
+	free(buckets);
+	*written = pos;
+	return 0;
+}
+
+static int aggregator_chunk_format(struct aggregator_chunk *chunk, struct aggregator_entry *entry)
+{
+	const char *prefix = &chunk->prefixes[entry->prefix];
+	size_t written = 0;
+	int error;
+
+	if (item_type_directory(entry->item))
+		error = aggregator_format_histogram(chunk, entry->item, prefix, &written);
+	else
+		error = aggregator_format_file(chunk, container_of(entry->item, struct procstat_file, base),
+					       prefix, &written);
+	if (error || !written)
+		return error;
+
+	entry->value = aggregator_hash(&chunk->buf[chunk->size], written);
+	if (chunk->previous && aggregator_values_slot(chunk->previous, entry->key)->value == entry->value)
+		return 0; /* unchanged since the last complete read */
+	chunk->size += written;
+	return 0;
+}
+
+static void *aggregator_chunk_run(void *arg)
+{
+	struct aggregator_chunk *chunk = arg;
+	size_t i = 0;
+
+	while (i < chunk->count && !chunk->error) {
+		size_t end = MIN(i + AGGREGATOR_BATCH_SIZE, chunk->count);
+
+		pthread_rwlock_rdlock(&chunk->context->tree_lock);
+		for (; i < end && !chunk->error; ++i) {
+			/* files removed since the collection may have their objects freed already */
+			if (item_registered(chunk->entries[i].item))
+				chunk->error = aggregator_chunk_format(chunk, &chunk->entries[i]);
+		}
+		pthread_rwlock_unlock(&chunk->context->tree_lock);
+	}
+	return NULL;
+}
+
+static int aggregator_snapshot_format(struct procstat_context *context, struct aggregator_snapshot *snapshot,
+				      struct aggregator_values *previous, struct read_struct *rs)
+{
+	struct aggregator_chunk chunks[AGGREGATOR_MAX_THREADS];
+	size_t nchunks = snapshot->count / AGGREGATOR_FILES_PER_THREAD + 1;
+	size_t per_chunk;
+	size_t total = 0;
+	int error = 0;
+	size_t i;
+
+	nchunks = MIN(MIN(nchunks, AGGREGATOR_MAX_THREADS), (size_t)get_nprocs());
+	per_chunk = (snapshot->count + nchunks - 1) / nchunks;
+	memset(chunks, 0, sizeof(chunks));
+	for (i = 0; i < nchunks; ++i) {
+		size_t begin = MIN(i * per_chunk, snapshot->count);
+
+		chunks[i].context = context;
+		chunks[i].format = snapshot->format;
+		chunks[i].entries = &snapshot->entries[begin];
+		chunks[i].count = MIN(per_chunk, snapshot->count - begin);
+		chunks[i].prefixes = snapshot->prefixes;
+		chunks[i].previous = previous;
+		if (!i && snapshot->format == PROCSTAT_FORMAT_JSON) {
+			error = aggregator_chunk_reserve(&chunks[i], 2);
+			if (error)
+				goto out;
+			memcpy(chunks[i].buf, "{\n", 2);
+			chunks[i].size = 2;
+		}
+		/* the calling thread formats the first chunk itself, and any chunk left without a thread */
+		if (i)
+			chunks[i].threaded = !pthread_create(&chunks[i].thread, NULL, aggregator_chunk_run, &chunks[i]);
+	}
+	for (i = 0; i < nchunks; ++i) {
+		if (!chunks[i].threaded)
+			aggregator_chunk_run(&chunks[i]);
+	}
+
+	for (i = 0; i < nchunks; ++i) {
+		if (chunks[i].threaded)
+			pthread_join(chunks[i].thread, NULL);
+		error = error ? error : chunks[i].error;
+		total += chunks[i].size;
+	}
+	if (error)
+		goto out;
+
+	if (nchunks == 1 && chunks[0].buf) {
+		/* room for closing the JSON object */
+		error = aggregator_chunk_reserve(&chunks[0], AGGREGATOR_TRAILER_SIZE);
+		if (error)
+			goto out;
+		rs->buffer = chunks[0].buf;
+		rs->capacity = chunks[0].capacity;
+		chunks[0].buf = NULL;
+	} else {
+		if (total + AGGREGATOR_TRAILER_SIZE > rs->capacity) {
+			rs->buffer = malloc(total + AGGREGATOR_TRAILER_SIZE);
+			if (!rs->buffer) {
+				rs->buffer = rs->inline_buffer;
+				error = ENOMEM;
+				goto out;
+			}
+			rs->capacity = total + AGGREGATOR_TRAILER_SIZE;
+		}
+		for (i = 0, total = 0; i < nchunks; ++i) {
+			if (chunks[i].size)
+				memcpy(&rs->buffer[total], chunks[i].buf, chunks[i].size);
+			total += chunks[i].size;
+		}
+	}
+	/* the entries of the JSON object end with ",\n", the last one loses its comma */
+	if (snapshot->format == PROCSTAT_FORMAT_JSON) {
+		if (total > 2 && rs->buffer[total - 2] == ',')
+			total -= 2;
+		total += sprintf(&rs->buffer[total], total > 2 ? "\n}\n" : "}\n");
+	}
+	rs->size = total;
+out:
+	for (i = 0; i < nchunks; ++i)
+		free(chunks[i].buf);
+	return error;
+}
+
+/* the values of this read are kept in @rs->ext until release commits them to the cursor */
+static int aggregator_values_build(struct aggregator_snapshot *snapshot, struct read_struct *rs)
+{
+	struct aggregator_values *values;
+	size_t buckets = 16;
+	size_t i;
+
+	while (buckets < 2 * snapshot->count)
+		buckets *= 2;
+	values = calloc(1, sizeof(*values) + buckets * sizeof(values->slots[0]));
+	if (!values)
+		return ENOMEM;
+	values->mask = buckets - 1;
+
+	for (i = 0; i < snapshot->count; ++i) {
+		struct aggregator_entry *entry = &snapshot->entries[i];
+
+		if (entry->value)
+			*aggregator_values_slot(values, entry->key) = (struct aggregator_value){entry->key, entry->value};
+	}
+	rs->ext = values;
+	return 0;
+}
+
+static void aggregator_values_commit(struct procstat_file *aggregator, struct read_struct *rs)
+{
+	struct aggregator_cursor *cursor = aggregator->private;
+	struct aggregator_values *values = rs->ext;
+
+	if (!cursor || !values || !values->complete)
+		return;
+
+	pthread_mutex_lock(&cursor->lock);
+	free(cursor->values);
+	cursor->values = values;
+	pthread_mutex_unlock(&cursor->lock);
+	rs->ext = NULL;
+}
+
+/* formats the files under @dir, but @self, into @rs. @cursor is set for changes aggregators */
+static int tree_snapshot_build(struct procstat_context *context, struct procstat_directory *dir,
+			       struct procstat_item *self, enum procstat_aggregator_format format,
+			       struct aggregator_cursor *cursor, struct read_struct *rs)
+{
+	struct aggregator_snapshot snapshot;
+	char path[MAX_PATH_LEN];
+	bool locked = false;
+	int error;
+	size_t i;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.format = format;
+	path[0] = 0;
+	/* reads of one cursor are serialized, the cursor lock is always taken before the tree lock */
+	if (cursor)
+		pthread_mutex_lock(&cursor->lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
+	error = aggregator_collect_locked(&snapshot, path, dir, self);
+	pthread_rwlock_unlock(&context->tree_lock);
+
+	if (!error)
+		error = aggregator_snapshot_format(context, &snapshot, cursor ? cursor->values : NULL, rs);
+	if (!error && cursor)
+		error = aggregator_values_build(&snapshot, rs);
+	if (cursor)
+		pthread_mutex_unlock(&cursor->lock);
+
+	for (i = 0; i < snapshot.count; ++i)
+		item_unref_batched(context, snapshot.entries[i].item, 1, &locked);
+	if (locked)
+		pthread_rwlock_unlock(&context->tree_lock);
+	free(snapshot.entries);
+	free(snapshot.prefixes);
+	return error;
+}
+
+static int aggregator_snapshot_build(struct procstat_context *context, struct procstat_file *aggregator,
+				     struct read_struct *rs)
+{
+	return tree_snapshot_build(context, aggregator->base.parent, &aggregator->base,
+				   AGGREGATOR_FORMAT(aggregator->arg), aggregator->private, rs);
+}
+
+static void free_aggregator(struct procstat_file *file)
+{
+	struct aggregator_cursor *cursor = file->private;
+
+	if (!cursor)
+		return;
+	pthread_mutex_destroy(&cursor->lock);
+	free(cursor->values);
+	free(cursor);
+}
+
+static void aggregator_release_locked(struct procstat_item *item, struct fuse_file_info *fi)
+{
+	struct read_struct *rs = (struct read_struct *)fi->fh;
+
+	/* only streaming aggregators keep an aggregator_struct in ext */
+	if (rs && AGGREGATOR_MODE(container_of(item, struct procstat_file, base)->arg) == PROCSTAT_AGGREGATOR_STREAM) {
+		struct aggregator_struct *as = (struct aggregator_struct *)rs->ext;
 
 		if (as && as->c.current) {
 			if (as->c.current != &item->parent->children) {
 				struct procstat_item *current = container_of(as->c.current, struct procstat_item, entry);
 
-				--current->refcnt;
+				item_unref_locked(current, 1);
 			}
 		}
 	}
-	--item->parent->base.refcnt;
+	item_unref_locked(&item->parent->base, 1);
 }
 
 static void fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
@@ -698,7 +1887,13 @@ static void fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 	struct procstat_file *file = fuse_inode_to_file(ino);
 
 	if (file->base.flags & STATS_ENTRY_FLAG_AGGREGATOR) {
+		/* the cursor and the output buffer in ext are reallocated by the read */
+		pthread_mutex_lock(&read_buffer->lock);
+		/* snapshot and changes aggregators were formatted on open */
+		if (AGGREGATOR_MODE(file->arg) != PROCSTAT_AGGREGATOR_STREAM)
+			goto reply;
 		aggregator_read(req, file, read_buffer, size, off);
+		pthread_mutex_unlock(&read_buffer->lock);
 		return;
 	}
 
@@ -713,15 +1908,28 @@ static void fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 		return;
 	}
 
-	if (off == 0)
-		read_buffer->size = file->fmt(file->private, file->arg, read_buffer->buffer, READ_BUFFER_SIZE);
+	/* a read at offset 0 formats again, so the slice of a concurrent read is copied under the lock */
+	pthread_mutex_lock(&read_buffer->lock);
+	if (off == 0 || read_buffer->size < 0) {
+		int error = read_struct_format(read_buffer, file);
 
-	if (off >= read_buffer->size) {
-		fuse_reply_buf(req, NULL, 0);
-		return;
+		if (error) {
+			pthread_mutex_unlock(&read_buffer->lock);
+			fuse_reply_err(req, error);
+			return;
+		}
 	}
 
-	fuse_reply_buf(req, (char *)read_buffer->buffer + off, read_buffer->size - off);
+reply:
+	/* changes aggregators commit the values on release, once the whole output was read */
+	if (read_buffer->ext && off + size >= read_buffer->size)
+		((struct aggregator_values *)read_buffer->ext)->complete = true;
+
+	if (off >= read_buffer->size)
+		fuse_reply_buf(req, NULL, 0);
+	else
+		fuse_reply_buf(req, read_buffer->buffer + off, MIN(size, read_buffer->size - off));
+	pthread_mutex_unlock(&read_buffer->lock);
 }
 
 static bool valid_filename(const char *name)
@@ -772,21 +1980,21 @@ static int register_item(struct procstat_context *context,
 			 struct procstat_item *item,
 			 struct procstat_directory *parent)
 {
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_wrlock(&context->tree_lock);
 	if (parent) {
 		struct procstat_item *duplicate;
 
 		duplicate = lookup_item_locked(parent, procstat_item_name(item), item->name_hash);
 		if (duplicate) {
-			pthread_mutex_unlock(&context->global_lock);
+			pthread_rwlock_unlock(&context->tree_lock);
 			return EEXIST;
 		}
-		list_add_tail(&item->entry, &parent->children);
+		directory_add_child_locked(parent, item);
 	}
 	item->flags |= STATS_ENTRY_FLAG_REGISTERED;
 	item->refcnt = 1;
 	item->parent = parent;
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
 	return 0;
 }
 
@@ -800,6 +2008,9 @@ static int init_directory(struct procstat_context *context,
 	init_item(&directory->base, name);
 	directory->base.flags = STATS_ENTRY_FLAG_DIR;
 	INIT_LIST_HEAD(&directory->children);
+	directory->index = NULL;
+	directory->index_mask = 0;
+	directory->nchildren = 0;
 	error = register_item(context, &directory->base, parent);
 	if (error)
 		return error;
@@ -807,32 +2018,89 @@ static int init_directory(struct procstat_context *context,
 	return 0;
 }
 
+/*
+ * Queue invalidation of the kernel dentry of @item, removed from @parent. Items holding just the
+ * registration reference were never looked up, so the kernel cannot cache them. Entries below a
+ * removed directory go away together with the dentry of the directory.
+ */
+static void queue_entry_invalidation(struct procstat_directory *parent, struct procstat_item *item)
+{
+	struct procstat_context *context = procstat_context(&parent->base);
+	struct entry_invalidation *invalidation;
+	const char *name = procstat_item_name(item);
+	size_t namelen = strlen(name);
+
+	if (!context->session || __atomic_load_n(&item->refcnt, __ATOMIC_RELAXED) <= 1)
+		return;
+
+	invalidation = malloc(sizeof(*invalidation) + namelen + 1);
+	if (!invalidation)
+		return;
+	invalidation->parent = item_to_fuse_inode(context, &parent->base);
+	invalidation->namelen = namelen;
+	memcpy(invalidation->name, name, namelen + 1);
+	invalidation->next = context->invalidations;
+	context->invalidations = invalidation;
+}
+
+/* release the tree lock taken for writing and notify the kernel of the entries removed meanwhile */
+static void tree_write_unlock(struct procstat_context *context)
+{
+	struct entry_invalidation *invalidation = context->invalidations;
+
+	context->invalidations = NULL;
+	pthread_rwlock_unlock(&context->tree_lock);
+
+	while (invalidation) {
+		struct entry_invalidation *next = invalidation->next;
+
+		fuse_lowlevel_notify_inval_entry(context->session, invalidation->parent,
+						 invalidation->name, invalidation->namelen);
+		free(invalidation);
+		invalidation = next;
+	}
+}
+
 static void item_put_locked(struct procstat_item *item);
 static void item_put_children_locked(struct procstat_directory *directory)
 {
 	struct procstat_item *iter, *n;
 	list_for_each_entry_safe(iter, n, &directory->children, entry) {
+		if (item_registered(&directory->base))
+			queue_entry_invalidation(directory, iter);
 		iter->parent = NULL;
 		item_put_locked(iter);
 	}
+
+	/* the children left without a parent, so the index is dropped in one go */
+	free(directory->index);
+	directory->index = NULL;
+	directory->index_mask = 0;
+	directory->nchildren = 0;
 }
 
 static void item_put_locked(struct procstat_item *item)
 {
-	assert(item->refcnt);
+	assert(__atomic_load_n(&item->refcnt, __ATOMIC_RELAXED));
 
 	if (!item_registered(item))
 		goto free_item;
 
-	list_del_init(&item->entry);
+	if (item->parent) {
+		queue_entry_invalidation(item->parent, item);
+		directory_del_child_locked(item->parent, item);
+	} else {
+		list_del_init(&item->entry);
+	}
 	item->flags &= ~STATS_ENTRY_FLAG_REGISTERED;
+	/* the histogram may be released by its owner right after the removal */
+	if (item->flags & (STATS_ENTRY_FLAG_HISTOGRAM | STATS_ENTRY_FLAG_HISTOGRAM_U64))
+		list_del_init(&((struct procstat_series *)item)->standby_entry);
 	if (item_type_directory(item))
 		item_put_children_locked((struct procstat_directory *)item);
 
 free_item:
-	if (--item->refcnt)
-		return;
-	free_item(item);
+	item_unref_locked(item, 1);
 }
 
 static struct procstat_item *parent_or_root(struct procstat_context *context, struct procstat_item *parent)
@@ -844,10 +2112,12 @@ static struct procstat_item *parent_or_root(struct procstat_context *context, st
 	return NULL;
 }
 
-static struct procstat_file *create_file(struct procstat_context *context,
-					 struct procstat_directory *parent,
-					 const char *name, void *item,
-					 procstats_formatter fmt, procstats_formatter writer)
+/* @flags and @arg are set before registration, as FUSE ops may read them as soon as it is visible */
+static struct procstat_file *create_file_ex(struct procstat_context *context,
+					    struct procstat_directory *parent,
+					    const char *name, void *item,
+					    procstats_formatter fmt, procstats_formatter writer,
+					    unsigned flags, uint64_t arg)
 {
 	struct procstat_file *file;
 	int error;
@@ -862,6 +2132,8 @@ static struct procstat_file *create_file(struct procstat_context *context,
 		errno = ENOMEM;
 		return NULL;
 	}
+	file->base.flags = flags;
+	file->arg = arg;
 
 	error = register_item(context,&file->base, parent);
 	if (error) {
@@ -873,6 +2145,14 @@ static struct procstat_file *create_file(struct procstat_context *context,
 	return file;
 }
 
+static struct procstat_file *create_file(struct procstat_context *context,
+					 struct procstat_directory *parent,
+					 const char *name, void *item,
+					 procstats_formatter fmt, procstats_formatter writer)
+{
+	return create_file_ex(context, parent, name, item, fmt, writer, 0, 0);
+}
+
 struct procstat_item *procstat_create_directory(struct procstat_context *context,
 					   	struct procstat_item *parent,
 						const char *name)
@@ -914,7 +2194,7 @@ void procstat_remove(struct procstat_context *context, struct procstat_item *ite
 	assert(context);
 	assert(item);
 
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_wrlock(&context->tree_lock);
 
 	if (!item_registered(item))
 		goto done;
@@ -931,7 +2211,7 @@ void procstat_remove(struct procstat_context *context, struct procstat_item *ite
 remove_item:
 	item_put_locked(item);
 done:
-	pthread_mutex_unlock(&context->global_lock);
+	tree_write_unlock(context);
 }
 
 int procstat_remove_by_name(struct procstat_context *context,
@@ -946,22 +2226,22 @@ int procstat_remove_by_name(struct procstat_context *context,
 		return -1;
 	}
 
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_wrlock(&context->tree_lock);
 	item = lookup_item_locked((struct procstat_directory *)parent,
 				  name, string_hash(name));
 	if (!item) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		return ENOENT;
 	}
 	item_put_locked(item);
-	pthread_mutex_unlock(&context->global_lock);
+	tree_write_unlock(context);
 	return 0;
 }
 
-int procstat_create_simple(struct procstat_context *context,
-			   struct procstat_item *parent,
-			   struct procstat_simple_handle *descriptors,
-			   size_t descriptors_size)
+static int create_simple(struct procstat_context *context,
+			 struct procstat_item *parent,
+			 struct procstat_simple_handle *descriptors,
+			 size_t descriptors_size, unsigned flags)
 {
 	int i;
 
@@ -975,14 +2255,14 @@ int procstat_create_simple(struct procstat_context *context,
 		struct procstat_file *file;
 		struct procstat_simple_handle *descriptor = &descriptors[i];
 
-		file = create_file(context, (struct procstat_directory *)parent,
-				   descriptor->name, descriptor->object,
-				   descriptor->fmt, descriptor->writer);
+		file = create_file_ex(context, (struct procstat_directory *)parent,
+				      descriptor->name, descriptor->object,
+				      descriptor->fmt, descriptor->writer,
+				      flags, descriptor->arg);
 		if (!file) {
 			--i;
 			goto error_release;
 		}
-		file->arg = descriptor->arg;
 	}
 	return 0;
 error_release:
@@ -992,75 +2272,220 @@ error_release:
 	return -1;
 }
 
+int procstat_create_simple(struct procstat_context *context,
+			   struct procstat_item *parent,
+			   struct procstat_simple_handle *descriptors,
+			   size_t descriptors_size)
+{
+	return create_simple(context, parent, descriptors, descriptors_size, 0);
+}
+
+int procstat_create_cacheable(struct procstat_context *context,
+			      struct procstat_item *parent,
+			      struct procstat_simple_handle *descriptors,
+			      size_t descriptors_size)
+{
+	return create_simple(context, parent, descriptors, descriptors_size, STATS_ENTRY_FLAG_CACHEABLE);
+}
+
+void procstat_invalidate(struct procstat_context *context, struct procstat_item *item)
+{
+	assert(context);
+	assert(item);
+
+	if (!context->session || !(item->flags & STATS_ENTRY_FLAG_CACHEABLE))
+		return;
+	fuse_lowlevel_notify_inval_inode(context->session, (uintptr_t)item, 0, 0);
+}
+
 int procstat_create_aggregator(struct procstat_context *context,
 			      struct procstat_item *parent,
 			      const char *name)
+{
+	return procstat_create_aggregator_ex(context, parent, name, PROCSTAT_AGGREGATOR_STREAM, PROCSTAT_FORMAT_TEXT);
+}
+
+int procstat_create_aggregator_ex(struct procstat_context *context,
+				 struct procstat_item *parent,
+				 const char *name,
+				 enum procstat_aggregator_mode mode,
+				 enum procstat_aggregator_format format)
 {
 	parent = parent_or_root(context, parent);
-	if (!parent) {
+	if (!parent || format > PROCSTAT_FORMAT_PROMETHEUS ||
+	    (mode == PROCSTAT_AGGREGATOR_STREAM && format != PROCSTAT_FORMAT_TEXT)) {
 		errno = EINVAL;
 		return -1;
 	}
 
 	struct procstat_file *file;
+	struct aggregator_cursor *cursor = NULL;
 
-	file = create_file(context, (struct procstat_directory *)parent,
-			   name, NULL, NULL, NULL);
-	if (!file)
-		return -1;
+	if (mode == PROCSTAT_AGGREGATOR_CHANGES) {
+		cursor = calloc(1, sizeof(*cursor));
+		if (!cursor) {
+			errno = ENOMEM;
+			return -1;
+		}
+		pthread_mutex_init(&cursor->lock, NULL);
+	}
 
-	file->base.flags |= STATS_ENTRY_FLAG_AGGREGATOR;
+	file = create_file_ex(context, (struct procstat_directory *)parent,
+			      name, cursor, NULL, NULL, STATS_ENTRY_FLAG_AGGREGATOR, AGGREGATOR_ARG(mode, format));
+	if (!file) {
+		free(cursor);
+		return -1;
+	}
 
 	return 0;
 }
 
-bool is_reset(struct reset_info* reset)
-{
-	unsigned reset_requested = 0;
-	bool reset_interval_expired = false;
-	uint64_t reset_interval, time_since_last_reset;
+/*
+ * Interval resets are driven by a coarse epoch (SERIES_RESET_CLOCK seconds + 1) shared by all the
+ * statistics. The epoch is advanced by a ticker thread each context runs until it is destroyed,
+ * and by every read of statistics files. Each statistic keeps reset_at, the epoch at which its
+ * values expire (0 - never, 1 - reset requested), so the writer only compares a single integer and
+ * never reads the clock.
+ */
+static uint64_t reset_epoch;
 
+static uint64_t reset_epoch_refresh(void)
+{
 	struct timespec cur_time;
-	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0) {
-		time_since_last_reset = cur_time.tv_sec - reset->last_reset_time;
-		reset_interval = __atomic_load_n(&reset->reset_interval, __ATOMIC_RELAXED);
-		if ((reset_interval) && (time_since_last_reset > reset_interval)) {
-			reset_interval_expired = true;
-			reset->last_reset_time = cur_time.tv_sec;
-		}
-	}
+	uint64_t epoch;
 
-	if (reset_interval_expired == false) {
-		reset_requested = __atomic_load_n(&reset->reset_flag, __ATOMIC_RELAXED);
-	}
+	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time))
+		return __atomic_load_n(&reset_epoch, __ATOMIC_RELAXED);
 
-	if (reset_interval_expired || reset_requested) {
-		return true;
-	} else {
-		return false;
-	}
+	epoch = cur_time.tv_sec + 1;
+	/* avoid dirtying the cache line all the writers read */
+	if (epoch != __atomic_load_n(&reset_epoch, __ATOMIC_RELAXED))
+		__atomic_store_n(&reset_epoch, epoch, __ATOMIC_RELAXED);
+	return epoch;
 }
 
-void clear_values_series(struct procstat_series_u64 *series)
+static void recycle_standby_histograms(struct procstat_context *context);
+static void *reset_ticker_run(void *arg)
 {
-	series->count = 0;
-	series->sum = 0;
-	series->mean = 0;
-	series->aggregated_variance = 0;
-	series->min = ULLONG_MAX;
-	series->max = 0;
-	__atomic_store_n(&series->reset.reset_flag, 0, __ATOMIC_RELEASE);
+	struct reset_ticker *ticker = arg;
+	struct procstat_context *context = container_of(ticker, struct procstat_context, ticker);
+	struct timespec deadline;
+
+	pthread_mutex_lock(&ticker->lock);
+	while (!ticker->stop) {
+		pthread_mutex_unlock(&ticker->lock);
+		reset_epoch_refresh();
+		recycle_standby_histograms(context);
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += 1;
+		pthread_mutex_lock(&ticker->lock);
+		if (!ticker->stop)
+			pthread_cond_timedwait(&ticker->cond, &ticker->lock, &deadline);
+	}
+	pthread_mutex_unlock(&ticker->lock);
+	return NULL;
 }
 
-void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t value)
+static void reset_ticker_start(struct reset_ticker *ticker)
+{
+	pthread_condattr_t cond_attr;
+	sigset_t all, old;
+
+	pthread_mutex_init(&ticker->lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ticker->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	ticker->stop = false;
+
+	sigfillset(&all);
+	/* the ticker must not steal signals addressed to the application */
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	/* without a ticker the epoch still advances on reads */
+	ticker->running = !pthread_create(&ticker->thread, NULL, reset_ticker_run, ticker);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void reset_ticker_stop(struct reset_ticker *ticker)
+{
+	if (ticker->running) {
+		pthread_mutex_lock(&ticker->lock);
+		ticker->stop = true;
+		pthread_cond_signal(&ticker->cond);
+		pthread_mutex_unlock(&ticker->lock);
+		pthread_join(ticker->thread, NULL);
+	}
+	pthread_cond_destroy(&ticker->cond);
+	pthread_mutex_destroy(&ticker->lock);
+}
+
+static void reset_init(struct reset_info *reset)
+{
+	reset_epoch_refresh();
+	reset->reset_interval = 0;
+	reset->reset_at = 0;
+}
+
+static void reset_request(struct reset_info *reset)
+{
+	__atomic_store_n(&reset->reset_at, 1, __ATOMIC_RELAXED);
+}
+
+static void reset_set_interval(struct reset_info *reset, uint64_t reset_interval)
+{
+	uint64_t epoch = reset_epoch_refresh();
+
+	__atomic_store_n(&reset->reset_interval, reset_interval, __ATOMIC_RELAXED);
+	__atomic_store_n(&reset->reset_at, reset_interval ? epoch + reset_interval + 1 : 0, __ATOMIC_RELAXED);
+}
+
+static inline bool reset_pending(struct reset_info *reset)
+{
+	/* reset_at of 0 wraps around to the largest epoch, so it never expires */
+	return __atomic_load_n(&reset->reset_at, __ATOMIC_RELAXED) - 1 <
+	       __atomic_load_n(&reset_epoch, __ATOMIC_RELAXED);
+}
+
+/*
+ * @return true in case values should be reset now. Only the caller that arms the next expiry
+ * resets, a concurrent caller that lost the race sees the new expiry and does not.
+ */
+static inline bool is_reset(struct reset_info *reset)
+{
+	uint64_t reset_at = __atomic_load_n(&reset->reset_at, __ATOMIC_RELAXED);
+	uint64_t epoch = __atomic_load_n(&reset_epoch, __ATOMIC_RELAXED);
+	uint64_t reset_interval;
+
+	if (__builtin_expect(reset_at - 1 >= epoch, 1))
+		return false;
+
+	do {
+		reset_interval = __atomic_load_n(&reset->reset_interval, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&reset->reset_at, &reset_at,
+						reset_interval ? epoch + reset_interval + 1 : 0,
+						false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return true;
+		/* a reset requested meanwhile expires right away */
+	} while (reset_at - 1 < epoch);
+	return false;
+}
+
+void clear_values_series(struct procstat_series_u64 *series)
+{
+	series->count = 0;
+	series->sum = 0;
+	series->mean = 0;
+	series->aggregated_variance = 0;
+	series->min = ULLONG_MAX;
+	series->max = 0;
+}
+
+static inline void series_u64_update(struct procstat_series_u64 *series, uint64_t value)
 {
 	int64_t delta;
 	int64_t delta2;
 	int64_t avg_delta;
 
-	if (is_reset(&series->reset)) 
-		clear_values_series(series);
-
 	if (value < series->min)
 		series->min = value;
 	if (value > series->max)
@@ -1078,6 +2503,113 @@ void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t
 	series->aggregated_variance += delta * delta2;
 }
 
+/*
+ * Series fields are published under a sequence counter: the writer makes it odd before the
+ * update and even after it, readers copy the fields and retry if the counter moved. The
+ * writer side costs two plain stores (the fences only restrict compiler reordering on x86).
+ */
+#define SEQCOUNT_READ_RETRIES 64
+
+static inline void seqcount_write_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqcount_write_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy a consistent snapshot of @series into @snapshot. In case the series is written by
+ * several threads the counter may never settle, then a racy copy is taken after a bounded
+ * number of retries.
+ */
+static void series_u64_snapshot(struct procstat_series_u64 *series, struct procstat_series_u64 *snapshot)
+{
+	int retries = SEQCOUNT_READ_RETRIES;
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&series->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(snapshot, series, sizeof(*snapshot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&series->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	} while (--retries);
+
+	memcpy(snapshot, series, sizeof(*snapshot));
+}
+
+void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t value)
+{
+	seqcount_write_begin(&series->seq);
+	if (is_reset(&series->reset))
+		clear_values_series(series);
+
+	series_u64_update(series, value);
+	seqcount_write_end(&series->seq);
+}
+
+/*
+ * Fold @count points with the given @sum, @min, @max, @mean and @aggregated_variance into
+ * @series, means and variances are combined with the pairwise update of Chan et al.
+ */
+static void series_u64_merge(struct procstat_series_u64 *series, uint64_t count, uint64_t sum,
+			     uint64_t min, uint64_t max, double mean, double aggregated_variance)
+{
+	uint64_t total = series->count + count;
+	double delta = mean - (double)series->mean;
+
+	if (min < series->min)
+		series->min = min;
+	if (max > series->max)
+		series->max = max;
+	series->sum += sum;
+	series->mean = (double)series->mean + delta * count / total;
+	series->aggregated_variance += aggregated_variance + delta * delta * series->count * count / total;
+	series->count = total;
+}
+
+void procstat_u64_series_add_points(struct procstat_series_u64 *series, const uint64_t *values, size_t n)
+{
+	uint64_t sum, min = ULLONG_MAX, max = 0;
+	double mean, aggregated_variance;
+
+	if (!n)
+		return;
+
+	/* the batch is reduced outside the sequence counter, by the SIMD kernels of the histograms */
+	sum = procstat_u64_min_max_sum(values, n, &min, &max);
+	mean = (double)sum / n;
+	aggregated_variance = procstat_u64_squared_deviations(values, n, mean);
+
+	seqcount_write_begin(&series->seq);
+	if (is_reset(&series->reset))
+		clear_values_series(series);
+
+	series_u64_merge(series, n, sum, min, max, mean, aggregated_variance);
+	series->last = values[n - 1];
+	seqcount_write_end(&series->seq);
+}
+
+void procstat_u64_series_add_point_n(struct procstat_series_u64 *series, uint64_t value, uint64_t count)
+{
+	if (!count)
+		return;
+
+	seqcount_write_begin(&series->seq);
+	if (is_reset(&series->reset))
+		clear_values_series(series);
+
+	series_u64_merge(series, count, value * count, value, value, value, 0);
+	series->last = value;
+	seqcount_write_end(&series->seq);
+}
+
 enum series_u64_type{
 	SERIES_SUM = 0,
 	SERIES_COUNT = 1,
@@ -1090,18 +2622,14 @@ enum series_u64_type{
 	SERIES_RESET_INTERVAL = 8,
 };
 
-static ssize_t series_u64_read(void *object, uint64_t arg, char *buffer, size_t len)
+static ssize_t format_series_u64(struct procstat_series_u64 *series, enum series_u64_type type,
+				 char *buffer, size_t len)
 {
-	struct procstat_series_u64 *series = object;
-	enum series_u64_type type = arg;
 	uint64_t *data_ptr = NULL;
 	uint64_t data;
 	uint64_t count;
 
-	if (is_reset(&series->reset))
-		clear_values_series(series);
-
-	count = *((volatile uint64_t *)&series->count);
+	count = series->count;
 	switch (type) {
 	case SERIES_SUM:
 		data_ptr = &series->sum;
@@ -1143,8 +2671,20 @@ static ssize_t series_u64_read(void *object, uint64_t arg, char *buffer, size_t
 write_zero:
 	return snprintf(buffer, len, "0\n");
 write_var:
-	return procstat_format_u64_decimal(data_ptr, arg, buffer, len);
+	return procstat_format_u64_decimal(data_ptr, 0, buffer, len);
+}
 
+static ssize_t series_u64_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_series_u64 *series = object;
+	struct procstat_series_u64 snapshot;
+
+	/* the values are cleared by the next add_point, until then a pending reset reads as zeros */
+	reset_epoch_refresh();
+	series_u64_snapshot(series, &snapshot);
+	if (reset_pending(&series->reset))
+		clear_values_series(&snapshot);
+	return format_series_u64(&snapshot, arg, buffer, len);
 }
 
 static int register_u64_series_files(struct procstat_context *context,
@@ -1176,7 +2716,7 @@ static ssize_t reset_u64_series(void *object, uint64_t arg, char *buffer, size_t
 	if (control != 1)
 		return EINVAL;
 
-	__atomic_store_n(&series->reset.reset_flag, 1, __ATOMIC_RELAXED);
+	reset_request(&series->reset);
 	return 1;
 }
 
@@ -1190,7 +2730,7 @@ static ssize_t set_reset_interval_u64_series(void *object, uint64_t arg, char *b
 	if (control < 0)
 		return EINVAL;
 
-	__atomic_store_n(&series->reset.reset_interval, control, __ATOMIC_RELAXED);
+	reset_set_interval(&series->reset, control);
 	return 1;
 }
 
@@ -1231,14 +2771,7 @@ int procstat_create_u64_series(struct procstat_context *context, struct procstat
 		goto error_remove_stat;
 	}
 
-	struct timespec cur_time;
-	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0) {
-		series->reset.last_reset_time = cur_time.tv_sec;
-	} else {
-		series->reset.last_reset_time = 0;
-	}
-	series->reset.reset_flag = 0;
-	series->reset.reset_interval = 0;
+	reset_init(&series->reset);
 
 	control[0].object = series_stat;
 	control[1].object = series_stat;
@@ -1254,7 +2787,7 @@ error_remove_stat:
 
 void procstat_u64_series_set_reset_interval(struct procstat_series_u64 *series, int reset_interval)
 {
-	series->reset.reset_interval = reset_interval;
+	reset_set_interval(&series->reset, reset_interval);
 }
 
 int procstat_create_multiple_u64_series(struct procstat_context *context,
@@ -1288,6 +2821,222 @@ error_release:
 	return -1;
 }
 
+static inline unsigned __int128 series_u64_fast_sum_of_squares(struct procstat_series_u64_fast *series)
+{
+	return ((unsigned __int128)series->sum_of_squares_hi << 64) | series->sum_of_squares_lo;
+}
+
+static void clear_values_series_fast(struct procstat_series_u64_fast *series)
+{
+	series->count = 0;
+	series->sum = 0;
+	series->sum_of_squares_lo = 0;
+	series->sum_of_squares_hi = 0;
+	series->min = ULLONG_MAX;
+	series->max = 0;
+}
+
+void procstat_u64_fast_series_add_point(struct procstat_series_u64_fast *series, uint64_t value)
+{
+	unsigned __int128 sum_of_squares;
+
+	seqcount_write_begin(&series->seq);
+	if (is_reset(&series->reset))
+		clear_values_series_fast(series);
+
+	if (value < series->min)
+		series->min = value;
+	if (value > series->max)
+		series->max = value;
+	++series->count;
+	series->last = value;
+	series->sum += value;
+	sum_of_squares = series_u64_fast_sum_of_squares(series) + (unsigned __int128)value * value;
+	series->sum_of_squares_lo = (uint64_t)sum_of_squares;
+	series->sum_of_squares_hi = (uint64_t)(sum_of_squares >> 64);
+	seqcount_write_end(&series->seq);
+}
+
+static void series_u64_fast_snapshot(struct procstat_series_u64_fast *series,
+				     struct procstat_series_u64_fast *snapshot)
+{
+	int retries = SEQCOUNT_READ_RETRIES;
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&series->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(snapshot, series, sizeof(*snapshot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&series->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	} while (--retries);
+
+	memcpy(snapshot, series, sizeof(*snapshot));
+}
+
+/*
+ * Sample variance (n * sum_of_squares - sum^2) / (n * (n - 1)) rounded to the nearest integer.
+ * sum^2 / n is subtracted first, so the numerator only overflows 128 bits for variances
+ * beyond 2^64, those are truncated.
+ */
+static uint64_t series_u64_fast_variance(struct procstat_series_u64_fast *series)
+{
+	unsigned __int128 count = series->count;
+	unsigned __int128 square_of_sum = (unsigned __int128)series->sum * series->sum;
+	unsigned __int128 sum_of_squares = series_u64_fast_sum_of_squares(series);
+	unsigned __int128 quotient, remainder, deviation, numerator, denominator;
+
+	if (series->count < 2)
+		return 0;
+
+	quotient = square_of_sum / count;
+	remainder = square_of_sum % count;
+	/* only wrapped around sums can break sum_of_squares >= sum^2 / n */
+	if (sum_of_squares < quotient)
+		return 0;
+	deviation = sum_of_squares - quotient;
+
+	denominator = count * (count - 1);
+	if (__builtin_mul_overflow(deviation, count, &numerator)) {
+		deviation /= count - 1;
+		return deviation > UINT64_MAX ? UINT64_MAX : (uint64_t)deviation;
+	}
+	if (numerator < remainder)
+		return 0;
+	numerator -= remainder;
+	numerator = (numerator + denominator / 2) / denominator;
+	return numerator > UINT64_MAX ? UINT64_MAX : (uint64_t)numerator;
+}
+
+/*
+ * Nothing but the raw sums is kept by the writer, the mean and the variance reported by the
+ * "mean" and "stddev" files are computed here. Like for @procstat_series_u64 "stddev" holds
+ * the sample variance.
+ */
+static ssize_t series_u64_fast_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_series_u64_fast *series = object;
+	struct procstat_series_u64_fast snapshot;
+	struct procstat_series_u64 values;
+
+	reset_epoch_refresh();
+	series_u64_fast_snapshot(series, &snapshot);
+	if (reset_pending(&series->reset))
+		clear_values_series_fast(&snapshot);
+	memset(&values, 0, sizeof(values));
+	values.sum = snapshot.sum;
+	values.count = snapshot.count;
+	values.min = snapshot.min;
+	values.max = snapshot.max;
+	values.last = snapshot.last;
+	values.reset = snapshot.reset;
+	if (snapshot.count)
+		values.mean = ((unsigned __int128)snapshot.sum + snapshot.count / 2) / snapshot.count;
+
+	if (arg == SERIES_STDEV) {
+		uint64_t variance = series_u64_fast_variance(&snapshot);
+
+		return procstat_format_u64_decimal(&variance, 0, buffer, len);
+	}
+	return format_series_u64(&values, arg, buffer, len);
+}
+
+static ssize_t reset_u64_fast_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_series_u64_fast *series = series_stat->private;
+	uint32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control != 1)
+		return EINVAL;
+
+	reset_request(&series->reset);
+	return 1;
+}
+
+static ssize_t set_reset_interval_u64_fast_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_series_u64_fast *series = series_stat->private;
+	int32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control < 0)
+		return EINVAL;
+
+	reset_set_interval(&series->reset, control);
+	return 1;
+}
+
+int procstat_create_u64_fast_series(struct procstat_context *context, struct procstat_item *parent,
+				    const char *name, struct procstat_series_u64_fast *series)
+{
+	struct procstat_series *series_stat;
+	struct procstat_simple_handle control[] = {
+		{.name = "reset", .writer = reset_u64_fast_series},
+		{.name = "reset_interval_sec", .writer = set_reset_interval_u64_fast_series}};
+	struct procstat_simple_handle descriptors[] = {
+			{"sum",    			series, SERIES_SUM, series_u64_fast_read},
+			{"count",  			series, SERIES_COUNT, series_u64_fast_read},
+			{"min",    			series, SERIES_MIN, series_u64_fast_read},
+			{"max",    			series, SERIES_MAX, series_u64_fast_read},
+			{"last",   			series, SERIES_LAST, series_u64_fast_read},
+			{"avg",    			series, SERIES_AVG, series_u64_fast_read},
+			{"mean",   			series, SERIES_MEAN, series_u64_fast_read},
+			{"stddev", 			series, SERIES_STDEV, series_u64_fast_read},
+			{"get_reset_interval_sec", 	series, SERIES_RESET_INTERVAL, series_u64_fast_read}};
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	series_stat = calloc(1, sizeof(*series_stat));
+	if (!series_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+	series_stat->private = series;
+
+	series->min = ULLONG_MAX;
+	error = init_directory(context, &series_stat->root,
+			       name, (struct procstat_directory *)parent);
+	if (error) {
+		free_item(&series_stat->root.base);
+		errno = error;
+		return -1;
+	}
+
+	error = procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
+	if (error) {
+		errno = error;
+		goto error_remove_stat;
+	}
+
+	reset_init(&series->reset);
+
+	control[0].object = series_stat;
+	control[1].object = series_stat;
+	error = procstat_create_simple(context, &series_stat->root.base, control, 2);
+	if (error)
+		goto error_remove_stat;
+	return 0;
+
+error_remove_stat:
+	procstat_remove(context, &series_stat->root.base);
+	return -1;
+}
+
+void procstat_u64_fast_series_set_reset_interval(struct procstat_series_u64_fast *series, int reset_interval)
+{
+	reset_set_interval(&series->reset, reset_interval);
+}
+
 int procstat_create_start_end(struct procstat_context *context,
 			      struct procstat_item *parent,
 			      struct procstat_start_end_handle *descriptors,
@@ -1356,30 +3105,30 @@ void fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
 	struct procstat_item *item;
 
 	memset(&stat, 0, sizeof(stat));
-	pthread_mutex_lock(&context->global_lock);
+	pthread_rwlock_rdlock(&context->tree_lock);
 
 	item = fuse_inode_to_item(context, ino);
 	if (!item_registered(item)) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
 	if (!fuse_inode_to_file(ino)->writer) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		fuse_reply_err(req, EPERM);
 		return;
 	}
 
 	/* only support for truncate as it is needed during write */
 	if (to_set != FUSE_SET_ATTR_SIZE) {
-		pthread_mutex_unlock(&context->global_lock);
+		pthread_rwlock_unlock(&context->tree_lock);
 		fuse_reply_err(req, EINVAL);
 		return;
 	}
 
 	fill_item_stats(context, item, &stat);
-	pthread_mutex_unlock(&context->global_lock);
+	pthread_rwlock_unlock(&context->tree_lock);
 	fuse_reply_attr(req, &stat, 1.0);
 }
 
@@ -1388,99 +3137,243 @@ static void fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
 	struct procstat_context *context = request_context(req);
 	struct procstat_item *item = fuse_inode_to_item(request_context(req), ino);
 
-	pthread_mutex_lock(&context->global_lock);
-	if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
-		aggregator_release_locked(item, fi);
-	if (--item->refcnt == 0)
-		free_item(item);
-	pthread_mutex_unlock(&context->global_lock);
-	if (fi->fh) {
-		struct read_struct *fh = (struct read_struct *)fi->fh;
-		free(fh->ext);
-		free(fh);
+	/* the handle keeps the aggregator alive, and the cursor is not locked under the tree lock */
+	if ((item->flags & STATS_ENTRY_FLAG_AGGREGATOR) && fi->fh)
+		aggregator_values_commit(container_of(item, struct procstat_file, base),
+					 (struct read_struct *)fi->fh);
+
+	if ((item->flags & STATS_ENTRY_FLAG_AGGREGATOR) || !item_put_unless_last(item, 1)) {
+		pthread_rwlock_wrlock(&context->tree_lock);
+		if (item->flags & STATS_ENTRY_FLAG_AGGREGATOR)
+			aggregator_release_locked(item, fi);
+		item_unref_locked(item, 1);
+		pthread_rwlock_unlock(&context->tree_lock);
+	}
+	if (fi->fh)
+		read_struct_free((struct read_struct *)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void fuse_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct procstat_context *context = request_context(req);
+	struct procstat_item *item = fuse_inode_to_item(context, ino);
+
+	readdir_snapshot_free(context, (struct readdir_snapshot *)fi->fh);
+	if (!item_put_unless_last(item, 1)) {
+		pthread_rwlock_wrlock(&context->tree_lock);
+		item_unref_locked(item, 1);
+		pthread_rwlock_unlock(&context->tree_lock);
 	}
 	fuse_reply_err(req, 0);
 }
 
+/*
+ * Listings always go through readdirplus, so that a recursive scrape gets the attributes of every
+ * entry without a LOOKUP per file. Replies are formatted in memory and sent with writev, and
+ * splice reads of the tiny requests procstat gets would only cost an extra copy through a pipe,
+ * so no splicing is used. libfuse turns splice reads on by default once write_buf is set.
+ */
+static void fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+	conn->want &= ~(FUSE_CAP_READDIRPLUS_AUTO | FUSE_CAP_SPLICE_READ);
+}
+
 static struct fuse_lowlevel_ops fops = {
+	.init = fuse_init,
 	.read = fuse_read,
 	.lookup = fuse_lookup,
 	.forget = fuse_forget,
+	.forget_multi = fuse_forget_multi,
 	.getattr = fuse_getattr,
 	.opendir = fuse_opendir,
 	.readdir = fuse_readdir,
+	.readdirplus = fuse_readdirplus,
 	.open = fuse_open,
 	.write = fuse_write,
+	.write_buf = fuse_write_buf,
 	.setattr = fuse_setattr,
 	.release = fuse_release,
-	.releasedir = fuse_release,
+	.releasedir = fuse_releasedir,
 };
 
 #define ROOT_DIR_NAME "."
-struct procstat_context *procstat_create(const char *mountpoint)
+struct procstat_context *procstat_create_headless(void)
 {
 	struct procstat_context *context;
-	char *argv[] = {(char *)"stats", (char *)"-o", (char *)"auto_unmount", (char *)mountpoint, NULL};
-	struct fuse_args args = FUSE_ARGS_INIT(ARRAY_SIZE(argv)-1, argv);
-	char *full_path_mountpoint;
-	int error;
-	struct fuse_chan *channel;
-
-	error = mkdir(mountpoint, 0755);
-	if (error) {
-		if (errno != EEXIST)
-			return NULL;
-	}
-
-	error = fuse_parse_cmdline(&args, &full_path_mountpoint, NULL, NULL);
-	if (error) {
-		errno = EINVAL;
-		return NULL;
-	}
+	pthread_rwlockattr_t lock_attr;
 
 	context = calloc(1, sizeof(*context));
 	if (!context) {
 		errno = ENOMEM;
 		return NULL;
 	}
-	context->mountpoint = full_path_mountpoint;
 	context->uid = getuid();
 	context->gid = getgid();
 
-	pthread_mutex_init(&context->global_lock, NULL);
+	pthread_rwlockattr_init(&lock_attr);
+	/* keep registration from starving behind back to back scrapes */
+	pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&context->tree_lock, &lock_attr);
+	pthread_rwlockattr_destroy(&lock_attr);
 	init_directory(context, &context->root, ROOT_DIR_NAME, NULL);
-
-	channel = fuse_mount(context->mountpoint, &args);
-	if (!channel) {
-		errno = EFAULT;
-		goto free_stats;
-	}
-
-	context->session = fuse_lowlevel_new(&args, &fops, sizeof(fops), context);
-	if (!context->session) {
-		errno = EPERM;
-		goto free_stats;
-	}
-
-	fuse_opt_free_args(&args);
-	fuse_session_add_chan(context->session, channel);
+	INIT_LIST_HEAD(&context->histograms);
+	reset_ticker_start(&context->ticker);
 	return context;
-free_stats:
-	procstat_destroy(context);
-	return NULL;
 }
 
-
-
-void procstat_stop(struct procstat_context *context)
+int procstat_mount(struct procstat_context *context, const char *mountpoint)
+{
+	char *argv[] = {(char *)"stats", (char *)"-o", (char *)"auto_unmount", (char *)mountpoint, NULL};
+	struct fuse_args args = FUSE_ARGS_INIT(ARRAY_SIZE(argv)-1, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *session;
+	int error;
+
+	if (context->session || context->mountpoint) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	error = mkdir(mountpoint, 0755);
+	if (error) {
+		if (errno != EEXIST)
+			return -1;
+	}
+
+	error = fuse_parse_cmdline(&args, &opts);
+	if (error) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	session = fuse_session_new(&args, &fops, sizeof(fops), context);
+	fuse_opt_free_args(&args);
+	if (!session) {
+		free(opts.mountpoint);
+		errno = EPERM;
+		return -1;
+	}
+
+	if (fuse_session_mount(session, opts.mountpoint)) {
+		fuse_session_destroy(session);
+		free(opts.mountpoint);
+		errno = EFAULT;
+		return -1;
+	}
+
+	/* removals queue entry invalidations once the session is published */
+	pthread_rwlock_wrlock(&context->tree_lock);
+	context->mountpoint = opts.mountpoint;
+	__atomic_store_n(&context->session, session, __ATOMIC_SEQ_CST);
+	pthread_rwlock_unlock(&context->tree_lock);
+	inode_invalidator_start(context);
+	return 0;
+}
+
+/*
+ * Contexts created by procstat_create_async() are mounted by the first loop. procstat_stop() may
+ * come before the loop serves the session: under the tree lock the stop raises stop_pending and
+ * the loop marks itself serving unless the stop came first, so procstat_stop() only wakes up a
+ * loop that will read the session.
+ */
+struct pending_mount {
+	procstat_mount_callback callback;
+	void 			*arg;
+	char 			mountpoint[0];
+};
+
+struct procstat_context *procstat_create_async(const char *mountpoint, procstat_mount_callback callback, void *arg)
+{
+	struct procstat_context *context;
+	struct pending_mount *pending;
+
+	pending = malloc(sizeof(*pending) + strlen(mountpoint) + 1);
+	if (!pending) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pending->callback = callback;
+	pending->arg = arg;
+	strcpy(pending->mountpoint, mountpoint);
+
+	context = procstat_create_headless();
+	if (!context) {
+		free(pending);
+		return NULL;
+	}
+	context->pending_mount = pending;
+	return context;
+}
+
+/* @return true in case the loop has a session to serve */
+static bool loop_prepare(struct procstat_context *context)
+{
+	struct pending_mount *pending = context->pending_mount;
+	bool serving;
+
+	if (pending) {
+		int error = 0;
+
+		context->pending_mount = NULL;
+		if (procstat_mount(context, pending->mountpoint))
+			error = errno;
+		if (pending->callback)
+			pending->callback(context, error, pending->arg);
+		free(pending);
+	}
+
+	pthread_rwlock_wrlock(&context->tree_lock);
+	serving = context->session && !context->stop_pending;
+	context->stop_pending = false;
+	context->serving = serving;
+	pthread_rwlock_unlock(&context->tree_lock);
+	return serving;
+}
+
+static void loop_finish(struct procstat_context *context)
+{
+	pthread_rwlock_wrlock(&context->tree_lock);
+	context->serving = false;
+	pthread_rwlock_unlock(&context->tree_lock);
+}
+
+struct procstat_context *procstat_create(const char *mountpoint)
+{
+	struct procstat_context *context;
+	int error;
+
+	context = procstat_create_headless();
+	if (!context)
+		return NULL;
+
+	if (procstat_mount(context, mountpoint)) {
+		error = errno;
+		procstat_destroy(context);
+		errno = error;
+		return NULL;
+	}
+	return context;
+}
+
+
+
+void procstat_stop(struct procstat_context *context)
 {
 	struct fuse_session *session;
+	bool serving;
 
 
 	assert(context);
+	/* the loop of an asynchronous context may not have mounted it yet */
+	pthread_rwlock_wrlock(&context->tree_lock);
+	context->stop_pending = true;
 	session = context->session;
+	serving = context->serving;
+	pthread_rwlock_unlock(&context->tree_lock);
 
-	if (session) {
+	if (serving) {
 		DIR *root_dir;
 		// Closing the dir after "fuse_session_exit" causes fuse looper
 		// to receive a callback and exit. Otherwise thread running
@@ -1488,6 +3381,9 @@ void procstat_stop(struct procstat_context *context)
 		root_dir = opendir(context->mountpoint);
 		fuse_session_exit(session);
 		closedir(root_dir);
+	} else if (session) {
+		/* nobody reads the session, a loop entered later returns right away */
+		fuse_session_exit(session);
 	}
 }
 
@@ -1498,24 +3394,27 @@ void procstat_destroy(struct procstat_context *context)
 	assert(context);
 	session = context->session;
 
-	pthread_mutex_lock(&context->global_lock);
+	reset_ticker_stop(&context->ticker);
+	/* the publisher, the servers and the invalidator walk the tree */
+	inode_invalidator_stop(context);
+	procstat_shm_close(context);
+	procstat_unix_close(context);
+	procstat_http_close(context);
+	pthread_rwlock_wrlock(&context->tree_lock);
 	if (session) {
-		struct fuse_chan *channel = NULL;
-
 		assert(context->mountpoint);
 		fuse_session_exit(session);
-		channel = fuse_session_next_chan(session, channel);
-		assert(channel);
-		fuse_session_remove_chan(channel);
-
-		fuse_unmount(context->mountpoint, channel);
+		fuse_session_unmount(session);
 		fuse_session_destroy(session);
+		/* nothing is cached past the unmount */
+		context->session = NULL;
 	}
 
 	item_put_children_locked(&context->root);
 	free(context->mountpoint);
-	pthread_mutex_unlock(&context->global_lock);
-	pthread_mutex_destroy(&context->global_lock);
+	free(context->pending_mount);
+	pthread_rwlock_unlock(&context->tree_lock);
+	pthread_rwlock_destroy(&context->tree_lock);
 
 	/* debug purposes of use after free*/
 	context->mountpoint = NULL;
@@ -1525,46 +3424,228 @@ void procstat_destroy(struct procstat_context *context)
 
 void procstat_loop(struct procstat_context *context)
 {
-	fuse_session_loop(context->session);
+	/* headless contexts have nothing to serve */
+	if (loop_prepare(context)) {
+		fuse_session_loop(context->session);
+		loop_finish(context);
+	}
 }
 
-static ssize_t procstat_fmt_u32_percentile(void *object, uint64_t arg, char *buffer, size_t length)
+void procstat_loop_mt(struct procstat_context *context)
 {
-	struct procstat_histogram_u32 *series = object;
-	unsigned reset;
-	uint32_t zero = 0;
-	uint32_t *data_ptr = NULL;
+	/* a cloned /dev/fuse fd per worker spreads requests over per thread queues */
+	struct fuse_loop_config config = {
+		.clone_fd = 1,
+		.max_idle_threads = 10,
+	};
 
-	reset = __atomic_load_n(&series->reset.reset_flag, __ATOMIC_ACQUIRE);
-	if (reset) {
-		data_ptr = &zero;
-	} else {
-		series->compute_cb(series->histogram, series->count, series->percentile, series->npercentile);
-		data_ptr = &series->percentile[arg].value;
+	if (loop_prepare(context)) {
+		fuse_session_loop_mt(context->session, &config);
+		loop_finish(context);
 	}
-	return procstat_format_u32_decimal(data_ptr, 0, buffer, length);
 }
 
-void clear_values_histogram(struct procstat_histogram_u32 *series)
+/*
+ * Histogram resets do not clear the buckets on the writer: the writer swaps the active values
+ * with the zeroed standby values and marks the previous values dirty, the dirty standby is then
+ * cleared by the reset ticker of the context once a second, or earlier by a statistics reader.
+ * Only in case the ticker fell a whole reset interval behind the writer recycles the standby
+ * itself before the swap, so the swap is never postponed and no point is dropped.
+ */
+enum histogram_standby_state {
+	HISTOGRAM_STANDBY_CLEAN = 0,
+	HISTOGRAM_STANDBY_DIRTY = 1,
+	HISTOGRAM_STANDBY_CLEARING = 2,
+};
+
+void clear_values_histogram(struct procstat_histogram_u32_values *values)
 {
-	series->count = 0;
-	series->sum = 0;
-	series->last = 0;
-	memset(series->histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*series->histogram));
-	__atomic_store_n(&series->reset.reset_flag, 0, __ATOMIC_RELEASE);
+	values->count = 0;
+	values->sum = 0;
+	values->last = 0;
+	procstat_hist_sparse_clear(&values->buckets);
+}
+
+static void histogram_u32_recycle_standby(struct procstat_histogram_u32 *series)
+{
+	uint32_t state = HISTOGRAM_STANDBY_DIRTY;
+
+	if (__atomic_load_n(&series->standby_dirty, __ATOMIC_RELAXED) != HISTOGRAM_STANDBY_DIRTY)
+		return;
+	if (!__atomic_compare_exchange_n(&series->standby_dirty, &state, HISTOGRAM_STANDBY_CLEARING,
+					 false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	clear_values_histogram(series->standby);
+	__atomic_store_n(&series->standby_dirty, HISTOGRAM_STANDBY_CLEAN, __ATOMIC_RELEASE);
+}
+
+static void track_histogram(struct procstat_context *context, struct procstat_series *series_stat)
+{
+	pthread_rwlock_wrlock(&context->tree_lock);
+	/* a histogram removed meanwhile is not tracked */
+	if (item_registered(&series_stat->root.base))
+		list_add_tail(&series_stat->standby_entry, &context->histograms);
+	pthread_rwlock_unlock(&context->tree_lock);
+}
+
+/* @return true in case the writer should swap the values now */
+static inline bool histogram_u32_is_reset(struct procstat_histogram_u32 *series)
+{
+	if (__builtin_expect(!reset_pending(&series->reset), 1))
+		return false;
+	return is_reset(&series->reset);
+}
+
+static void histogram_u32_swap(struct procstat_histogram_u32 *series)
+{
+	struct procstat_histogram_u32_values *active = series->active;
+	uint32_t state;
+
+	/* a concurrent recycle clears a single buffer, so waiting for it is bounded */
+	while ((state = __atomic_load_n(&series->standby_dirty, __ATOMIC_ACQUIRE)) != HISTOGRAM_STANDBY_CLEAN)
+		if (state == HISTOGRAM_STANDBY_DIRTY)
+			histogram_u32_recycle_standby(series);
+
+	__atomic_store_n(&series->generation, series->generation + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&series->active, series->standby, __ATOMIC_RELEASE);
+	series->standby = active;
+	__atomic_store_n(&series->standby_dirty, HISTOGRAM_STANDBY_DIRTY, __ATOMIC_RELEASE);
 }
 
 void procstat_histogram_u32_add_point(struct procstat_histogram_u32 *series, uint32_t value)
 {
-	if (is_reset(&series->reset)) {
-		clear_values_histogram(series);
-	}
+	struct procstat_histogram_u32_values *values;
 
-	++series->count;
-	series->sum += value;
-	series->last = value;
+	seqcount_write_begin(&series->seq);
+	if (histogram_u32_is_reset(series))
+		histogram_u32_swap(series);
+
+	values = series->active;
+	++values->count;
+	values->sum += value;
+	values->last = value;
+	seqcount_write_end(&series->seq);
+
+	procstat_hist_sparse_add_point(&values->buckets, value);
+}
+
+void procstat_histogram_u32_add_points(struct procstat_histogram_u32 *series, const uint32_t *values, size_t n)
+{
+	struct procstat_histogram_u32_values *active;
+	uint64_t sum;
+
+	if (!n)
+		return;
+
+	seqcount_write_begin(&series->seq);
+	if (histogram_u32_is_reset(series))
+		histogram_u32_swap(series);
+	active = series->active;
+	seqcount_write_end(&series->seq);
+
+	/* buckets are not covered by the sequence counter, count is published once they are in */
+	sum = procstat_hist_sparse_add_points(&active->buckets, values, n);
+
+	seqcount_write_begin(&series->seq);
+	active->count += n;
+	active->sum += sum;
+	active->last = values[n - 1];
+	seqcount_write_end(&series->seq);
+}
+
+void procstat_histogram_u32_add_point_n(struct procstat_histogram_u32 *series, uint32_t value, uint32_t count)
+{
+	struct procstat_histogram_u32_values *values;
+
+	if (!count)
+		return;
+
+	seqcount_write_begin(&series->seq);
+	if (histogram_u32_is_reset(series))
+		histogram_u32_swap(series);
+
+	values = series->active;
+	values->count += count;
+	values->sum += (uint64_t)value * count;
+	values->last = value;
+	seqcount_write_end(&series->seq);
+
+	procstat_hist_sparse_add_point_n(&values->buckets, value, count);
+}
+
+/*
+ * Percentiles are computed into the percentile array of the histogram under the cache lock, and
+ * reused by the following percentile file reads as long as the values were not reset and either
+ * no samples arrived or the reads belong to the same scrape (PERCENTILE_CACHE_WINDOW_NS).
+ */
+#define PERCENTILE_CACHE_WINDOW_NS (100 * 1000 * 1000ULL)
+
+static inline void percentile_cache_lock(struct procstat_percentile_cache *cache)
+{
+	while (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&cache->lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void percentile_cache_unlock(struct procstat_percentile_cache *cache)
+{
+	__atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t percentile_cache_now(void)
+{
+	struct timespec cur_time;
+
+	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time))
+		return 0;
+	return cur_time.tv_sec * 1000000000ULL + cur_time.tv_nsec;
+}
+
+/*
+ * @return true in case the cached percentiles can be used for values of @generation holding
+ * @count samples. Otherwise the cache is stamped, and the caller must recompute the percentiles
+ * before unlocking. Must be called with the cache locked.
+ */
+static bool percentile_cache_hit(struct procstat_percentile_cache *cache, uint32_t generation, uint64_t count)
+{
+	uint64_t now = percentile_cache_now();
+
+	if (cache->computed_ns && cache->generation == generation &&
+	    (cache->count == count || now - cache->computed_ns < PERCENTILE_CACHE_WINDOW_NS))
+		return true;
+
+	cache->generation = generation;
+	cache->count = count;
+	/* 0 is reserved for a cache that was never filled */
+	cache->computed_ns = now ? now : 1;
+	return false;
+}
 
-	procstat_hist_add_point(series->histogram, value);
+static ssize_t procstat_fmt_u32_percentile(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_histogram_u32 *series = object;
+	struct procstat_histogram_u32_values *values;
+	/* on the stack, the cache lock is a spinlock and must not be held across allocations */
+	uint32_t buckets[PROCSTAT_PERCENTILE_ARR_NR];
+	uint32_t generation;
+	uint32_t value = 0;
+
+	reset_epoch_refresh();
+	histogram_u32_recycle_standby(series);
+	if (!reset_pending(&series->reset)) {
+		generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+		values = __atomic_load_n(&series->active, __ATOMIC_ACQUIRE);
+		percentile_cache_lock(&series->percentile_cache);
+		if (!percentile_cache_hit(&series->percentile_cache, generation, values->count)) {
+			procstat_hist_sparse_read(&values->buckets, buckets);
+			series->compute_cb(buckets, series->percentile_cache.count,
+					   series->percentile, series->npercentile);
+		}
+		value = series->percentile[arg].value;
+		percentile_cache_unlock(&series->percentile_cache);
+	}
+	return procstat_format_u32_decimal(&value, 0, buffer, length);
 }
 
 enum histogram_u32_series_type{
@@ -1575,38 +3656,37 @@ enum histogram_u32_series_type{
 	HISTOGRAM_RESET_INTERVAL = 4,
 };
 
-static ssize_t histogram_u32_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+struct histogram_u32_snapshot {
+	uint64_t 	sum;
+	uint64_t 	count;
+	uint64_t 	last;
+	uint64_t 	reset_interval;
+};
+
+static ssize_t format_histogram_u32(struct histogram_u32_snapshot *snapshot, enum histogram_u32_series_type type,
+				    char *buffer, size_t len)
 {
-	struct procstat_histogram_u32 *series = object;
-	enum histogram_u32_series_type type = arg;
 	uint64_t *data_ptr = NULL;
 	uint64_t data;
-	uint64_t count;
-
-	if (is_reset(&series->reset)) {
-		clear_values_histogram(series);
-	}
 
 	switch (type) {
 	case HISTOGRAM_SUM:
-		data_ptr = &series->sum;
+		data_ptr = &snapshot->sum;
 		goto write_var;
 	case HISTOGRAM_COUNT:
-		count = *((volatile uint64_t *)&series->count);
-		data_ptr = &series->count;
+		data_ptr = &snapshot->count;
 		goto write_var;
 	case HISTOGRAM_LAST:
-		data_ptr = &series->last;
+		data_ptr = &snapshot->last;
 		goto write_var;
 	case HISTOGRAM_AVG:
-		count = *((volatile uint64_t *)&series->count);
-		if (!count)
+		if (!snapshot->count)
 			goto write_zero;
-		data = series->sum / count;
+		data = snapshot->sum / snapshot->count;
 		data_ptr = &data;
 		goto write_var;
 	case HISTOGRAM_RESET_INTERVAL:
-		data_ptr = &series->reset.reset_interval;
+		data_ptr = &snapshot->reset_interval;
 		goto write_var;
 	default:
 		return -1;
@@ -1614,7 +3694,79 @@ static ssize_t histogram_u32_series_read(void *object, uint64_t arg, char *buffe
 write_zero:
 	return snprintf(buffer, len, "0\n");
 write_var:
-	return procstat_format_u64_decimal(data_ptr, arg, buffer, len);
+	return procstat_format_u64_decimal(data_ptr, 0, buffer, len);
+}
+
+static inline void histogram_u32_copy(struct procstat_histogram_u32 *series, struct histogram_u32_snapshot *snapshot)
+{
+	struct procstat_histogram_u32_values *values = __atomic_load_n(&series->active, __ATOMIC_ACQUIRE);
+
+	snapshot->sum = values->sum;
+	snapshot->count = values->count;
+	snapshot->last = values->last;
+}
+
+/*
+ * Copy sum, count and last of the active values under the sequence counter, in case the counter
+ * keeps moving a racy copy is taken. Values pending reset are reported as zeros.
+ */
+static void histogram_u32_snapshot(struct procstat_histogram_u32 *series, struct histogram_u32_snapshot *snapshot)
+{
+	int retries = SEQCOUNT_READ_RETRIES;
+	uint32_t seq;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->reset_interval = __atomic_load_n(&series->reset.reset_interval, __ATOMIC_RELAXED);
+	if (reset_pending(&series->reset))
+		return;
+
+	do {
+		seq = __atomic_load_n(&series->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		histogram_u32_copy(series, snapshot);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&series->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	} while (--retries);
+
+	histogram_u32_copy(series, snapshot);
+}
+
+static ssize_t histogram_u32_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_histogram_u32 *series = object;
+	struct histogram_u32_snapshot snapshot;
+
+	reset_epoch_refresh();
+	histogram_u32_recycle_standby(series);
+	histogram_u32_snapshot(series, &snapshot);
+	return format_histogram_u32(&snapshot, arg, buffer, len);
+}
+
+void procstat_histogram_u32_get(struct procstat_histogram_u32 *series, uint64_t *sum, uint64_t *count,
+				uint64_t *last, uint32_t *histogram)
+{
+	struct histogram_u32_snapshot snapshot;
+
+	histogram_u32_snapshot(series, &snapshot);
+	if (sum)
+		*sum = snapshot.sum;
+	if (count)
+		*count = snapshot.count;
+	if (last)
+		*last = snapshot.last;
+	if (!histogram)
+		return;
+	if (reset_pending(&series->reset))
+		memset(histogram, 0, PROCSTAT_PERCENTILE_ARR_NR * sizeof(*histogram));
+	else
+		procstat_hist_sparse_read(&__atomic_load_n(&series->active, __ATOMIC_ACQUIRE)->buckets, histogram);
+}
+
+size_t procstat_histogram_u32_size(struct procstat_histogram_u32 *series)
+{
+	return procstat_hist_sparse_size(&__atomic_load_n(&series->active, __ATOMIC_ACQUIRE)->buckets);
 }
 
 static ssize_t reset_histogram_u32_series(void *object, uint64_t arg, char *buffer, size_t length)
@@ -1627,7 +3779,8 @@ static ssize_t reset_histogram_u32_series(void *object, uint64_t arg, char *buff
 	if (control != 1)
 		return EINVAL;
 
-	__atomic_store_n(&series->reset.reset_flag, 1, __ATOMIC_RELAXED);
+	histogram_u32_recycle_standby(series);
+	reset_request(&series->reset);
 	return 1;
 }
 
@@ -1641,8 +3794,8 @@ static ssize_t reset_interval_histogram_u32_series(void *object, uint64_t arg, c
 	if (control < 0)
 		return EINVAL;
 
-	__atomic_store_n(&series->reset.reset_interval, control, __ATOMIC_RELAXED);
-	return 1; 
+	reset_set_interval(&series->reset, control);
+	return 1;
 }
 
 int procstat_create_histogram_u32_series(struct procstat_context *context, struct procstat_item *parent,
@@ -1684,11 +3837,18 @@ int procstat_create_histogram_u32_series(struct procstat_context *context, struc
 
 	series_stat->root.base.flags |= STATS_ENTRY_FLAG_HISTOGRAM;
 	series_stat->private = series;
-	series->histogram = calloc(PROCSTAT_PERCENTILE_ARR_NR, sizeof(uint32_t));
-	if (!series->histogram) {
+	INIT_LIST_HEAD(&series_stat->standby_entry);
+	series->buffers = calloc(2, sizeof(*series->buffers));
+	if (!series->buffers) {
 		errno = ENOMEM;
 		goto fail_remove_stat;
 	}
+	series->active = &series->buffers[0];
+	series->standby = &series->buffers[1];
+	series->standby_dirty = HISTOGRAM_STANDBY_CLEAN;
+	series->seq = 0;
+	series->generation = 0;
+	memset(&series->percentile_cache, 0, sizeof(series->percentile_cache));
 
 	error = procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
 	if (error) {
@@ -1711,14 +3871,7 @@ int procstat_create_histogram_u32_series(struct procstat_context *context, struc
 		file->arg = i;
 	}
 
-	struct timespec cur_time;
-	if (clock_gettime(SERIES_RESET_CLOCK, &cur_time) == 0) {
-		series->reset.last_reset_time = cur_time.tv_sec;
-	} else {
-		series->reset.last_reset_time = 0;
-	}
-	series->reset.reset_flag = 0;
-	series->reset.reset_interval = 0;
+	reset_init(&series->reset);
 
 	control[0].object = series_stat;
 	control[1].object = series_stat;
@@ -1726,6 +3879,7 @@ int procstat_create_histogram_u32_series(struct procstat_context *context, struc
 	if (error)
 		goto fail_remove_stat;
 
+	track_histogram(context, series_stat);
 	return 0;
 
 fail_remove_stat:
@@ -1735,57 +3889,2611 @@ fail_remove_stat:
 
 void procstat_histogram_u32_series_set_reset_interval(struct procstat_histogram_u32 *series, int reset_interval)
 {
-	series->reset.reset_interval = reset_interval;
+	reset_set_interval(&series->reset, reset_interval);
 }
 
-struct procstat_item *procstat_lookup_item(struct procstat_context *context,
-		struct procstat_item *parent, const char *name)
+/*
+ * u64 histograms follow the u32 histogram scheme: the writer swaps the active values with the
+ * zeroed standby on reset, and the ticker or a reader recycles the dirty standby.
+ */
+static void clear_values_histogram_u64(struct procstat_histogram_u64 *series,
+				       struct procstat_histogram_u64_values *values)
 {
-	struct procstat_item *item = NULL;
+	values->count = 0;
+	values->sum = 0;
+	values->last = 0;
+	memset(values->histogram, 0, PROCSTAT_U64_BUCKETS_NR(series->precision_bits) * sizeof(uint64_t));
+}
 
-	pthread_mutex_lock(&context->global_lock);
-	parent = parent_or_root(context, parent);
+static void histogram_u64_recycle_standby(struct procstat_histogram_u64 *series)
+{
+	uint32_t state = HISTOGRAM_STANDBY_DIRTY;
 
-	if (!item_registered(parent)) {
-		goto done;
-	}
+	if (__atomic_load_n(&series->standby_dirty, __ATOMIC_RELAXED) != HISTOGRAM_STANDBY_DIRTY)
+		return;
+	if (!__atomic_compare_exchange_n(&series->standby_dirty, &state, HISTOGRAM_STANDBY_CLEARING,
+					 false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
 
-	item = lookup_item_locked((struct procstat_directory *)parent,
-				  name, string_hash(name));
+	clear_values_histogram_u64(series, series->standby);
+	__atomic_store_n(&series->standby_dirty, HISTOGRAM_STANDBY_CLEAN, __ATOMIC_RELEASE);
+}
 
-	if (!item || !item_registered(item)) {
-		item = NULL;
-		goto done;
+static void recycle_standby_histograms(struct procstat_context *context)
+{
+	struct procstat_series *series_stat;
+
+	pthread_rwlock_rdlock(&context->tree_lock);
+	list_for_each_entry(series_stat, &context->histograms, standby_entry) {
+		if (series_stat->root.base.flags & STATS_ENTRY_FLAG_HISTOGRAM)
+			histogram_u32_recycle_standby(series_stat->private);
+		else
+			histogram_u64_recycle_standby(series_stat->private);
 	}
+	pthread_rwlock_unlock(&context->tree_lock);
+}
+
+static inline bool histogram_u64_is_reset(struct procstat_histogram_u64 *series)
+{
+	if (__builtin_expect(!reset_pending(&series->reset), 1))
+		return false;
+	return is_reset(&series->reset);
+}
 
-	++item->refcnt;
+static void histogram_u64_swap(struct procstat_histogram_u64 *series)
+{
+	struct procstat_histogram_u64_values *active = series->active;
+	uint32_t state;
 
-done:
-	pthread_mutex_unlock(&context->global_lock);
-	return item;
+	while ((state = __atomic_load_n(&series->standby_dirty, __ATOMIC_ACQUIRE)) != HISTOGRAM_STANDBY_CLEAN)
+		if (state == HISTOGRAM_STANDBY_DIRTY)
+			histogram_u64_recycle_standby(series);
+
+	__atomic_store_n(&series->generation, series->generation + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&series->active, series->standby, __ATOMIC_RELEASE);
+	series->standby = active;
+	__atomic_store_n(&series->standby_dirty, HISTOGRAM_STANDBY_DIRTY, __ATOMIC_RELEASE);
 }
 
-void procstat_refget(struct procstat_context *context, struct procstat_item *item)
+void procstat_histogram_u64_add_point(struct procstat_histogram_u64 *series, uint64_t value)
 {
-	pthread_mutex_lock(&context->global_lock);
-	++item->refcnt;
-	pthread_mutex_unlock(&context->global_lock);
+	struct procstat_histogram_u64_values *values;
+
+	seqcount_write_begin(&series->seq);
+	if (histogram_u64_is_reset(series))
+		histogram_u64_swap(series);
+
+	values = series->active;
+	++values->count;
+	values->sum += value;
+	values->last = value;
+	seqcount_write_end(&series->seq);
+
+	procstat_hist_u64_add_point(values->histogram, series->precision_bits, value);
 }
 
-void procstat_refput(struct procstat_context *context, struct procstat_item *item)
+static ssize_t histogram_u64_fmt_percentile(void *object, uint64_t arg, char *buffer, size_t length)
 {
-	pthread_mutex_lock(&context->global_lock);
-	if (item->refcnt == 1)
-		item_put_locked(item);
-	else
-		--item->refcnt;
-	pthread_mutex_unlock(&context->global_lock);
+	struct procstat_histogram_u64 *series = object;
+	struct procstat_histogram_u64_values *values;
+	uint32_t generation;
+	uint64_t value = 0;
+
+	reset_epoch_refresh();
+	histogram_u64_recycle_standby(series);
+	if (!reset_pending(&series->reset)) {
+		generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+		values = __atomic_load_n(&series->active, __ATOMIC_ACQUIRE);
+		percentile_cache_lock(&series->percentile_cache);
+		if (!percentile_cache_hit(&series->percentile_cache, generation, values->count))
+			procstat_percentile_u64_calculate(values->histogram, series->precision_bits,
+							  series->percentile_cache.count,
+							  series->percentile, series->npercentile);
+		value = series->percentile[arg].value;
+		percentile_cache_unlock(&series->percentile_cache);
+	}
+	return procstat_format_u64_decimal(&value, 0, buffer, length);
 }
 
-void procstat_remove_subtree(struct procstat_context *context, struct procstat_item* directory)
+static inline void histogram_u64_copy(struct procstat_histogram_u64 *series, struct histogram_u32_snapshot *snapshot)
 {
-	pthread_mutex_lock(&context->global_lock);
-	if (item_type_directory(directory))
-		item_put_children_locked((struct procstat_directory*)directory);
-	pthread_mutex_unlock(&context->global_lock);
-}
\ No newline at end of file
+	struct procstat_histogram_u64_values *values = __atomic_load_n(&series->active, __ATOMIC_ACQUIRE);
+
+	snapshot->sum = values->sum;
+	snapshot->count = values->count;
+	snapshot->last = values->last;
+}
+
+static void histogram_u64_snapshot(struct procstat_histogram_u64 *series, struct histogram_u32_snapshot *snapshot)
+{
+	int retries = SEQCOUNT_READ_RETRIES;
+	uint32_t seq;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->reset_interval = __atomic_load_n(&series->reset.reset_interval, __ATOMIC_RELAXED);
+	if (reset_pending(&series->reset))
+		return;
+
+	do {
+		seq = __atomic_load_n(&series->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		histogram_u64_copy(series, snapshot);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&series->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	} while (--retries);
+
+	histogram_u64_copy(series, snapshot);
+}
+
+static ssize_t histogram_u64_series_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_histogram_u64 *series = object;
+	struct histogram_u32_snapshot snapshot;
+
+	reset_epoch_refresh();
+	histogram_u64_recycle_standby(series);
+	histogram_u64_snapshot(series, &snapshot);
+	return format_histogram_u32(&snapshot, arg, buffer, len);
+}
+
+static ssize_t reset_histogram_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_histogram_u64 *series = series_stat->private;
+	uint32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control != 1)
+		return EINVAL;
+
+	histogram_u64_recycle_standby(series);
+	reset_request(&series->reset);
+	return 1;
+}
+
+static ssize_t reset_interval_histogram_u64_series(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_series *series_stat = object;
+	struct procstat_histogram_u64 *series = series_stat->private;
+	int32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control < 0)
+		return EINVAL;
+
+	reset_set_interval(&series->reset, control);
+	return 1;
+}
+
+int procstat_create_histogram_u64_series(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u64 *series)
+{
+	int i;
+	struct procstat_series *series_stat;
+	struct procstat_simple_handle control[] = {
+		{.name = "reset", .writer = reset_histogram_u64_series},
+		{.name = "reset_interval_sec", .writer = reset_interval_histogram_u64_series},
+	};
+	int error;
+	struct procstat_simple_handle descriptors[] = {
+		{"sum",    			series, HISTOGRAM_SUM, histogram_u64_series_read},
+		{"count",  			series, HISTOGRAM_COUNT, histogram_u64_series_read},
+		{"last",   			series, HISTOGRAM_LAST, histogram_u64_series_read},
+		{"avg",    			series, HISTOGRAM_AVG, histogram_u64_series_read},
+		{"get_reset_interval_sec",  	series, HISTOGRAM_RESET_INTERVAL, histogram_u64_series_read},
+	};
+	unsigned buckets_nr;
+	uint64_t *buckets;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!series->precision_bits)
+		series->precision_bits = PROCSTAT_BUCKET_BITS;
+	if (series->precision_bits < PROCSTAT_U64_BUCKET_BITS_MIN ||
+	    series->precision_bits > PROCSTAT_U64_BUCKET_BITS_MAX ||
+	    series->npercentile < 0 || series->npercentile > MAX_SUPPORTED_PERCENTILE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	series_stat = calloc(1, sizeof(*series_stat));
+	if (!series_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	error = init_directory(context, &series_stat->root, name, (struct procstat_directory *)parent);
+	if (error) {
+		free_item(&series_stat->root.base);
+		errno = error;
+		return -1;
+	}
+
+	series_stat->root.base.flags |= STATS_ENTRY_FLAG_HISTOGRAM_U64;
+	series_stat->private = series;
+	INIT_LIST_HEAD(&series_stat->standby_entry);
+	memset(series->buffers, 0, sizeof(series->buffers));
+	buckets_nr = PROCSTAT_U64_BUCKETS_NR(series->precision_bits);
+	buckets = calloc(2 * buckets_nr, sizeof(*buckets));
+	if (!buckets) {
+		errno = ENOMEM;
+		goto fail_remove_stat;
+	}
+	series->buffers[0].histogram = buckets;
+	series->buffers[1].histogram = buckets + buckets_nr;
+	series->active = &series->buffers[0];
+	series->standby = &series->buffers[1];
+	series->standby_dirty = HISTOGRAM_STANDBY_CLEAN;
+	series->seq = 0;
+	series->generation = 0;
+	memset(&series->percentile_cache, 0, sizeof(series->percentile_cache));
+
+	error = procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
+	if (error) {
+		errno = error;
+		goto fail_remove_stat;
+	}
+
+	for (i = 0; i < series->npercentile; ++i) {
+		char stat_name[100];
+		struct procstat_file *file;
+
+		sprintf(stat_name, "%.4g", series->percentile[i].fraction * 100);
+		file = create_file(context, (struct procstat_directory *)&series_stat->root.base,
+				   stat_name, series, histogram_u64_fmt_percentile, NULL);
+		if (!file)
+			goto fail_remove_stat;
+		file->arg = i;
+	}
+
+	reset_init(&series->reset);
+
+	control[0].object = series_stat;
+	control[1].object = series_stat;
+	error = procstat_create_simple(context, &series_stat->root.base, control, 2);
+	if (error)
+		goto fail_remove_stat;
+
+	track_histogram(context, series_stat);
+	return 0;
+
+fail_remove_stat:
+	procstat_remove(context, &series_stat->root.base);
+	return -1;
+}
+
+void procstat_histogram_u64_series_set_reset_interval(struct procstat_histogram_u64 *series, int reset_interval)
+{
+	reset_set_interval(&series->reset, reset_interval);
+}
+
+/*
+ * Sharded statistics: on its first write every thread takes a slot out of a 64 bit bitmap
+ * (PROCSTAT_MAX_SHARDS) and keeps it until it exits, when the thread key destructor returns the
+ * slot. Hence a shard is never written by two live threads and can be updated with plain stores.
+ * Threads that find the bitmap full use the overflow shard, which is protected by a spinlock.
+ */
+#define SHARD_OVERFLOW PROCSTAT_MAX_SHARDS
+
+static uint64_t shard_slots;
+static pthread_key_t shard_slot_key;
+static pthread_once_t shard_slot_once = PTHREAD_ONCE_INIT;
+static __thread int shard_slot = -1;
+
+static void shard_slot_release(void *value)
+{
+	uint64_t slot = (uintptr_t)value - 1;
+
+	__atomic_fetch_and(&shard_slots, ~(1ULL << slot), __ATOMIC_RELEASE);
+}
+
+static void shard_slot_key_init(void)
+{
+	pthread_key_create(&shard_slot_key, shard_slot_release);
+}
+
+static int shard_slot_alloc(void)
+{
+	uint64_t slots;
+	int slot;
+
+	pthread_once(&shard_slot_once, shard_slot_key_init);
+	slots = __atomic_load_n(&shard_slots, __ATOMIC_RELAXED);
+	do {
+		if (slots == ~0ULL) {
+			shard_slot = SHARD_OVERFLOW;
+			return shard_slot;
+		}
+		slot = __builtin_ctzll(~slots);
+	} while (!__atomic_compare_exchange_n(&shard_slots, &slots, slots | (1ULL << slot),
+					      false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	pthread_setspecific(shard_slot_key, (void *)(uintptr_t)(slot + 1));
+	shard_slot = slot;
+	return slot;
+}
+
+static inline int current_shard_slot(void)
+{
+	if (__builtin_expect(shard_slot >= 0, 1))
+		return shard_slot;
+	return shard_slot_alloc();
+}
+
+static inline void shard_overflow_lock(uint32_t *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void shard_overflow_unlock(uint32_t *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static void *shard_alloc(size_t size)
+{
+	void *shard;
+
+	if (posix_memalign(&shard, PROCSTAT_CACHELINE_SIZE, size))
+		return NULL;
+	memset(shard, 0, size);
+	return shard;
+}
+
+static inline void shard_set_last(uint32_t *last_shard, int slot)
+{
+	/* only store when it changes, so a dominant writer keeps the line shared */
+	if (__atomic_load_n(last_shard, __ATOMIC_RELAXED) != slot)
+		__atomic_store_n(last_shard, slot, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reset of sharded statistics never touches the shards: the generation is advanced and
+ * every writer clears its own shard once it notices the new generation. Readers ignore
+ * shards of older generations.
+ */
+static void sharded_reset_check(struct reset_info *reset, uint32_t *generation)
+{
+	reset_epoch_refresh();
+	if (is_reset(reset))
+		__atomic_fetch_add(generation, 1, __ATOMIC_RELEASE);
+}
+
+static ssize_t reset_sharded(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	uint32_t *generation = object;
+	uint32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control != 1)
+		return EINVAL;
+
+	__atomic_fetch_add(generation, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static ssize_t set_reset_interval_sharded(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct reset_info *reset = object;
+	int32_t control;
+
+	control = strtoul(buffer, NULL, 10);
+	if (control < 0)
+		return EINVAL;
+
+	reset_set_interval(reset, control);
+	return 1;
+}
+
+struct procstat_series_u64_shard {
+	struct procstat_series_u64 	values;
+	uint32_t 			generation;
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+static struct procstat_series_u64_shard *series_shard_get(struct procstat_series_u64_sharded *series,
+							  int slot, uint32_t generation)
+{
+	struct procstat_series_u64_shard *shard = series->shards[slot];
+
+	if (__builtin_expect(shard != NULL, 1))
+		return shard;
+
+	shard = shard_alloc(sizeof(*shard));
+	if (!shard)
+		return NULL;
+	clear_values_series(&shard->values);
+	shard->generation = generation;
+	__atomic_store_n(&series->shards[slot], shard, __ATOMIC_RELEASE);
+	return shard;
+}
+
+static inline void series_shard_add_point(struct procstat_series_u64_shard *shard,
+					  uint32_t generation, uint64_t value)
+{
+	seqcount_write_begin(&shard->values.seq);
+	if (shard->generation != generation) {
+		clear_values_series(&shard->values);
+		__atomic_store_n(&shard->generation, generation, __ATOMIC_RELAXED);
+	}
+	series_u64_update(&shard->values, value);
+	seqcount_write_end(&shard->values.seq);
+}
+
+void procstat_u64_series_sharded_add_point(struct procstat_series_u64_sharded *series, uint64_t value)
+{
+	uint32_t generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+	struct procstat_series_u64_shard *shard;
+	int slot = current_shard_slot();
+
+	if (__builtin_expect(slot != SHARD_OVERFLOW, 1)) {
+		shard = series_shard_get(series, slot, generation);
+		if (shard)
+			series_shard_add_point(shard, generation, value);
+	} else {
+		shard_overflow_lock(&series->overflow_lock);
+		shard = series_shard_get(series, slot, generation);
+		if (shard)
+			series_shard_add_point(shard, generation, value);
+		shard_overflow_unlock(&series->overflow_lock);
+	}
+	shard_set_last(&series->last_shard, slot);
+}
+
+/*
+ * Merge all shards of the current generation into @out. Means and variances of the shards
+ * are combined with the pairwise update of Chan et al.
+ */
+static void series_sharded_snapshot(struct procstat_series_u64_sharded *series,
+				    struct procstat_series_u64 *out)
+{
+	uint32_t generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+	uint32_t last_shard = __atomic_load_n(&series->last_shard, __ATOMIC_RELAXED);
+	double mean = 0, aggregated_variance = 0;
+	int i;
+
+	memset(out, 0, sizeof(*out));
+	out->min = ULLONG_MAX;
+	for (i = 0; i <= PROCSTAT_MAX_SHARDS; ++i) {
+		struct procstat_series_u64_shard *shard;
+		struct procstat_series_u64 values;
+		uint64_t count;
+		double delta;
+
+		shard = __atomic_load_n(&series->shards[i], __ATOMIC_ACQUIRE);
+		if (!shard || __atomic_load_n(&shard->generation, __ATOMIC_RELAXED) != generation)
+			continue;
+		series_u64_snapshot(&shard->values, &values);
+		if (!values.count)
+			continue;
+
+		count = out->count + values.count;
+		delta = (double)values.mean - mean;
+		mean += delta * values.count / count;
+		aggregated_variance += (double)values.aggregated_variance +
+				       delta * delta * out->count * values.count / count;
+		out->count = count;
+		out->sum += values.sum;
+		if (values.min < out->min)
+			out->min = values.min;
+		if (values.max > out->max)
+			out->max = values.max;
+		if (i == last_shard)
+			out->last = values.last;
+	}
+	out->mean = mean;
+	out->aggregated_variance = aggregated_variance;
+	out->reset.reset_interval = series->reset.reset_interval;
+}
+
+static ssize_t series_u64_sharded_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_series_u64_sharded *series = object;
+	struct procstat_series_u64 snapshot;
+
+	sharded_reset_check(&series->reset, &series->generation);
+	series_sharded_snapshot(series, &snapshot);
+	return format_series_u64(&snapshot, arg, buffer, len);
+}
+
+int procstat_create_u64_series_sharded(struct procstat_context *context, struct procstat_item *parent,
+				       const char *name, struct procstat_series_u64_sharded *series)
+{
+	struct procstat_series *series_stat;
+	struct procstat_simple_handle descriptors[] = {
+			{"sum",    			series, SERIES_SUM, series_u64_sharded_read},
+			{"count",  			series, SERIES_COUNT, series_u64_sharded_read},
+			{"min",    			series, SERIES_MIN, series_u64_sharded_read},
+			{"max",    			series, SERIES_MAX, series_u64_sharded_read},
+			{"last",   			series, SERIES_LAST, series_u64_sharded_read},
+			{"avg",    			series, SERIES_AVG, series_u64_sharded_read},
+			{"mean",   			series, SERIES_MEAN, series_u64_sharded_read},
+			{"stddev", 			series, SERIES_STDEV, series_u64_sharded_read},
+			{"get_reset_interval_sec", 	series, SERIES_RESET_INTERVAL, series_u64_sharded_read},
+			{.name = "reset", .object = &series->generation, .writer = reset_sharded},
+			{.name = "reset_interval_sec", .object = &series->reset, .writer = set_reset_interval_sharded}};
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	series_stat = calloc(1, sizeof(*series_stat));
+	if (!series_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+	series_stat->private = series;
+	reset_init(&series->reset);
+
+	error = init_directory(context, &series_stat->root,
+			       name, (struct procstat_directory *)parent);
+	if (error) {
+		free_item(&series_stat->root.base);
+		errno = error;
+		return -1;
+	}
+	series_stat->root.base.flags |= STATS_ENTRY_FLAG_SHARDED_SERIES;
+
+	error = procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
+	if (error) {
+		procstat_remove(context, &series_stat->root.base);
+		return -1;
+	}
+	return 0;
+}
+
+struct procstat_histogram_u32_shard {
+	uint64_t 	sum;
+	uint64_t 	count;
+	uint64_t 	last;
+	uint32_t 	generation;
+	uint32_t 	histogram[PROCSTAT_PERCENTILE_ARR_NR];
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+/* writers stopped before the removal, the shards are not referenced anymore */
+static void free_shards(void **shards)
+{
+	int i;
+
+	for (i = 0; i <= PROCSTAT_MAX_SHARDS; ++i) {
+		free(shards[i]);
+		shards[i] = NULL;
+	}
+}
+
+static void free_sharded(struct procstat_series *series)
+{
+	if (series->root.base.flags & STATS_ENTRY_FLAG_SHARDED_SERIES) {
+		struct procstat_series_u64_sharded *sharded = series->private;
+
+		free_shards((void **)sharded->shards);
+	} else {
+		struct procstat_histogram_u32_sharded *sharded = series->private;
+
+		free_shards((void **)sharded->shards);
+	}
+}
+
+static struct procstat_histogram_u32_shard *histogram_shard_get(struct procstat_histogram_u32_sharded *series,
+								int slot, uint32_t generation)
+{
+	struct procstat_histogram_u32_shard *shard = series->shards[slot];
+
+	if (__builtin_expect(shard != NULL, 1))
+		return shard;
+
+	shard = shard_alloc(sizeof(*shard));
+	if (!shard)
+		return NULL;
+	shard->generation = generation;
+	__atomic_store_n(&series->shards[slot], shard, __ATOMIC_RELEASE);
+	return shard;
+}
+
+static inline void histogram_shard_add_point(struct procstat_histogram_u32_shard *shard,
+					     uint32_t generation, uint32_t value)
+{
+	if (shard->generation != generation) {
+		shard->count = 0;
+		shard->sum = 0;
+		shard->last = 0;
+		memset(shard->histogram, 0, sizeof(shard->histogram));
+		__atomic_store_n(&shard->generation, generation, __ATOMIC_RELAXED);
+	}
+	++shard->count;
+	shard->sum += value;
+	shard->last = value;
+	procstat_hist_add_point(shard->histogram, value);
+}
+
+void procstat_histogram_u32_sharded_add_point(struct procstat_histogram_u32_sharded *series, uint32_t value)
+{
+	uint32_t generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+	struct procstat_histogram_u32_shard *shard;
+	int slot = current_shard_slot();
+
+	if (__builtin_expect(slot != SHARD_OVERFLOW, 1)) {
+		shard = histogram_shard_get(series, slot, generation);
+		if (shard)
+			histogram_shard_add_point(shard, generation, value);
+	} else {
+		shard_overflow_lock(&series->overflow_lock);
+		shard = histogram_shard_get(series, slot, generation);
+		if (shard)
+			histogram_shard_add_point(shard, generation, value);
+		shard_overflow_unlock(&series->overflow_lock);
+	}
+	shard_set_last(&series->last_shard, slot);
+}
+
+/*
+ * Merge sum, count and last of the current generation shards into @out, and in case
+ * @buckets is not NULL sum up the shard buckets into it as well.
+ */
+static void histogram_sharded_snapshot(struct procstat_histogram_u32_sharded *series,
+				       struct histogram_u32_snapshot *out, uint32_t *buckets)
+{
+	uint32_t generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+	uint32_t last_shard = __atomic_load_n(&series->last_shard, __ATOMIC_RELAXED);
+	int i;
+
+	out->sum = 0;
+	out->count = 0;
+	out->last = 0;
+	out->reset_interval = series->reset.reset_interval;
+	for (i = 0; i <= PROCSTAT_MAX_SHARDS; ++i) {
+		struct procstat_histogram_u32_shard *shard;
+
+		shard = __atomic_load_n(&series->shards[i], __ATOMIC_ACQUIRE);
+		if (!shard || __atomic_load_n(&shard->generation, __ATOMIC_RELAXED) != generation)
+			continue;
+
+		out->sum += shard->sum;
+		out->count += shard->count;
+		if (i == last_shard)
+			out->last = shard->last;
+		if (buckets)
+			procstat_hist_merge(buckets, shard->histogram);
+	}
+}
+
+static ssize_t histogram_u32_sharded_read(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	struct procstat_histogram_u32_sharded *series = object;
+	struct histogram_u32_snapshot snapshot;
+
+	sharded_reset_check(&series->reset, &series->generation);
+	histogram_sharded_snapshot(series, &snapshot, NULL);
+	return format_histogram_u32(&snapshot, arg, buffer, len);
+}
+
+static ssize_t histogram_u32_sharded_fmt_percentile(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	struct procstat_histogram_u32_sharded *series = object;
+	struct histogram_u32_snapshot snapshot;
+	uint32_t buckets[PROCSTAT_PERCENTILE_ARR_NR];
+	uint32_t generation;
+	uint32_t value = 0;
+
+	sharded_reset_check(&series->reset, &series->generation);
+	generation = __atomic_load_n(&series->generation, __ATOMIC_ACQUIRE);
+	histogram_sharded_snapshot(series, &snapshot, NULL);
+	if (!snapshot.count)
+		goto out;
+
+	percentile_cache_lock(&series->percentile_cache);
+	if (!percentile_cache_hit(&series->percentile_cache, generation, snapshot.count)) {
+		memset(buckets, 0, sizeof(buckets));
+		histogram_sharded_snapshot(series, &snapshot, buckets);
+		series->compute_cb(buckets, snapshot.count, series->percentile, series->npercentile);
+	}
+	value = series->percentile[arg].value;
+	percentile_cache_unlock(&series->percentile_cache);
+out:
+	return procstat_format_u32_decimal(&value, 0, buffer, length);
+}
+
+int procstat_create_histogram_u32_sharded(struct procstat_context *context, struct procstat_item *parent,
+					  const char *name, struct procstat_histogram_u32_sharded *series)
+{
+	int i;
+	struct procstat_series *series_stat;
+	struct procstat_simple_handle descriptors[] = {
+		{"sum",    			series, HISTOGRAM_SUM, histogram_u32_sharded_read},
+		{"count",  			series, HISTOGRAM_COUNT, histogram_u32_sharded_read},
+		{"last",   			series, HISTOGRAM_LAST, histogram_u32_sharded_read},
+		{"avg",    			series, HISTOGRAM_AVG, histogram_u32_sharded_read},
+		{"get_reset_interval_sec",  	series, HISTOGRAM_RESET_INTERVAL, histogram_u32_sharded_read},
+		{.name = "reset", .object = &series->generation, .writer = reset_sharded},
+		{.name = "reset_interval_sec", .object = &series->reset, .writer = set_reset_interval_sharded},
+	};
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	series_stat = calloc(1, sizeof(*series_stat));
+	if (!series_stat) {
+		errno = ENOMEM;
+		return -1;
+	}
+	series_stat->private = series;
+	reset_init(&series->reset);
+	memset(&series->percentile_cache, 0, sizeof(series->percentile_cache));
+	if (!series->compute_cb)
+		series->compute_cb = procstat_percentile_calculate;
+
+	error = init_directory(context, &series_stat->root, name, (struct procstat_directory *)parent);
+	if (error) {
+		free_item(&series_stat->root.base);
+		errno = error;
+		return -1;
+	}
+	series_stat->root.base.flags |= STATS_ENTRY_FLAG_SHARDED_HISTOGRAM;
+
+	error = procstat_create_simple(context, &series_stat->root.base, descriptors, ARRAY_SIZE(descriptors));
+	if (error)
+		goto fail_remove_stat;
+
+	for (i = 0; i < series->npercentile; ++i) {
+		char stat_name[100];
+		struct procstat_file *file;
+
+		sprintf(stat_name, "%.4g", series->percentile[i].fraction * 100);
+		file = create_file(context, (struct procstat_directory *)&series_stat->root.base,
+				   stat_name, series, histogram_u32_sharded_fmt_percentile, NULL);
+		if (!file)
+			goto fail_remove_stat;
+		file->arg = i;
+	}
+
+	return 0;
+
+fail_remove_stat:
+	procstat_remove(context, &series_stat->root.base);
+	return -1;
+}
+
+/*
+ * Fill @buckets, which the caller frees, with the cumulative buckets of a histogram directory
+ * @item. With @dense_layout empty buckets below the highest non empty one are output as well,
+ * otherwise they are skipped. The buckets are not covered by the sequence counter, so their last
+ * cumulative count rather than the snapshot count is reported. Values pending reset have no buckets.
+ * @return the number of buckets, or -1 in case of no memory
+ */
+static ssize_t histogram_export(struct procstat_item *item, uint64_t *sum, struct histogram_bucket **buckets,
+				bool dense_layout)
+{
+	struct procstat_series *series_stat = (struct procstat_series *)item;
+	struct histogram_u32_snapshot snapshot;
+	uint32_t *dense = NULL;
+	uint64_t *dense_u64 = NULL;
+	unsigned precision_bits = 0;
+	unsigned buckets_nr = 0;
+	uint64_t total = 0;
+	ssize_t nbuckets = 0;
+	unsigned i;
+
+	if (item->flags & STATS_ENTRY_FLAG_HISTOGRAM) {
+		struct procstat_histogram_u32 *series = series_stat->private;
+
+		reset_epoch_refresh();
+		histogram_u32_recycle_standby(series);
+		histogram_u32_snapshot(series, &snapshot);
+		if (!reset_pending(&series->reset)) {
+			dense = malloc(PROCSTAT_PERCENTILE_ARR_NR * sizeof(*dense));
+			if (!dense)
+				return -1;
+			procstat_hist_sparse_read(&__atomic_load_n(&series->active, __ATOMIC_ACQUIRE)->buckets, dense);
+			buckets_nr = PROCSTAT_PERCENTILE_ARR_NR;
+		}
+	} else if (item->flags & STATS_ENTRY_FLAG_HISTOGRAM_U64) {
+		struct procstat_histogram_u64 *series = series_stat->private;
+
+		reset_epoch_refresh();
+		histogram_u64_recycle_standby(series);
+		histogram_u64_snapshot(series, &snapshot);
+		if (!reset_pending(&series->reset)) {
+			dense_u64 = __atomic_load_n(&series->active, __ATOMIC_ACQUIRE)->histogram;
+			precision_bits = series->precision_bits;
+			buckets_nr = PROCSTAT_U64_BUCKETS_NR(precision_bits);
+		}
+	} else {
+		struct procstat_histogram_u32_sharded *series = series_stat->private;
+
+		sharded_reset_check(&series->reset, &series->generation);
+		dense = calloc(PROCSTAT_PERCENTILE_ARR_NR, sizeof(*dense));
+		if (!dense)
+			return -1;
+		histogram_sharded_snapshot(series, &snapshot, dense);
+		buckets_nr = PROCSTAT_PERCENTILE_ARR_NR;
+	}
+
+	/* nothing is output past the highest non empty bucket */
+	while (buckets_nr && !(dense ? dense[buckets_nr - 1] : dense_u64[buckets_nr - 1]))
+		--buckets_nr;
+
+	*sum = snapshot.sum;
+	*buckets = malloc(MAX(buckets_nr, 1) * sizeof(**buckets));
+	if (!*buckets) {
+		free(dense);
+		return -1;
+	}
+	for (i = 0; i < buckets_nr; ++i) {
+		uint64_t count = dense ? dense[i] : dense_u64[i];
+
+		if (!count && !dense_layout)
+			continue;
+		total += count;
+		(*buckets)[nbuckets].le = dense ? procstat_percentile_idx_to_max(i) :
+						  procstat_percentile_u64_idx_to_max(precision_bits, i);
+		(*buckets)[nbuckets++].count = total;
+	}
+	free(dense);
+	return nbuckets;
+}
+
+/*
+ * Per cpu counters. On x86_64 the current thread rseq area is used to find the cpu and the
+ * slot is updated inside a restartable sequence: in case the thread is preempted, migrated or
+ * signaled before the add is committed the kernel moves it to the abort handler and the add is
+ * retried. With glibc 2.35+ the rseq area glibc registered is used, and in case glibc did not
+ * register one (disabled by the glibc.pthread.rseq tunable, usually for the sake of another rseq
+ * user) none is registered either. Only older glibc leaves the registration to the thread, which
+ * then registers its own area and unregisters it on exit. Everywhere else the counter falls back
+ * to the sharded statistics thread slots.
+ */
+struct procstat_percpu_slot {
+	uint64_t value;
+} __attribute__((aligned(PROCSTAT_CACHELINE_SIZE)));
+
+struct procstat_rseq_abi {
+	uint32_t cpu_id_start;
+	uint32_t cpu_id;
+	uint64_t rseq_cs;
+	uint32_t flags;
+} __attribute__((aligned(32)));
+
+#if defined(__x86_64__) && defined(__NR_rseq)
+#define PROCSTAT_RSEQ 1
+#define RSEQ_SIG 0x53053053
+#define __rseq_str_1(x) #x
+#define __rseq_str(x) __rseq_str_1(x)
+
+extern ptrdiff_t __rseq_offset __attribute__((weak));
+extern unsigned int __rseq_size __attribute__((weak));
+
+#define RSEQ_FLAG_UNREGISTER 1
+
+static __thread struct procstat_rseq_abi rseq_own_area = {.cpu_id = (uint32_t)-1};
+static __thread struct procstat_rseq_abi *rseq_area;
+static __thread int rseq_state;
+static pthread_key_t rseq_own_key;
+static pthread_once_t rseq_own_once = PTHREAD_ONCE_INIT;
+static bool rseq_own_key_valid;
+
+/* the kernel must stop updating the area before the thread local storage is gone */
+static void rseq_own_unregister(void *value)
+{
+	syscall(__NR_rseq, &rseq_own_area, sizeof(rseq_own_area), RSEQ_FLAG_UNREGISTER, RSEQ_SIG);
+}
+
+static void rseq_own_key_init(void)
+{
+	rseq_own_key_valid = !pthread_key_create(&rseq_own_key, rseq_own_unregister);
+}
+
+static struct procstat_rseq_abi *rseq_thread_register(void)
+{
+	if (&__rseq_size) {
+		char *thread_pointer;
+
+		if (!__rseq_size)
+			goto fail;
+		asm ("mov %%fs:0, %0" : "=r" (thread_pointer));
+		rseq_area = (struct procstat_rseq_abi *)(thread_pointer + __rseq_offset);
+	} else {
+		pthread_once(&rseq_own_once, rseq_own_key_init);
+		/* an area that cannot be unregistered on exit is not registered */
+		if (!rseq_own_key_valid || pthread_setspecific(rseq_own_key, &rseq_own_area))
+			goto fail;
+		if (syscall(__NR_rseq, &rseq_own_area, sizeof(rseq_own_area), 0, RSEQ_SIG)) {
+			pthread_setspecific(rseq_own_key, NULL);
+			goto fail;
+		}
+		rseq_area = &rseq_own_area;
+	}
+	rseq_state = 1;
+	return rseq_area;
+fail:
+	rseq_state = -1;
+	return NULL;
+}
+
+static inline struct procstat_rseq_abi *rseq_thread_area(void)
+{
+	if (__builtin_expect(rseq_state > 0, 1))
+		return rseq_area;
+	if (rseq_state < 0)
+		return NULL;
+	return rseq_thread_register();
+}
+
+/* @return 0 if @value was added to @v while running on @cpu, -1 if the sequence was aborted */
+static inline int rseq_add_u64(struct procstat_rseq_abi *rseq, uint64_t *v, uint64_t value, uint32_t cpu)
+{
+	__asm__ __volatile__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %[rseq_cs]\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %[current_cpu]\n\t"
+		"jnz 4f\n\t"
+		"addq %[value], %[v]\n\t"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		/* signature the kernel validates before jumping to the abort handler */
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " __rseq_str(RSEQ_SIG) "\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [cpu] "r" (cpu), [current_cpu] "m" (rseq->cpu_id),
+		  [rseq_cs] "m" (rseq->rseq_cs), [v] "m" (*v), [value] "r" (value)
+		: "memory", "cc", "rax"
+		: abort);
+	return 0;
+abort:
+	return -1;
+}
+#endif
+
+static struct procstat_percpu_slot *percpu_thread_slots(struct procstat_percpu_u64 *counter)
+{
+	struct procstat_percpu_slot *slots, *expected = NULL;
+
+	slots = __atomic_load_n(&counter->thread_slots, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(slots != NULL, 1))
+		return slots;
+
+	slots = shard_alloc((PROCSTAT_MAX_SHARDS + 1) * sizeof(*slots));
+	if (!slots)
+		return NULL;
+	if (!__atomic_compare_exchange_n(&counter->thread_slots, &expected, slots,
+					 false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(slots);
+		slots = expected;
+	}
+	return slots;
+}
+
+static void percpu_thread_add(struct procstat_percpu_u64 *counter, uint64_t value)
+{
+	struct procstat_percpu_slot *slots = percpu_thread_slots(counter);
+	int slot = current_shard_slot();
+
+	if (!slots)
+		return;
+	if (__builtin_expect(slot != SHARD_OVERFLOW, 1))
+		__atomic_store_n(&slots[slot].value, slots[slot].value + value, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&slots[slot].value, value, __ATOMIC_RELAXED);
+}
+
+void procstat_percpu_u64_add(struct procstat_percpu_u64 *counter, uint64_t value)
+{
+#ifdef PROCSTAT_RSEQ
+	struct procstat_rseq_abi *rseq = rseq_thread_area();
+
+	while (rseq) {
+		uint32_t cpu = *((volatile uint32_t *)&rseq->cpu_id);
+
+		if (cpu >= counter->nr_cpus)
+			break;
+		if (rseq_add_u64(rseq, &counter->cpu_slots[cpu].value, value, cpu) == 0)
+			return;
+	}
+#endif
+	percpu_thread_add(counter, value);
+}
+
+uint64_t procstat_percpu_u64_read(struct procstat_percpu_u64 *counter)
+{
+	struct procstat_percpu_slot *slots;
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < counter->nr_cpus; ++i)
+		sum += __atomic_load_n(&counter->cpu_slots[i].value, __ATOMIC_RELAXED);
+
+	slots = __atomic_load_n(&counter->thread_slots, __ATOMIC_ACQUIRE);
+	if (slots) {
+		for (i = 0; i <= PROCSTAT_MAX_SHARDS; ++i)
+			sum += __atomic_load_n(&slots[i].value, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+static ssize_t percpu_u64_format(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	uint64_t value = procstat_percpu_u64_read(object);
+
+	return procstat_format_u64_decimal(&value, arg, buffer, length);
+}
+
+static void free_percpu(struct procstat_file *file)
+{
+	struct procstat_percpu_u64 *counter = file->private;
+
+	free(counter->cpu_slots);
+	free(counter->thread_slots);
+	counter->cpu_slots = NULL;
+	counter->thread_slots = NULL;
+	counter->nr_cpus = 0;
+}
+
+int procstat_create_percpu_u64(struct procstat_context *context, struct procstat_item *parent,
+			       const char *name, struct procstat_percpu_u64 *counter)
+{
+	struct procstat_file *file;
+	int nr_cpus = get_nprocs_conf();
+
+	parent = parent_or_root(context, parent);
+	if (!parent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	counter->cpu_slots = shard_alloc(nr_cpus * sizeof(*counter->cpu_slots));
+	if (!counter->cpu_slots) {
+		errno = ENOMEM;
+		return -1;
+	}
+	counter->thread_slots = NULL;
+	counter->nr_cpus = nr_cpus;
+
+	file = create_file(context, (struct procstat_directory *)parent, name, counter, percpu_u64_format, NULL);
+	if (!file) {
+		free(counter->cpu_slots);
+		counter->cpu_slots = NULL;
+		counter->nr_cpus = 0;
+		return -1;
+	}
+	file->base.flags |= STATS_ENTRY_FLAG_PERCPU;
+	return 0;
+}
+
+struct procstat_item *procstat_lookup_item(struct procstat_context *context,
+		struct procstat_item *parent, const char *name)
+{
+	struct procstat_item *item = NULL;
+
+	pthread_rwlock_rdlock(&context->tree_lock);
+	parent = parent_or_root(context, parent);
+
+	if (!item_registered(parent)) {
+		goto done;
+	}
+
+	item = lookup_item_locked((struct procstat_directory *)parent,
+				  name, string_hash(name));
+
+	if (!item || !item_registered(item)) {
+		item = NULL;
+		goto done;
+	}
+
+	item_get(item);
+
+done:
+	pthread_rwlock_unlock(&context->tree_lock);
+	return item;
+}
+
+ssize_t procstat_read_path(struct procstat_context *context, const char *path, char *buffer, size_t length)
+{
+	struct procstat_item *item = &context->root.base;
+	struct procstat_file *file;
+	char name[MAX_PATH_LEN];
+	const char *next;
+	ssize_t size;
+	int error = 0;
+
+	pthread_rwlock_rdlock(&context->tree_lock);
+	for (; *path && !error; path = next) {
+		size_t len;
+
+		next = strchr(path, '/');
+		if (!next)
+			next = path + strlen(path);
+		len = next - path;
+		if (*next)
+			++next;
+		/* empty components of "//" and trailing slashes are skipped */
+		if (!len)
+			continue;
+		if (len >= sizeof(name)) {
+			error = ENAMETOOLONG;
+			break;
+		}
+		if (!item_type_directory(item)) {
+			error = ENOTDIR;
+			break;
+		}
+		memcpy(name, path, len);
+		name[len] = 0;
+		item = lookup_item_locked((struct procstat_directory *)item, name, string_hash(name));
+		if (!item || !item_registered(item))
+			error = ENOENT;
+	}
+
+	if (!error && item_type_directory(item))
+		error = EISDIR;
+	file = container_of(item, struct procstat_file, base);
+	if (!error && !file->fmt)
+		error = EPERM;
+	if (error) {
+		pthread_rwlock_unlock(&context->tree_lock);
+		errno = error;
+		return -1;
+	}
+
+	size = file->fmt(file->private, file->arg, buffer, length);
+	pthread_rwlock_unlock(&context->tree_lock);
+	if (size < 0)
+		errno = EIO;
+	return size;
+}
+
+char *procstat_snapshot(struct procstat_context *context, struct procstat_item *parent,
+			enum procstat_aggregator_format format, size_t *size)
+{
+	struct read_struct *rs;
+	char *snapshot;
+	int error;
+
+	parent = parent_or_root(context, parent);
+	if (!parent || format > PROCSTAT_FORMAT_PROMETHEUS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rs = malloc(sizeof(*rs));
+	if (!rs) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	read_struct_init(rs);
+	error = tree_snapshot_build(context, (struct procstat_directory *)parent, NULL, format, NULL, rs);
+	snapshot = error ? NULL : malloc(rs->size + 1);
+	if (snapshot) {
+		memcpy(snapshot, rs->buffer, rs->size);
+		snapshot[rs->size] = 0;
+		if (size)
+			*size = rs->size;
+	}
+	read_struct_free(rs);
+	if (!snapshot)
+		errno = error ? error : ENOMEM;
+	return snapshot;
+}
+
+void procstat_refget(struct procstat_context *context, struct procstat_item *item)
+{
+	/* the caller holds a reference already, so the item cannot go away meanwhile */
+	item_get(item);
+}
+
+void procstat_refput(struct procstat_context *context, struct procstat_item *item)
+{
+	if (item_put_unless_last(item, 1))
+		return;
+
+	pthread_rwlock_wrlock(&context->tree_lock);
+	if (!item_put_unless_last(item, 1))
+		item_put_locked(item);
+	tree_write_unlock(context);
+}
+
+void procstat_remove_subtree(struct procstat_context *context, struct procstat_item* directory)
+{
+	pthread_rwlock_wrlock(&context->tree_lock);
+	if (item_type_directory(directory))
+		item_put_children_locked((struct procstat_directory*)directory);
+	tree_write_unlock(context);
+}
+/*
+ * Shared memory export. Every publish collects and pins the files like snapshot aggregators do,
+ * formats them in batches under the tree lock into a private image, and copies the image into the
+ * segment under its sequence counter. The tree lock is not held while the segment is written and
+ * readers of the segment never block the publisher.
+ */
+#define SHM_SEGMENT_MIN_SIZE (64 * 1024)
+
+struct shm_export {
+	char 				*name;
+	int 				fd;
+	struct procstat_shm_header 	*segment;
+	size_t 				mapped;
+	char 				*image;
+	size_t 				image_size;
+	size_t 				image_capacity;
+	struct read_struct 		*rs; /* formatting buffer, kept grown across publishes */
+	unsigned 			interval_ms;
+	pthread_mutex_t 		lock; /* serializes publishes */
+	pthread_cond_t 			wakeup;
+	bool 				stopping;
+	bool 				threaded;
+	pthread_t 			thread;
+};
+
+static int shm_image_reserve(struct shm_export *shm, size_t size)
+{
+	size_t capacity;
+	char *image;
+
+	if (shm->image_capacity - shm->image_size >= size)
+		return 0;
+
+	capacity = MAX(2 * shm->image_capacity, shm->image_size + size + 4096);
+	image = realloc(shm->image, capacity);
+	if (!image)
+		return ENOMEM;
+	shm->image = image;
+	shm->image_capacity = capacity;
+	return 0;
+}
+
+static void shm_entry_parse(struct procstat_shm_entry *entry, const char *text, size_t len)
+{
+	char *end;
+
+	entry->type = PROCSTAT_SHM_TEXT;
+	if (!aggregator_is_number(text, len))
+		return;
+
+	errno = 0;
+	if (!strpbrk(text, ".eE")) {
+		if (text[0] == '-') {
+			entry->value.s = strtoll(text, &end, 10);
+			entry->type = PROCSTAT_SHM_S64;
+		} else {
+			entry->value.u = strtoull(text, &end, 10);
+			entry->type = PROCSTAT_SHM_U64;
+		}
+		if (!errno)
+			return;
+	}
+	/* fractions, exponents and integers out of range */
+	entry->value.d = strtod(text, &end);
+	entry->type = PROCSTAT_SHM_DOUBLE;
+}
+
+/* appends the entry of @file to the image, @path is the "path/name:" prefix of the aggregator */
+static int shm_image_add(struct shm_export *shm, size_t index, const char *path, struct read_struct *rs)
+{
+	struct procstat_shm_entry *entry;
+	size_t path_len = strlen(path) - 1;
+	size_t text_len;
+	char *text;
+
+	/* files right under the root have an empty path */
+	if (path[0] == '/') {
+		++path;
+		--path_len;
+	}
+	text_len = aggregator_trim(rs->buffer, rs->size);
+	if (shm_image_reserve(shm, path_len + text_len + 2))
+		return ENOMEM;
+	if (shm->image_size + path_len + text_len + 2 > UINT32_MAX)
+		return EFBIG;
+
+	entry = &((struct procstat_shm_header *)shm->image)->entries[index];
+	entry->path = shm->image_size;
+	memcpy(&shm->image[shm->image_size], path, path_len);
+	shm->image[shm->image_size + path_len] = 0;
+	shm->image_size += path_len + 1;
+
+	entry->text = shm->image_size;
+	text = &shm->image[shm->image_size];
+	memcpy(text, rs->buffer, text_len);
+	text[text_len] = 0;
+	shm->image_size += text_len + 1;
+
+	entry->reserved = 0;
+	entry->value.u = 0;
+	shm_entry_parse(entry, text, text_len);
+	return 0;
+}
+
+static int shm_image_build(struct procstat_context *context, struct shm_export *shm, uint32_t *nentries)
+{
+	struct aggregator_snapshot snapshot;
+	char path[MAX_PATH_LEN];
+	bool locked = false;
+	size_t count = 0;
+	int error;
+	size_t i = 0;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	path[0] = 0;
+	pthread_rwlock_rdlock(&context->tree_lock);
+	error = aggregator_collect_locked(&snapshot, path, &context->root, NULL);
+	pthread_rwlock_unlock(&context->tree_lock);
+
+	shm->image_size = 0;
+	if (!error)
+		error = shm_image_reserve(shm, sizeof(struct procstat_shm_header) +
+					  snapshot.count * sizeof(struct procstat_shm_entry));
+	if (!error)
+		shm->image_size = sizeof(struct procstat_shm_header) + snapshot.count * sizeof(struct procstat_shm_entry);
+
+	while (i < snapshot.count && !error) {
+		size_t end = MIN(i + AGGREGATOR_BATCH_SIZE, snapshot.count);
+
+		pthread_rwlock_rdlock(&context->tree_lock);
+		for (; i < end && !error; ++i) {
+			struct aggregator_entry *entry = &snapshot.entries[i];
+
+			/* files removed since the collection may have their objects freed already */
+			if (!item_registered(entry->item))
+				continue;
+			error = read_struct_format(shm->rs, container_of(entry->item, struct procstat_file, base));
+			if (!error)
+				error = shm_image_add(shm, count++, &snapshot.prefixes[entry->prefix], shm->rs);
+		}
+		pthread_rwlock_unlock(&context->tree_lock);
+	}
+
+	for (i = 0; i < snapshot.count; ++i)
+		item_unref_batched(context, snapshot.entries[i].item, 1, &locked);
+	if (locked)
+		pthread_rwlock_unlock(&context->tree_lock);
+	free(snapshot.entries);
+	free(snapshot.prefixes);
+	*nentries = count;
+	return error;
+}
+
+static int shm_segment_resize(struct shm_export *shm, size_t size)
+{
+	size_t mapped = shm->mapped;
+	void *segment;
+
+	while (mapped < size)
+		mapped *= 2;
+	if (mapped == shm->mapped)
+		return 0;
+
+	if (ftruncate(shm->fd, mapped))
+		return errno;
+	segment = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (segment == MAP_FAILED)
+		return errno;
+	munmap(shm->segment, shm->mapped);
+	shm->segment = segment;
+	shm->mapped = mapped;
+	return 0;
+}
+
+static int shm_export_publish_locked(struct procstat_context *context, struct shm_export *shm)
+{
+	struct procstat_shm_header *segment;
+	struct timespec now;
+	uint32_t nentries;
+	int error;
+
+	error = shm_image_build(context, shm, &nentries);
+	if (!error)
+		error = shm_segment_resize(shm, shm->image_size);
+	if (error)
+		return error;
+
+	/* the entries of files removed since the collection are left unused before the strings */
+	segment = shm->segment;
+	clock_gettime(CLOCK_REALTIME, &now);
+	seqcount_write_begin(&segment->seq);
+	segment->nentries = nentries;
+	segment->size = shm->image_size;
+	segment->generation++;
+	segment->published_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	memcpy(segment->entries, shm->image + sizeof(*segment), shm->image_size - sizeof(*segment));
+	seqcount_write_end(&segment->seq);
+	return 0;
+}
+
+static void *shm_export_run(void *arg)
+{
+	struct procstat_context *context = arg;
+	struct shm_export *shm = context->shm;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&shm->lock);
+	while (!shm->stopping) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += shm->interval_ms / 1000;
+		deadline.tv_nsec += (shm->interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		/* a failed publish keeps the previous values, the next interval retries */
+		shm_export_publish_locked(context, shm);
+		while (!shm->stopping && pthread_cond_timedwait(&shm->wakeup, &shm->lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&shm->lock);
+	return NULL;
+}
+
+static void shm_export_free(struct shm_export *shm)
+{
+	if (shm->segment)
+		munmap(shm->segment, shm->mapped);
+	if (shm->fd >= 0) {
+		close(shm->fd);
+		shm_unlink(shm->name);
+	}
+	pthread_cond_destroy(&shm->wakeup);
+	pthread_mutex_destroy(&shm->lock);
+	if (shm->rs)
+		read_struct_free(shm->rs);
+	free(shm->image);
+	free(shm->name);
+	free(shm);
+}
+
+int procstat_shm_export(struct procstat_context *context, const char *name, unsigned interval_ms)
+{
+	struct shm_export *shm;
+	pthread_condattr_t cond_attr;
+	sigset_t all, old;
+	int error;
+
+	if (!name || !name[0] || strchr(name, '/')) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (context->shm) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (!shm) {
+		errno = ENOMEM;
+		return -1;
+	}
+	shm->fd = -1;
+	shm->interval_ms = interval_ms;
+	pthread_mutex_init(&shm->lock, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&shm->wakeup, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	shm->name = malloc(strlen(name) + 2);
+	if (!shm->name) {
+		error = ENOMEM;
+		goto fail;
+	}
+	sprintf(shm->name, "/%s", name);
+	shm->rs = malloc(sizeof(*shm->rs));
+	if (!shm->rs) {
+		error = ENOMEM;
+		goto fail;
+	}
+	read_struct_init(shm->rs);
+	shm->fd = shm_open(shm->name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (shm->fd < 0) {
+		error = errno;
+		goto fail;
+	}
+	shm->mapped = SHM_SEGMENT_MIN_SIZE;
+	if (ftruncate(shm->fd, shm->mapped)) {
+		error = errno;
+		goto fail;
+	}
+	shm->segment = mmap(NULL, shm->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (shm->segment == MAP_FAILED) {
+		shm->segment = NULL;
+		error = errno;
+		goto fail;
+	}
+	shm->segment->magic = PROCSTAT_SHM_MAGIC;
+	shm->segment->version = PROCSTAT_SHM_VERSION;
+
+	/* the segment holds the values once the export returns */
+	error = shm_export_publish_locked(context, shm);
+	if (error)
+		goto fail;
+
+	context->shm = shm;
+	if (interval_ms) {
+		/* the publisher must not steal signals addressed to the application */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		error = pthread_create(&shm->thread, NULL, shm_export_run, context);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (error) {
+			context->shm = NULL;
+			goto fail;
+		}
+		shm->threaded = true;
+	}
+	return 0;
+
+fail:
+	shm_export_free(shm);
+	errno = error;
+	return -1;
+}
+
+int procstat_shm_publish(struct procstat_context *context)
+{
+	struct shm_export *shm = context->shm;
+	int error;
+
+	if (!shm) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	pthread_mutex_lock(&shm->lock);
+	error = shm_export_publish_locked(context, shm);
+	pthread_mutex_unlock(&shm->lock);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void procstat_shm_close(struct procstat_context *context)
+{
+	struct shm_export *shm = context->shm;
+
+	if (!shm)
+		return;
+
+	if (shm->threaded) {
+		pthread_mutex_lock(&shm->lock);
+		shm->stopping = true;
+		pthread_cond_signal(&shm->wakeup);
+		pthread_mutex_unlock(&shm->lock);
+		pthread_join(shm->thread, NULL);
+	}
+	context->shm = NULL;
+	shm_export_free(shm);
+}
+
+/*
+ * Stat servers answer requests on sockets from one epoll thread. Requests are served like shm
+ * publishes: the files are collected and pinned under the tree lock and formatted in batches.
+ * Responses are queued on the connection and sent as the socket drains, a connection is not read
+ * while it has a response pending, so a client that does not read its responses is not buffered
+ * more than one read of requests.
+ */
+#define SERVER_READ_SIZE (64 * 1024)
+#define SERVER_MAX_EVENTS 64
+#define VARINT_MAX_SIZE 10
+
+struct server_buffer {
+	char 	*data;
+	size_t 	size;
+	size_t 	capacity;
+};
+
+struct server_client {
+	struct list_head 	entry;
+	int 			fd;
+	bool 			closing; /* closed by the peer or the protocol, closed once the responses are sent */
+	bool 			writing; /* polled for EPOLLOUT instead of EPOLLIN */
+	struct server_buffer 	in;
+	struct server_buffer 	out;
+	size_t 			sent;
+};
+
+struct stat_server {
+	struct procstat_context *context;
+	int 			listen_fd;
+	int 			epoll_fd;
+	int 			wakeup_fd;
+	char 			*path;    /* unix socket unlinked on close */
+	struct read_struct 	*rs;      /* formatting buffer, kept grown across requests */
+	struct server_buffer 	scratch;
+	struct list_head 	clients;
+	/* consumes the complete requests of @client->in into responses in @client->out */
+	int 			(*handle)(struct stat_server *server, struct server_client *client);
+	z_stream 		*zstream; /* gzip state of HTTP servers */
+	bool 			nodelay;  /* TCP connections, responses are sent as soon as they are ready */
+	bool 			started;
+	pthread_t 		thread;
+};
+
+static int server_buffer_reserve(struct server_buffer *buffer, size_t size)
+{
+	size_t capacity;
+	char *data;
+
+	if (buffer->capacity - buffer->size >= size)
+		return 0;
+
+	capacity = MAX(2 * buffer->capacity, buffer->size + size + 4096);
+	data = realloc(buffer->data, capacity);
+	if (!data)
+		return ENOMEM;
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+static void server_client_close(struct server_client *client)
+{
+	list_del(&client->entry);
+	/* closing the descriptor removes it from the epoll set */
+	close(client->fd);
+	free(client->in.data);
+	free(client->out.data);
+	free(client);
+}
+
+static void server_client_poll(struct stat_server *server, struct server_client *client, bool writing)
+{
+	struct epoll_event event;
+
+	if (client->writing == writing)
+		return;
+	event.events = writing ? EPOLLOUT : EPOLLIN;
+	event.data.ptr = client;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+	client->writing = writing;
+}
+
+static void server_client_flush(struct stat_server *server, struct server_client *client)
+{
+	ssize_t sent;
+
+	while (client->sent < client->out.size) {
+		sent = send(client->fd, &client->out.data[client->sent], client->out.size - client->sent,
+			    MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			server_client_close(client);
+			return;
+		}
+		client->sent += sent;
+	}
+
+	if (client->sent == client->out.size) {
+		client->out.size = 0;
+		client->sent = 0;
+		if (client->closing) {
+			server_client_close(client);
+			return;
+		}
+	}
+	server_client_poll(server, client, client->out.size);
+}
+
+static void server_client_read(struct stat_server *server, struct server_client *client)
+{
+	ssize_t len;
+
+	if (server_buffer_reserve(&client->in, SERVER_READ_SIZE))
+		goto close;
+	len = recv(client->fd, &client->in.data[client->in.size], SERVER_READ_SIZE, 0);
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		goto close;
+	}
+	if (!len)
+		client->closing = true;
+	client->in.size += len;
+	if (server->handle(server, client))
+		goto close;
+	server_client_flush(server, client);
+	return;
+
+close:
+	server_client_close(client);
+}
+
+static void server_accept(struct stat_server *server)
+{
+	struct server_client *client;
+	struct epoll_event event;
+	int one = 1;
+	int fd;
+
+	for (;;) {
+		fd = accept(server->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		if (server->nodelay)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		client->fd = fd;
+		event.events = EPOLLIN;
+		event.data.ptr = client;
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+			close(fd);
+			free(client);
+			continue;
+		}
+		list_add_tail(&client->entry, &server->clients);
+	}
+}
+
+static void *server_run(void *arg)
+{
+	struct stat_server *server = arg;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	int nevents;
+	int i;
+
+	for (;;) {
+		nevents = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+		if (nevents < 0 && errno != EINTR)
+			break;
+
+		/* a descriptor is reported once per wait, so a client closed here has no later events */
+		for (i = 0; i < nevents; ++i) {
+			struct server_client *client = events[i].data.ptr;
+
+			if (events[i].data.ptr == &server->wakeup_fd)
+				return NULL;
+			if (events[i].data.ptr == &server->listen_fd)
+				server_accept(server);
+			else if (client->writing)
+				server_client_flush(server, client);
+			else
+				server_client_read(server, client);
+		}
+	}
+	return NULL;
+}
+
+static struct stat_server *server_alloc(struct procstat_context *context,
+					int (*handle)(struct stat_server *, struct server_client *))
+{
+	struct stat_server *server;
+
+	server = calloc(1, sizeof(*server));
+	if (!server)
+		return NULL;
+	server->context = context;
+	server->handle = handle;
+	server->listen_fd = -1;
+	server->wakeup_fd = -1;
+	INIT_LIST_HEAD(&server->clients);
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->epoll_fd < 0) {
+		free(server);
+		return NULL;
+	}
+	return server;
+}
+
+/* starts serving @server->listen_fd, which must be non blocking and listening */
+static int server_start(struct stat_server *server)
+{
+	struct epoll_event event;
+	sigset_t all, old;
+	int error;
+
+	server->rs = malloc(sizeof(*server->rs));
+	if (!server->rs)
+		return ENOMEM;
+	read_struct_init(server->rs);
+
+	server->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (server->wakeup_fd < 0)
+		return errno;
+	event.events = EPOLLIN;
+	event.data.ptr = &server->wakeup_fd;
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wakeup_fd, &event))
+		return errno;
+	event.data.ptr = &server->listen_fd;
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event))
+		return errno;
+
+	/* the server must not steal signals addressed to the application */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	error = pthread_create(&server->thread, NULL, server_run, server);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	server->started = !error;
+	return error;
+}
+
+static void server_free(struct stat_server *server)
+{
+	struct server_client *client, *tmp;
+
+	if (server->started) {
+		eventfd_write(server->wakeup_fd, 1);
+		pthread_join(server->thread, NULL);
+	}
+	list_for_each_entry_safe(client, tmp, &server->clients, entry)
+		server_client_close(client);
+	if (server->listen_fd >= 0)
+		close(server->listen_fd);
+	if (server->wakeup_fd >= 0)
+		close(server->wakeup_fd);
+	close(server->epoll_fd);
+	if (server->path) {
+		unlink(server->path);
+		free(server->path);
+	}
+	if (server->rs)
+		read_struct_free(server->rs);
+	if (server->zstream)
+		deflateEnd(server->zstream);
+	free(server->zstream);
+	free(server->scratch.data);
+	free(server);
+}
+
+static size_t varint_put(char *out, uint64_t value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		out[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+	return len;
+}
+
+/* @return 0 on success, EAGAIN in case @end cuts the varint and EPROTO in case it is too long */
+static int varint_get(const char **pos, const char *end, uint64_t *value)
+{
+	const char *p = *pos;
+	unsigned shift = 0;
+
+	*value = 0;
+	while (p < end) {
+		unsigned char byte = *p++;
+
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*pos = p;
+			return 0;
+		}
+		shift += 7;
+		if (shift >= 7 * VARINT_MAX_SIZE)
+			return EPROTO;
+	}
+	return EAGAIN;
+}
+
+struct query_pattern {
+	enum procstat_query_kind kind;
+	size_t 			 len;
+	char 			 *pattern;
+};
+
+static bool query_match(const struct query_pattern *patterns, size_t npatterns, const char *path)
+{
+	size_t i;
+
+	if (!npatterns)
+		return true;
+	for (i = 0; i < npatterns; ++i) {
+		if (patterns[i].kind == PROCSTAT_QUERY_PREFIX && !strncmp(path, patterns[i].pattern, patterns[i].len))
+			return true;
+		if (patterns[i].kind == PROCSTAT_QUERY_GLOB && !fnmatch(patterns[i].pattern, path, FNM_PATHNAME))
+			return true;
+	}
+	return false;
+}
+
+/* @patterns and the pattern strings are a single allocation the caller frees */
+static int query_parse(const char *request, size_t size, struct query_pattern **patterns, size_t *npatterns)
+{
+	const char *end = request + size;
+	char *strings;
+	uint64_t count;
+	uint64_t len;
+	size_t i;
+
+	*patterns = NULL;
+	*npatterns = 0;
+	if (varint_get(&request, end, &count))
+		return EINVAL;
+	/* a query takes at least its kind and size */
+	if (count > (uint64_t)(end - request) / 2)
+		return EINVAL;
+	if (!count)
+		return 0;
+
+	*patterns = malloc(count * sizeof(**patterns) + size);
+	if (!*patterns)
+		return ENOMEM;
+	strings = (char *)&(*patterns)[count];
+	for (i = 0; i < count; ++i) {
+		struct query_pattern *query = &(*patterns)[i];
+
+		if (request == end)
+			return EINVAL;
+		query->kind = (unsigned char)*request++;
+		if (query->kind != PROCSTAT_QUERY_PREFIX && query->kind != PROCSTAT_QUERY_GLOB)
+			return EINVAL;
+		if (varint_get(&request, end, &len) || len > (uint64_t)(end - request))
+			return EINVAL;
+		query->pattern = strings;
+		query->len = len;
+		memcpy(strings, request, len);
+		strings[len] = 0;
+		strings += len + 1;
+		request += len;
+	}
+	*npatterns = count;
+	return request == end ? 0 : EINVAL;
+}
+
+static char *query_put_path(struct server_buffer *out, const char *path, size_t path_len,
+			    enum procstat_query_type type)
+{
+	char *pos = &out->data[out->size];
+
+	pos += varint_put(pos, path_len);
+	memcpy(pos, path, path_len);
+	pos += path_len;
+	*pos++ = type;
+	return pos;
+}
+
+static int query_add_histogram(struct server_buffer *out, const char *path, struct procstat_item *item)
+{
+	size_t path_len = strlen(path);
+	struct histogram_bucket *buckets;
+	uint64_t le = 0;
+	uint64_t count = 0;
+	uint64_t sum;
+	ssize_t nbuckets;
+	ssize_t i;
+	char *pos;
+
+	/* empty buckets carry no information for the delta encoded query responses */
+	nbuckets = histogram_export(item, &sum, &buckets, false);
+	if (nbuckets < 0)
+		return ENOMEM;
+	if (server_buffer_reserve(out, path_len + 1 + VARINT_MAX_SIZE * (3 + 2 * nbuckets))) {
+		free(buckets);
+		return ENOMEM;
+	}
+
+	pos = query_put_path(out, path, path_len, PROCSTAT_QUERY_HISTOGRAM);
+	pos += varint_put(pos, sum);
+	pos += varint_put(pos, nbuckets);
+	for (i = 0; i < nbuckets; ++i) {
+		pos += varint_put(pos, buckets[i].le - le);
+		pos += varint_put(pos, buckets[i].count - count);
+		le = buckets[i].le;
+		count = buckets[i].count;
+	}
+	out->size = pos - out->data;
+	free(buckets);
+	return 0;
+}
+
+static int query_add_file(struct server_buffer *out, struct read_struct *rs, const char *path,
+			  struct procstat_file *file)
+{
+	size_t path_len = strlen(path);
+	struct procstat_shm_entry value;
+	uint64_t bits;
+	size_t len;
+	char *pos;
+	int error;
+	int i;
+
+	error = read_struct_format(rs, file);
+	if (error)
+		return error;
+	len = aggregator_trim(rs->buffer, rs->size);
+	value.type = PROCSTAT_SHM_TEXT;
+	if (len < rs->capacity) {
+		rs->buffer[len] = 0;
+		shm_entry_parse(&value, rs->buffer, len);
+	}
+	if (server_buffer_reserve(out, path_len + len + 1 + 2 * VARINT_MAX_SIZE))
+		return ENOMEM;
+
+	/* the query types of values are the shm types */
+	pos = query_put_path(out, path, path_len, value.type);
+	switch (value.type) {
+	case PROCSTAT_SHM_U64:
+		pos += varint_put(pos, value.value.u);
+		break;
+	case PROCSTAT_SHM_S64:
+		pos += varint_put(pos, ((uint64_t)value.value.s << 1) ^ (uint64_t)(value.value.s >> 63));
+		break;
+	case PROCSTAT_SHM_DOUBLE:
+		memcpy(&bits, &value.value.d, sizeof(bits));
+		for (i = 0; i < 8; ++i)
+			*pos++ = bits >> (8 * i);
+		break;
+	default:
+		pos += varint_put(pos, len);
+		memcpy(pos, rs->buffer, len);
+		pos += len;
+		break;
+	}
+	out->size = pos - out->data;
+	return 0;
+}
+
+/* encodes the matching entries into @server->scratch */
+static int query_collect(struct stat_server *server, const struct query_pattern *patterns, size_t npatterns,
+			 uint64_t *nentries)
+{
+	struct procstat_context *context = server->context;
+	struct aggregator_snapshot snapshot;
+	char path[MAX_PATH_LEN];
+	bool locked = false;
+	int error;
+	size_t i = 0;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.raw = true;
+	path[0] = 0;
+	pthread_rwlock_rdlock(&context->tree_lock);
+	error = aggregator_collect_locked(&snapshot, path, &context->root, NULL);
+	pthread_rwlock_unlock(&context->tree_lock);
+
+	while (i < snapshot.count && !error) {
+		size_t end = MIN(i + AGGREGATOR_BATCH_SIZE, snapshot.count);
+
+		pthread_rwlock_rdlock(&context->tree_lock);
+		for (; i < end && !error; ++i) {
+			struct aggregator_entry *entry = &snapshot.entries[i];
+			const char *name = &snapshot.prefixes[entry->prefix];
+
+			/* files removed since the collection may have their objects freed already */
+			if (!item_registered(entry->item) || !query_match(patterns, npatterns, name))
+				continue;
+			if (item_type_directory(entry->item))
+				error = query_add_histogram(&server->scratch, name, entry->item);
+			else
+				error = query_add_file(&server->scratch, server->rs, name,
+						       container_of(entry->item, struct procstat_file, base));
+			*nentries += !error;
+		}
+		pthread_rwlock_unlock(&context->tree_lock);
+	}
+
+	for (i = 0; i < snapshot.count; ++i)
+		item_unref_batched(context, snapshot.entries[i].item, 1, &locked);
+	if (locked)
+		pthread_rwlock_unlock(&context->tree_lock);
+	free(snapshot.entries);
+	free(snapshot.prefixes);
+	return error;
+}
+
+static int query_respond(struct stat_server *server, struct server_client *client, const char *request,
+			 size_t size)
+{
+	struct query_pattern *patterns;
+	char header[2 * VARINT_MAX_SIZE];
+	size_t header_len;
+	size_t npatterns;
+	uint64_t nentries = 0;
+	char *out;
+	int status;
+
+	server->scratch.size = 0;
+	status = query_parse(request, size, &patterns, &npatterns);
+	if (!status)
+		status = query_collect(server, patterns, npatterns, &nentries);
+	free(patterns);
+	/* a failed request returns no entries */
+	if (status) {
+		server->scratch.size = 0;
+		nentries = 0;
+	}
+
+	header_len = varint_put(header, status);
+	header_len += varint_put(&header[header_len], nentries);
+	if (server_buffer_reserve(&client->out, VARINT_MAX_SIZE + header_len + server->scratch.size))
+		return ENOMEM;
+	out = &client->out.data[client->out.size];
+	out += varint_put(out, header_len + server->scratch.size);
+	memcpy(out, header, header_len);
+	memcpy(out + header_len, server->scratch.data, server->scratch.size);
+	client->out.size = out + header_len + server->scratch.size - client->out.data;
+	return 0;
+}
+
+static int query_handle(struct stat_server *server, struct server_client *client)
+{
+	const char *pos = client->in.data;
+	const char *end = pos + client->in.size;
+	int error;
+
+	while (pos < end) {
+		const char *body = pos;
+		uint64_t size;
+
+		error = varint_get(&body, end, &size);
+		if (error == EAGAIN)
+			break;
+		if (error || size > PROCSTAT_QUERY_MAX_REQUEST)
+			return EPROTO;
+		if (size > (uint64_t)(end - body))
+			break;
+		error = query_respond(server, client, body, size);
+		if (error)
+			return error;
+		pos = body + size;
+	}
+
+	/* the rest of a request can't come after the end of the stream, the responses queued still go out */
+	if (client->closing)
+		pos = end;
+	memmove(client->in.data, pos, end - pos);
+	client->in.size = end - pos;
+	return 0;
+}
+
+/* a socket at @addr nobody accepts on was left behind by a process that exited */
+static bool unix_socket_stale(const struct sockaddr_un *addr)
+{
+	struct stat st;
+	int error = 0;
+	int fd;
+
+	if (lstat(addr->sun_path, &st) || !S_ISSOCK(st.st_mode))
+		return false;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)))
+		error = errno;
+	close(fd);
+	return error == ECONNREFUSED;
+}
+
+static int unix_listen(struct stat_server *server, const char *path)
+{
+	struct sockaddr_un addr;
+	int error;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->listen_fd < 0)
+		return errno;
+	error = bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (error && errno == EADDRINUSE && unix_socket_stale(&addr)) {
+		unlink(path);
+		error = bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+	}
+	if (error)
+		return errno;
+
+	server->path = strdup(path);
+	if (!server->path) {
+		unlink(path);
+		return ENOMEM;
+	}
+	if (listen(server->listen_fd, SOMAXCONN))
+		return errno;
+	return 0;
+}
+
+int procstat_serve_unix(struct procstat_context *context, const char *path)
+{
+	struct stat_server *server;
+	int error;
+
+	if (!path || !path[0]) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (context->unix_server) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	server = server_alloc(context, query_handle);
+	if (!server)
+		return -1;
+	error = unix_listen(server, path);
+	if (!error)
+		error = server_start(server);
+	if (error) {
+		server_free(server);
+		errno = error;
+		return -1;
+	}
+	context->unix_server = server;
+	return 0;
+}
+
+void procstat_unix_close(struct procstat_context *context)
+{
+	struct stat_server *server = context->unix_server;
+
+	if (!server)
+		return;
+	context->unix_server = NULL;
+	server_free(server);
+}
+
+/*
+ * The HTTP server serves GET and HEAD of /metrics, every request formats a Prometheus snapshot of
+ * the whole tree. Request bodies are not supported, requests with one are refused and their
+ * connection closed.
+ */
+#define HTTP_MAX_REQUEST (16 * 1024)
+
+struct http_request {
+	bool head;
+	bool keep_alive;
+	bool gzip;
+};
+
+/* @return the length of the request head at @data including the empty line, 0 if it is incomplete */
+static size_t http_head_length(const char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < size; ++i) {
+		if (data[i] != '\n')
+			continue;
+		if (data[i + 1] == '\n')
+			return i + 2;
+		if (i + 2 < size && data[i + 1] == '\r' && data[i + 2] == '\n')
+			return i + 3;
+	}
+	return 0;
+}
+
+/* @token is in the comma separated header @value, and not refused by a zero quality */
+static bool http_has_token(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+
+	while (*value) {
+		const char *end;
+		const char *quality;
+
+		value += strspn(value, " \t,");
+		end = value + strcspn(value, ",");
+		if (!strncasecmp(value, token, len) && (value[len] == 0 || strchr(" \t,;", value[len]))) {
+			quality = strstr(&value[len], "q=");
+			return !quality || quality > end || strtod(&quality[2], NULL) != 0;
+		}
+		value = end;
+	}
+	return false;
+}
+
+static char *http_next_line(char **lines)
+{
+	char *line = *lines;
+	char *end = &line[strcspn(line, "\n")];
+
+	*lines = *end ? end + 1 : end;
+	*end = 0;
+	if (end > line && end[-1] == '\r')
+		end[-1] = 0;
+	return line;
+}
+
+/* parses the head of @len bytes in place, @return the status of the response */
+static int http_parse(char *head, size_t len, struct http_request *request)
+{
+	char *lines = head;
+	char *method;
+	char *target;
+	char *version;
+	char *line;
+
+	memset(request, 0, sizeof(*request));
+	head[len - 1] = 0;
+	method = http_next_line(&lines);
+	target = strchr(method, ' ');
+	if (!target)
+		return 400;
+	*target++ = 0;
+	version = strchr(target, ' ');
+	if (!version)
+		return 400;
+	*version++ = 0;
+	if (strncmp(version, "HTTP/1.", 7) || !isdigit((unsigned char)version[7]) || version[8])
+		return 400;
+	request->keep_alive = version[7] != '0';
+
+	while (*(line = http_next_line(&lines))) {
+		char *value = strchr(line, ':');
+
+		if (!value)
+			return 400;
+		*value++ = 0;
+		value += strspn(value, " \t");
+		if (!strcasecmp(line, "Connection")) {
+			if (http_has_token(value, "close"))
+				request->keep_alive = false;
+			else if (http_has_token(value, "keep-alive"))
+				request->keep_alive = true;
+		} else if (!strcasecmp(line, "Accept-Encoding")) {
+			request->gzip = http_has_token(value, "gzip");
+		} else if (!strcasecmp(line, "Transfer-Encoding") ||
+			   (!strcasecmp(line, "Content-Length") && strtoull(value, NULL, 10))) {
+			return 400;
+		}
+	}
+
+	request->head = !strcmp(method, "HEAD");
+	if (!request->head && strcmp(method, "GET"))
+		return 405;
+	target[strcspn(target, "?")] = 0;
+	if (strcmp(target, "/metrics"))
+		return 404;
+	return 200;
+}
+
+static const char *http_reason(int status)
+{
+	switch (status) {
+	case 200:
+		return "OK";
+	case 400:
+		return "Bad Request";
+	case 404:
+		return "Not Found";
+	case 405:
+		return "Method Not Allowed";
+	default:
+		return "Internal Server Error";
+	}
+}
+
+/* compresses @size bytes of @data into @server->scratch */
+static int http_gzip(struct stat_server *server, const char *data, size_t size)
+{
+	z_stream *stream = server->zstream;
+
+	if (size > UINT_MAX)
+		return EFBIG;
+	if (!stream) {
+		stream = calloc(1, sizeof(*stream));
+		if (!stream)
+			return ENOMEM;
+		/* the fastest level, the text format compresses well anyway */
+		if (deflateInit2(stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(stream);
+			return ENOMEM;
+		}
+		server->zstream = stream;
+	} else {
+		deflateReset(stream);
+	}
+
+	server->scratch.size = 0;
+	if (server_buffer_reserve(&server->scratch, deflateBound(stream, size)))
+		return ENOMEM;
+	stream->next_in = (Bytef *)data;
+	stream->avail_in = size;
+	stream->next_out = (Bytef *)server->scratch.data;
+	stream->avail_out = server->scratch.capacity;
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+		return EIO;
+	server->scratch.size = stream->total_out;
+	return 0;
+}
+
+static int http_respond(struct stat_server *server, struct server_client *client, int status,
+			const struct http_request *request)
+{
+	struct procstat_context *context = server->context;
+	struct read_struct *rs = NULL;
+	const char *body = NULL;
+	size_t body_len = 0;
+	bool gzip = false;
+	char header[512];
+	char reason[64];
+	int header_len;
+
+	if (status == 200) {
+		rs = malloc(sizeof(*rs));
+		if (rs) {
+			read_struct_init(rs);
+			if (tree_snapshot_build(context, &context->root, NULL, PROCSTAT_FORMAT_PROMETHEUS, NULL, rs))
+				status = 500;
+		} else {
+			status = 500;
+		}
+	}
+	if (status == 200) {
+		body = rs->buffer;
+		body_len = rs->size;
+		if (request->gzip && body_len && !http_gzip(server, body, body_len)) {
+			body = server->scratch.data;
+			body_len = server->scratch.size;
+			gzip = true;
+		}
+	} else {
+		body_len = snprintf(reason, sizeof(reason), "%s\n", http_reason(status));
+		body = reason;
+	}
+
+	header_len = snprintf(header, sizeof(header),
+			      "HTTP/1.1 %d %s\r\n"
+			      "Content-Type: text/plain; %scharset=utf-8\r\n"
+			      "Content-Length: %zu\r\n"
+			      "%s%s%s%s"
+			      "\r\n",
+			      status, http_reason(status),
+			      status == 200 ? "version=0.0.4; " : "",
+			      body_len,
+			      status == 200 ? "Vary: Accept-Encoding\r\n" : "",
+			      gzip ? "Content-Encoding: gzip\r\n" : "",
+			      status == 405 ? "Allow: GET, HEAD\r\n" : "",
+			      request->keep_alive ? "" : "Connection: close\r\n");
+	if (request->head)
+		body_len = 0;
+
+	if (server_buffer_reserve(&client->out, header_len + body_len)) {
+		if (rs)
+			read_struct_free(rs);
+		return ENOMEM;
+	}
+	memcpy(&client->out.data[client->out.size], header, header_len);
+	memcpy(&client->out.data[client->out.size + header_len], body, body_len);
+	client->out.size += header_len + body_len;
+	if (rs)
+		read_struct_free(rs);
+	return 0;
+}
+
+static int http_handle(struct stat_server *server, struct server_client *client)
+{
+	struct http_request request;
+	char *pos = client->in.data;
+	char *end = pos + client->in.size;
+	size_t len;
+	int status;
+	int error;
+
+	while (!client->closing && (len = http_head_length(pos, end - pos))) {
+		status = http_parse(pos, len, &request);
+		/* the rest of a malformed request can't be told from the next one */
+		if (status == 400)
+			request.keep_alive = false;
+		error = http_respond(server, client, status, &request);
+		if (error)
+			return error;
+		if (!request.keep_alive)
+			client->closing = true;
+		pos += len;
+	}
+
+	/* nothing is read from a connection past its last response */
+	if (client->closing)
+		pos = end;
+	if (end - pos > HTTP_MAX_REQUEST)
+		return EMSGSIZE;
+	memmove(client->in.data, pos, end - pos);
+	client->in.size = end - pos;
+	return 0;
+}
+
+static int http_listen(struct stat_server *server, const char *address, unsigned short port, int *bound)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	struct addrinfo hints;
+	struct addrinfo *info;
+	char service[8];
+	int one = 1;
+	int error;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+	sprintf(service, "%u", port);
+	if (getaddrinfo(address ? address : "127.0.0.1", service, &hints, &info))
+		return EINVAL;
+
+	server->listen_fd = socket(info->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->listen_fd < 0) {
+		error = errno;
+		goto out;
+	}
+	setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(server->listen_fd, info->ai_addr, info->ai_addrlen) || listen(server->listen_fd, SOMAXCONN) ||
+	    getsockname(server->listen_fd, (struct sockaddr *)&addr, &addr_len)) {
+		error = errno;
+		goto out;
+	}
+	*bound = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port :
+						    ((struct sockaddr_in *)&addr)->sin_port);
+	error = 0;
+out:
+	freeaddrinfo(info);
+	return error;
+}
+
+int procstat_serve_http(struct procstat_context *context, const char *address, unsigned short port)
+{
+	struct stat_server *server;
+	int bound = 0;
+	int error;
+
+	if (context->http_server) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	server = server_alloc(context, http_handle);
+	if (!server)
+		return -1;
+	server->nodelay = true;
+	error = http_listen(server, address, port, &bound);
+	if (!error)
+		error = server_start(server);
+	if (error) {
+		server_free(server);
+		errno = error;
+		return -1;
+	}
+	context->http_server = server;
+	return bound;
+}
+
+void procstat_http_close(struct procstat_context *context)
+{
+	struct stat_server *server = context->http_server;
+
+	if (!server)
+		return;
+	context->http_server = NULL;
+	server_free(server);
+}
@@ -55,8 +55,8 @@ struct procstat_item;
  * @param arg registered with statistics
  * @param buffer to format object to
  * @param lenght of buffer
- * @param offset to return from beginning of buffer. This can be ignored in case statistics string
- * is large > 4K
+ * @return length of the whole formatted value, like snprintf. In case it does not fit @length the
+ * formatter is called again with a large enough buffer (up to 16MB), negative on error
  */
 typedef ssize_t (*procstats_formatter)(void *object, uint64_t arg, char *buffer, size_t length);
 
@@ -84,6 +84,44 @@ struct procstat_simple_handle {
  */
 struct procstat_context *procstat_create(const char *mountpoint);
 
+/**
+ * @brief called once the mount of an asynchronous context is done
+ * @error 0 in case the statistics are mounted, errno of the failure otherwise
+ */
+typedef void (*procstat_mount_callback)(struct procstat_context *context, int error, void *arg);
+
+/**
+ * @brief create statistics context and leave the mount of @mountpoint to the thread that runs
+ * @procstat_loop or @procstat_loop_mt, so the caller does not wait for it. The context can be used
+ * for registration right away, the statistics registered before the mount is done become visible
+ * with it. @callback (may be NULL) is called with @arg on the loop thread once the mount is done or
+ * failed, in which case the loop returns.
+ * @return context or NULL in case of error, errno will be set accordingly
+ */
+struct procstat_context *procstat_create_async(const char *mountpoint, procstat_mount_callback callback, void *arg);
+
+/**
+ * @brief create statistics context without mounting it. Statistics are registered as usual and read
+ * with @procstat_read_path and @procstat_snapshot, until @procstat_mount attaches FUSE, if ever.
+ * @return context or NULL in case of error, errno will be set accordingly
+ */
+struct procstat_context *procstat_create_headless(void);
+
+/**
+ * @brief mount headless @context under @mountpoint, which will be created in case it does not
+ * exist. The statistics registered so far become visible as they are.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_mount(struct procstat_context *context, const char *mountpoint);
+
+/**
+ * @brief format the file at @path ("dir/name", relative to the root) into @buffer, in process and
+ * whether the context is mounted or not
+ * @return length of the whole formatted value like the formatters, -1 in case of failure and errno
+ * will be set accordingly
+ */
+ssize_t procstat_read_path(struct procstat_context *context, const char *path, char *buffer, size_t length);
+
 /**
  * @brief signal the loop to exit
  */
@@ -111,6 +149,148 @@ struct procstat_context *procstat_context(struct procstat_item *item);
  */
 void procstat_loop(struct procstat_context *context);
 
+/**
+ * @brief multithreaded variant of @procstat_loop, statistics operations are served by a pool
+ * of threads, so concurrent readers do not wait for each other. Formatters of custom statistics
+ * may then be called concurrently.
+ */
+void procstat_loop_mt(struct procstat_context *context);
+
+/**
+ * @brief layout of the shared memory segment published by @procstat_shm_export. The segment starts
+ * with @procstat_shm_header followed by @nentries entries, all offsets are from the start of the
+ * segment. Readers map the segment read only and copy what they need between two loads of @seq,
+ * retrying in case @seq was odd or changed. @size may grow on publish, readers remap the segment in
+ * case it exceeds their mapping.
+ */
+#define PROCSTAT_SHM_MAGIC 0x4d485350 /* "PSHM" */
+#define PROCSTAT_SHM_VERSION 1
+
+/**
+ * @brief types of exported values, values that are not numbers are available as text only
+ */
+enum procstat_shm_type {
+	PROCSTAT_SHM_TEXT = 0,
+	PROCSTAT_SHM_U64 = 1,
+	PROCSTAT_SHM_S64 = 2,
+	PROCSTAT_SHM_DOUBLE = 3,
+};
+
+/**
+ * @brief exported value
+ * @path offset of the NUL terminated "dir/name" path of the value
+ * @text offset of the NUL terminated formatted value, trailing newline stripped
+ * @type of @value, see @procstat_shm_type
+ */
+struct procstat_shm_entry {
+	uint32_t path;
+	uint32_t text;
+	uint32_t type;
+	uint32_t reserved;
+	union {
+		uint64_t u;
+		int64_t  s;
+		double 	 d;
+	} value;
+};
+
+struct procstat_shm_header {
+	uint32_t 			magic;
+	uint32_t 			version;
+	uint32_t 			seq;
+	uint32_t 			nentries;
+	uint64_t 			size;
+	uint64_t 			generation;
+	uint64_t 			published_ns;
+	struct procstat_shm_entry 	entries[0];
+};
+
+/**
+ * @brief publish all values of @context into the POSIX shared memory object @name (/dev/shm/@name)
+ * every @interval_ms, so local collectors can scan them without any system call. Values are formatted
+ * by their registered formatters, like FUSE reads do, on a background thread. @interval_ms 0 only
+ * publishes on @procstat_shm_publish. A context has at most one export, which is removed by
+ * @procstat_shm_close or @procstat_destroy.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_shm_export(struct procstat_context *context, const char *name, unsigned interval_ms);
+
+/**
+ * @brief publish the current values into the shared memory export of @context right away
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_shm_publish(struct procstat_context *context);
+
+/**
+ * @brief stop publishing and unlink the shared memory object of @context
+ */
+void procstat_shm_close(struct procstat_context *context);
+
+/**
+ * @brief binary protocol of @procstat_serve_unix. Integers are LEB128 varints unless noted, every
+ * request and response is a frame: the varint size of the body followed by the body. Clients may
+ * send several requests without waiting, the responses come back in the same order.
+ *
+ * request body:  nqueries, then per query a u8 @procstat_query_kind, the pattern size and the
+ *                pattern bytes. A value is returned in case any of the queries matches its
+ *                "dir/name" path, no queries return all values.
+ * response body: status (0 or an errno value), nentries, then per entry the path size, the path
+ *                bytes, a u8 @procstat_query_type and the value:
+ *                U64        varint
+ *                S64        zigzag varint
+ *                DOUBLE     8 bytes IEEE 754, little endian
+ *                TEXT       size, bytes
+ *                HISTOGRAM  sum, nbuckets, then per non empty bucket the delta of its upper bound
+ *                           from the bound of the previous bucket (from 0 for the first one) and the
+ *                           number of samples in the bucket
+ * Histogram directories are returned as a single entry of their raw buckets. Requests larger than
+ * @PROCSTAT_QUERY_MAX_REQUEST close the connection.
+ */
+#define PROCSTAT_QUERY_MAX_REQUEST (64 * 1024)
+
+enum procstat_query_kind {
+	PROCSTAT_QUERY_PREFIX = 0, /* plain prefix of the path */
+	PROCSTAT_QUERY_GLOB = 1,   /* fnmatch(3) pattern, wildcards do not match '/' */
+};
+
+enum procstat_query_type {
+	PROCSTAT_QUERY_TEXT = PROCSTAT_SHM_TEXT,
+	PROCSTAT_QUERY_U64 = PROCSTAT_SHM_U64,
+	PROCSTAT_QUERY_S64 = PROCSTAT_SHM_S64,
+	PROCSTAT_QUERY_DOUBLE = PROCSTAT_SHM_DOUBLE,
+	PROCSTAT_QUERY_HISTOGRAM = 4,
+};
+
+/**
+ * @brief answer queries for the values of @context on the unix stream socket @path, see
+ * @PROCSTAT_QUERY_MAX_REQUEST for the protocol. Requests are served by a background thread and
+ * format the values by their registered formatters, like FUSE reads do. A socket left behind by a
+ * previous process is replaced. A context has at most one query server, which is removed by
+ * @procstat_unix_close or @procstat_destroy.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_serve_unix(struct procstat_context *context, const char *path);
+
+/**
+ * @brief close the connections of the query server of @context and unlink its socket
+ */
+void procstat_unix_close(struct procstat_context *context);
+
+/**
+ * @brief serve the values of @context in the Prometheus text format on http://@address:@port/metrics
+ * from a background thread. Connections are kept alive and responses are gzip compressed for
+ * clients that accept it. @address is a numeric IPv4 or IPv6 address, NULL listens on 127.0.0.1,
+ * @port 0 picks a free port. A context has at most one HTTP server, which is removed by
+ * @procstat_http_close or @procstat_destroy.
+ * @return the port the server listens on, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_serve_http(struct procstat_context *context, const char *address, unsigned short port);
+
+/**
+ * @brief close the connections and the listening socket of the HTTP server of @context
+ */
+void procstat_http_close(struct procstat_context *context);
+
 /**
  * @brief create directory @name under @parent directory
  * @context statistics context
@@ -178,6 +358,23 @@ int procstat_create_simple(struct procstat_context *context,
 			   struct procstat_simple_handle *descriptors,
 			   size_t descriptors_len);
 
+/**
+ * @brief creates counters like @procstat_create_simple, whose contents the kernel caches until
+ * they are written through the filesystem or invalidated with @procstat_invalidate. Meant for
+ * configuration parameters and static information.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_cacheable(struct procstat_context *context,
+			      struct procstat_item *parent,
+			      struct procstat_simple_handle *descriptors,
+			      size_t descriptors_len);
+
+/**
+ * @brief drop the kernel cached contents of cacheable @item after its value changed. Must not be
+ * called from a formatter or writer of the item.
+ */
+void procstat_invalidate(struct procstat_context *context, struct procstat_item *item);
+
 /**
  * @brief creates a file that on read outputs the contents of the entire directory tree.
  * @return 0 on success, -1  in case of failure and errno will be set accordingly
@@ -186,6 +383,57 @@ int procstat_create_aggregator(struct procstat_context *context,
 			   struct procstat_item *parent,
 			   const char *name);
 
+/**
+ * @brief output modes of aggregators
+ * @PROCSTAT_AGGREGATOR_STREAM formats the tree while it is read, so reads have to be sequential
+ * @PROCSTAT_AGGREGATOR_SNAPSHOT formats the whole tree once on open, reads of the handle may come
+ * at any offset and all see the same values
+ * @PROCSTAT_AGGREGATOR_CHANGES like @PROCSTAT_AGGREGATOR_SNAPSHOT, but outputs only the values that
+ * changed since the last read of the aggregator that got to the end of the output. Every consumer
+ * should read its own changes aggregator
+ */
+enum procstat_aggregator_mode {
+	PROCSTAT_AGGREGATOR_STREAM = 0,
+	PROCSTAT_AGGREGATOR_SNAPSHOT = 1,
+	PROCSTAT_AGGREGATOR_CHANGES = 2,
+};
+
+/**
+ * @brief output formats of aggregators
+ * @PROCSTAT_FORMAT_TEXT "path/name:value" lines, histograms are output as their files
+ * @PROCSTAT_FORMAT_JSON a single object keyed by "path/name". Numeric values are output as numbers,
+ * other values as strings and histograms as {"count":, "sum":, "buckets":[[le, count], ...]} objects
+ * @PROCSTAT_FORMAT_PROMETHEUS Prometheus text exposition format, the metric names are the paths with
+ * the characters Prometheus does not allow replaced by '_'. Values that are not numbers are skipped
+ * and histograms are output as cumulative _bucket lines with _sum and _count
+ * Histogram buckets are taken from the raw histogram buckets, only the non empty ones are output and
+ * every bucket is bounded by the largest value it counts.
+ */
+enum procstat_aggregator_format {
+	PROCSTAT_FORMAT_TEXT = 0,
+	PROCSTAT_FORMAT_JSON = 1,
+	PROCSTAT_FORMAT_PROMETHEUS = 2,
+};
+
+/**
+ * @brief creates an aggregator with output @mode and @format, see @procstat_create_aggregator.
+ * Formats other than @PROCSTAT_FORMAT_TEXT are not supported by @PROCSTAT_AGGREGATOR_STREAM aggregators
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_aggregator_ex(struct procstat_context *context,
+				 struct procstat_item *parent,
+				 const char *name,
+				 enum procstat_aggregator_mode mode,
+				 enum procstat_aggregator_format format);
+
+/**
+ * @brief format all the files under @parent (root when NULL) in @format, like snapshot aggregators
+ * do, into a NUL terminated buffer that the caller frees. @size is set to its length unless NULL
+ * @return the buffer, NULL in case of failure and errno will be set accordingly
+ */
+char *procstat_snapshot(struct procstat_context *context, struct procstat_item *parent,
+			enum procstat_aggregator_format format, size_t *size);
+
 
 #define DEFINE_PROCSTAT_FORMATTER(__type, __fmt, __fmt_name)\
 static inline ssize_t procstat_format_ ## __type ##_## __fmt_name(void *object, uint64_t arg, char *buffer, size_t len)\
@@ -270,10 +518,14 @@ int procstat_create_start_end(struct procstat_context 	       *context,
 #define procstat_start_end_u64_handle(name, start_end)\
 	(struct procstat_start_end_handle){name, &start_end.start, &start_end.end, procstat_format_u64_decimal}
 
+/**
+ * @brief reset state of series and histograms
+ * @reset_interval in seconds, 0 disables periodic reset
+ * @reset_at coarse epoch at which the values are reset: 0 never, 1 reset requested
+ */
 struct reset_info {
 	uint64_t reset_interval;
-	uint64_t last_reset_time;
-	unsigned reset_flag;
+	uint64_t reset_at;
 };
 
 /**
@@ -298,9 +550,27 @@ struct procstat_series_u64 {
 	uint64_t 		last;
 	uint64_t 		mean;
 	uint64_t 		aggregated_variance;
+	uint32_t 		seq;
 	struct reset_info 	reset;
 };
 
+/**
+ * @brief series statistics without a division on the hot path: only @sum, @count,
+ * @sum_of_squares, @min, @max and @last are accumulated per point, mean and variance are
+ * derived from them when statistics are read. Exposes the same files as @procstat_series_u64.
+ * The 128 bit @sum_of_squares is kept as its low and high halves.
+ */
+struct procstat_series_u64_fast {
+	uint64_t 		sum;
+	uint64_t 		count;
+	uint64_t 		min;
+	uint64_t 		max;
+	uint64_t 		last;
+	uint64_t 		sum_of_squares_lo;
+	uint64_t 		sum_of_squares_hi;
+	uint32_t 		seq;
+	struct reset_info 	reset;
+};
 
 /**
  * @brief callback to calculate histogram values
@@ -310,15 +580,47 @@ typedef void (*percentiles_calculator)(uint32_t *histogram,
 					struct procstat_percentile_result *result,
 					unsigned result_len);
 
+/**
+ * @brief values of a histogram accumulated since the last reset
+ */
+struct procstat_histogram_u32_values {
+	uint64_t 			sum;
+	uint64_t 			count;
+	uint64_t 			last;
+	struct procstat_hist_sparse	buckets;
+};
+
 #define MAX_SUPPORTED_PERCENTILE 20
+
+/**
+ * @brief stamp of the percentile values last computed for a histogram. All percentile files
+ * read within one scrape share a single walk over the buckets, the values are recomputed once
+ * the histogram generation changed, or new samples arrived and the scrape window passed.
+ */
+struct procstat_percentile_cache {
+	uint32_t 	lock;
+	uint32_t 	generation;
+	uint64_t 	count;
+	uint64_t 	computed_ns;
+};
+
+/**
+ * @brief histogram statistics. Points are added to the @active values, on reset the writer
+ * swaps @active with the zeroed @standby values, and the previous values are cleared later on
+ * by the reset ticker of the context, so the writer does not clear the buckets itself. The
+ * values are read with procstat_histogram_u32_get().
+ */
 struct procstat_histogram_u32 {
-	uint64_t 				sum;
-	uint64_t 				count;
-	uint64_t 				last;
 	int 					npercentile;
 	struct procstat_percentile_result	percentile[MAX_SUPPORTED_PERCENTILE];
-	uint32_t 				*histogram;
 	percentiles_calculator 			compute_cb;
+	struct procstat_histogram_u32_values	*buffers;
+	struct procstat_histogram_u32_values	*active;
+	struct procstat_histogram_u32_values	*standby;
+	uint32_t 				standby_dirty;
+	uint32_t 				seq;
+	uint32_t 				generation;
+	struct procstat_percentile_cache	percentile_cache;
 	struct reset_info 			reset;
 };
 
@@ -342,15 +644,203 @@ int procstat_create_multiple_u64_series(struct procstat_context *context,
  */
 void procstat_u64_series_add_point(struct procstat_series_u64 *series, uint64_t value);
 
+/**
+ * @brief add @n points of @values to series statistics, published as a single update
+ */
+void procstat_u64_series_add_points(struct procstat_series_u64 *series, const uint64_t *values, size_t n);
+
+/**
+ * @brief add @count points of the same @value to series statistics
+ */
+void procstat_u64_series_add_point_n(struct procstat_series_u64 *series, uint64_t value, uint64_t count);
+
 void procstat_u64_series_set_reset_interval(struct procstat_series_u64 *series, int reset_interval);
 
+/**
+ * @brief create division free series statistics.
+ */
+int procstat_create_u64_fast_series(struct procstat_context *context, struct procstat_item *parent,
+				    const char *name, struct procstat_series_u64_fast *series);
+
+/**
+ * @brief add points to division free series statistics
+ */
+void procstat_u64_fast_series_add_point(struct procstat_series_u64_fast *series, uint64_t value);
+
+void procstat_u64_fast_series_set_reset_interval(struct procstat_series_u64_fast *series, int reset_interval);
+
 int procstat_create_histogram_u32_series(struct procstat_context *context, struct procstat_item *parent,
 					 const char *name, struct procstat_histogram_u32 *series);
 
 void procstat_histogram_u32_add_point(struct procstat_histogram_u32 *series, uint32_t value);
 
+/**
+ * @brief add @n points of @values to histogram, the reset check and the sum, count and last update
+ * are done once per call
+ */
+void procstat_histogram_u32_add_points(struct procstat_histogram_u32 *series, const uint32_t *values, size_t n);
+
+/**
+ * @brief add @count points of the same @value to histogram
+ */
+void procstat_histogram_u32_add_point_n(struct procstat_histogram_u32 *series, uint32_t value, uint32_t count);
+
 void procstat_histogram_u32_series_set_reset_interval(struct procstat_histogram_u32 *series, int reset_interval);
 
+/**
+ * @brief copy the values @series accumulated since the last reset, zeros while a reset is pending.
+ * Any of the outputs may be NULL, @histogram receives PROCSTAT_PERCENTILE_ARR_NR bucket counters.
+ */
+void procstat_histogram_u32_get(struct procstat_histogram_u32 *series, uint64_t *sum, uint64_t *count,
+				uint64_t *last, uint32_t *histogram);
+
+/**
+ * @brief @return bytes of bucket counters allocated by the active values of @series
+ */
+size_t procstat_histogram_u32_size(struct procstat_histogram_u32 *series);
+
+/**
+ * @brief values of a u64 histogram accumulated since the last reset
+ */
+struct procstat_histogram_u64_values {
+	uint64_t 	sum;
+	uint64_t 	count;
+	uint64_t 	last;
+	uint64_t 	*histogram;
+};
+
+/**
+ * @brief histogram statistics over the full 64 bit range with u64 bucket counts. @precision_bits
+ * (PROCSTAT_U64_BUCKET_BITS_MIN - PROCSTAT_U64_BUCKET_BITS_MAX, 0 picks PROCSTAT_BUCKET_BITS) must be
+ * set before creation together with @percentile and @npercentile. It trades accuracy for memory: the
+ * error is bounded by 1/2^(precision_bits + 1) and the buckets take
+ * 2 * 8 * PROCSTAT_U64_BUCKETS_NR(precision_bits) bytes, e.g. 59 KB for 6 bits and 8 KB for 3 bits.
+ * Resets swap the active and standby values like @procstat_histogram_u32 does.
+ */
+struct procstat_histogram_u64 {
+	int 					npercentile;
+	struct procstat_percentile_u64_result	percentile[MAX_SUPPORTED_PERCENTILE];
+	unsigned 				precision_bits;
+	struct procstat_histogram_u64_values	buffers[2];
+	struct procstat_histogram_u64_values	*active;
+	struct procstat_histogram_u64_values	*standby;
+	uint32_t 				standby_dirty;
+	uint32_t 				seq;
+	uint32_t 				generation;
+	struct procstat_percentile_cache	percentile_cache;
+	struct reset_info 			reset;
+};
+
+/**
+ * @brief create u64 histogram statistics.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_histogram_u64_series(struct procstat_context *context, struct procstat_item *parent,
+					 const char *name, struct procstat_histogram_u64 *series);
+
+void procstat_histogram_u64_add_point(struct procstat_histogram_u64 *series, uint64_t value);
+
+void procstat_histogram_u64_series_set_reset_interval(struct procstat_histogram_u64 *series, int reset_interval);
+
+/**
+ * @brief number of writer threads that get a private shard in sharded series and histograms.
+ * Threads beyond that limit share a single spinlock protected overflow shard.
+ */
+#define PROCSTAT_MAX_SHARDS 64
+#define PROCSTAT_CACHELINE_SIZE 64
+
+struct procstat_series_u64_shard;
+struct procstat_histogram_u32_shard;
+
+/**
+ * @brief series statistics for points submitted from many threads concurrently. Every writer thread
+ * updates its own cache line aligned shard with plain stores, shards are allocated on first use
+ * and merged when statistics are read. Exposes the same files as @procstat_series_u64.
+ * Must be zero initialized before creation.
+ */
+struct procstat_series_u64_sharded {
+	struct procstat_series_u64_shard 	*shards[PROCSTAT_MAX_SHARDS + 1];
+	uint32_t 				generation;
+	uint32_t 				last_shard;
+	uint32_t 				overflow_lock;
+	struct reset_info 			reset;
+};
+
+/**
+ * @brief sharded counterpart of @procstat_histogram_u32. Every writer thread owns a private bucket
+ * array, buckets of all shards are summed up when percentiles are read.
+ * Must be zero initialized before @percentile and @npercentile are filled.
+ */
+struct procstat_histogram_u32_sharded {
+	int 					npercentile;
+	struct procstat_percentile_result	percentile[MAX_SUPPORTED_PERCENTILE];
+	percentiles_calculator 			compute_cb;
+	struct procstat_histogram_u32_shard 	*shards[PROCSTAT_MAX_SHARDS + 1];
+	uint32_t 				generation;
+	uint32_t 				last_shard;
+	uint32_t 				overflow_lock;
+	struct procstat_percentile_cache	percentile_cache;
+	struct reset_info 			reset;
+};
+
+/**
+ * @brief create sharded series statistics.
+ */
+int procstat_create_u64_series_sharded(struct procstat_context *context, struct procstat_item *parent,
+				       const char *name, struct procstat_series_u64_sharded *series);
+
+/**
+ * @brief add point to the calling thread shard of @series. Safe to call from any number of threads.
+ * The shards are freed together with the statistics item, so all writers must stop adding points
+ * before the item is removed or the context is destroyed.
+ */
+void procstat_u64_series_sharded_add_point(struct procstat_series_u64_sharded *series, uint64_t value);
+
+int procstat_create_histogram_u32_sharded(struct procstat_context *context, struct procstat_item *parent,
+					  const char *name, struct procstat_histogram_u32_sharded *series);
+
+/**
+ * @brief add point to the calling thread shard of @series, the same rules as for
+ * procstat_u64_series_sharded_add_point() apply.
+ */
+void procstat_histogram_u32_sharded_add_point(struct procstat_histogram_u32_sharded *series, uint32_t value);
+
+struct procstat_percpu_slot;
+
+/**
+ * @brief u64 counter with a slot per cpu. Increments are plain adds into the slot of the current cpu
+ * inside a restartable sequence (rseq), so no lock prefixed instruction is needed. When rseq is not
+ * available the counter falls back to per thread slots. The slots are summed up on read.
+ * Must be zero initialized before creation.
+ */
+struct procstat_percpu_u64 {
+	struct procstat_percpu_slot 	*cpu_slots;
+	struct procstat_percpu_slot 	*thread_slots;
+	uint32_t 			nr_cpus;
+};
+
+/**
+ * @brief create per cpu counter exposed as @name under @parent directory.
+ * @return 0 on success, -1  in case of failure and errno will be set accordingly
+ */
+int procstat_create_percpu_u64(struct procstat_context *context, struct procstat_item *parent,
+			       const char *name, struct procstat_percpu_u64 *counter);
+
+/**
+ * @brief add @value to @counter. Safe to call from any number of threads.
+ */
+void procstat_percpu_u64_add(struct procstat_percpu_u64 *counter, uint64_t value);
+
+/**
+ * @return sum of all slots of @counter
+ */
+uint64_t procstat_percpu_u64_read(struct procstat_percpu_u64 *counter);
+
+static inline void procstat_percpu_u64_inc(struct procstat_percpu_u64 *counter)
+{
+	procstat_percpu_u64_add(counter, 1);
+}
+
 #ifdef __cplusplus
 }
 #endif
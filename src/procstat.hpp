@@ -110,10 +110,9 @@ namespace procstat {
 	 * @brief represents series registry of "series" statistics. Series are u64
 	 * statistics that exposes basic min, max, avg, sum, count, last, stddev statistics
 	 * via fuse. Also statistics can be reset via writing "echo 1 > <series mount>/reset file
-	 * Note: There are also no "locks" on hotpath, so histogram is relatively fast, however it is possible
-	 * that during some reads you will get slightly inconsistent values. (For example sum and count are updated
-	 * separately, so the "read" can catch the values in the middle of the update). This does not really matter
-	 * on large input series as it will have only minor affect
+	 * Note: There are also no "locks" on hotpath, every read takes a consistent snapshot of all the fields
+	 * guarded by a sequence counter, which costs the writer two plain stores. The series must have a single
+	 * writer, use procstat_series_u64_sharded for series shared between threads.
 	 */
 	class series : public registration {
 	public:
@@ -155,9 +154,9 @@ namespace procstat {
 	 * @brief represents histogram registry of "histogram" statistics. Histogram are u32
 	 * statistics that exposes sum, count, last, avg and specified percentiles
 	 * via fuse. Also statistics can be reset via writing "echo 1 > <series mount>/reset file
-	 * !Note: every histogram takes ~4K bytes for "buckets" calculation. So every "add point"
-	 * is essentually a cache miss. (unless entries are really close). There are also no "locks" on
-	 * hotpath, so histogram is relatively fast.
+	 * !Note: buckets are allocated per group of 64 buckets on first use, with 8 bit counters that
+	 * widen on overflow. A histogram touching a few groups takes a few cache lines, so points close to
+	 * each other hit the same lines. There are also no "locks" on hotpath, so histogram is relatively fast.
 	 */
 	class histogram : public registration {
 	public:
@@ -338,6 +337,18 @@ namespace procstat {
 			}
 		}
 
+		/**
+		 * @brief creates a context that is not mounted, statistics are read in process until
+		 * @mount is called
+		 */
+		context()
+		{
+			impl = procstat_create_headless();
+			if (!impl) {
+				throw std::system_error(errno, std::generic_category(), "procstat_create_headless");
+			}
+		}
+
 		context(const context &other) = delete;
 
 		context(context &&other) = delete;
@@ -370,6 +381,48 @@ namespace procstat {
 			}
 		}
 
+		/**
+		 * @brief mounts a context created without mountpoint
+		 * @param autostart whether to start serving statistics automatically
+		 */
+		void mount(const std::string &mountpoint, bool autostart = true)
+		{
+			/* a looper started before the mount had nothing to serve and exited */
+			if (fuse_thread.joinable()) {
+				fuse_thread.join();
+			}
+
+			if (procstat_mount(impl, mountpoint.c_str())) {
+				throw std::system_error(errno, std::generic_category(), mountpoint);
+			}
+
+			if (autostart) {
+				start();
+			}
+		}
+
+		/**
+		 * @return formatted value of the file at @path, relative to the root
+		 */
+		std::string read(const std::string &path)
+		{
+			std::string value(64, '\0');
+			ssize_t size;
+
+			for (;;) {
+				size = procstat_read_path(impl, path.c_str(), &value[0], value.size());
+				if (size < 0) {
+					throw std::system_error(errno, std::generic_category(), path);
+				}
+				if ((size_t)size < value.size()) {
+					break;
+				}
+				value.resize(size + 1);
+			}
+			value.resize(size);
+			return value;
+		}
+
 		/**
 		 * @return root directory of the statistics
 		 */
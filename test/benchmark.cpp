@@ -0,0 +1,345 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/procstat.h"
+#include "../src/basic_formatters.h"
+
+/*
+ * Micro benchmarks of procstat hot paths. Not part of the test suite, run manually:
+ * ./procstat_bench [mountpoint]
+ * The statistics are only mounted when a mountpoint is given.
+ */
+
+static const uint64_t points_per_thread = 1000000;
+
+/* runs @body(thread_index) on @threads threads and returns wall clock ns per submitted point */
+static double run_threads(unsigned threads, const std::function<void(unsigned)> &body)
+{
+	std::vector<std::thread> workers;
+	std::atomic<bool> go{false};
+
+	for (unsigned i = 0; i < threads; ++i) {
+		workers.emplace_back([&, i]() {
+			while (!go.load())
+				;
+			body(i);
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	go = true;
+	for (auto &worker : workers)
+		worker.join();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / (threads * points_per_thread);
+}
+
+static void bench_sharded_scaling(struct procstat_context *ctx)
+{
+	printf("\nseries/histogram add_point scaling, ns per point (lost = updates lost by races)\n");
+	printf("%8s %12s %10s %12s %12s %10s %12s\n",
+	       "threads", "series", "lost", "sharded", "histogram", "lost", "sharded");
+
+	for (unsigned threads = 1; threads <= 64; threads *= 2) {
+		struct procstat_series_u64 series;
+		struct procstat_series_u64_sharded sharded_series;
+		struct procstat_histogram_u32 hist;
+		struct procstat_histogram_u32_sharded sharded_hist;
+		uint64_t expected = threads * points_per_thread;
+
+		memset(&series, 0, sizeof(series));
+		memset(&sharded_series, 0, sizeof(sharded_series));
+		memset(&hist, 0, sizeof(hist));
+		memset(&sharded_hist, 0, sizeof(sharded_hist));
+
+		procstat_create_u64_series(ctx, NULL, "series", &series);
+		procstat_create_u64_series_sharded(ctx, NULL, "sharded_series", &sharded_series);
+		procstat_create_histogram_u32_series(ctx, NULL, "hist", &hist);
+		procstat_create_histogram_u32_sharded(ctx, NULL, "sharded_hist", &sharded_hist);
+
+		double series_ns = run_threads(threads, [&](unsigned t) {
+			for (uint64_t i = 0; i < points_per_thread; ++i)
+				procstat_u64_series_add_point(&series, i);
+		});
+		double sharded_series_ns = run_threads(threads, [&](unsigned t) {
+			for (uint64_t i = 0; i < points_per_thread; ++i)
+				procstat_u64_series_sharded_add_point(&sharded_series, i);
+		});
+		double hist_ns = run_threads(threads, [&](unsigned t) {
+			for (uint64_t i = 0; i < points_per_thread; ++i)
+				procstat_histogram_u32_add_point(&hist, i);
+		});
+		double sharded_hist_ns = run_threads(threads, [&](unsigned t) {
+			for (uint64_t i = 0; i < points_per_thread; ++i)
+				procstat_histogram_u32_sharded_add_point(&sharded_hist, i);
+		});
+
+		uint64_t hist_count;
+		procstat_histogram_u32_get(&hist, NULL, &hist_count, NULL, NULL);
+		printf("%8u %12.2f %10lu %12.2f %12.2f %10lu %12.2f\n", threads,
+		       series_ns, expected - series.count, sharded_series_ns,
+		       hist_ns, expected - hist_count, sharded_hist_ns);
+
+		procstat_remove_by_name(ctx, NULL, "series");
+		procstat_remove_by_name(ctx, NULL, "sharded_series");
+		procstat_remove_by_name(ctx, NULL, "hist");
+		procstat_remove_by_name(ctx, NULL, "sharded_hist");
+	}
+}
+
+static void bench_percpu_counter(struct procstat_context *ctx)
+{
+	printf("\ncounter increment, ns per increment\n");
+	printf("%8s %12s %12s\n", "threads", "atomic", "percpu");
+
+	for (unsigned threads = 1; threads <= 64; threads *= 2) {
+		uint64_t atomic_counter = 0;
+		struct procstat_percpu_u64 percpu_counter;
+
+		memset(&percpu_counter, 0, sizeof(percpu_counter));
+		procstat_create_u64(ctx, NULL, "atomic", &atomic_counter);
+		procstat_create_percpu_u64(ctx, NULL, "percpu", &percpu_counter);
+
+		double atomic_ns = run_threads(threads, [&](unsigned t) {
+			for (uint64_t i = 0; i < points_per_thread; ++i)
+				__atomic_fetch_add(&atomic_counter, 1, __ATOMIC_RELAXED);
+		});
+		double percpu_ns = run_threads(threads, [&](unsigned t) {
+			for (uint64_t i = 0; i < points_per_thread; ++i)
+				procstat_percpu_u64_inc(&percpu_counter);
+		});
+
+		printf("%8u %12.2f %12.2f\n", threads, atomic_ns, percpu_ns);
+
+		procstat_remove_by_name(ctx, NULL, "atomic");
+		procstat_remove_by_name(ctx, NULL, "percpu");
+	}
+}
+
+/* bucket by bucket walk the percentile kernels are compared to */
+static void scalar_percentile_calculate(uint32_t *histogram, uint64_t samples_count,
+					struct procstat_percentile_result *result, unsigned result_len)
+{
+	unsigned long num_points = 0;
+	unsigned int i, j = 0;
+
+	for (i = 0; i < PROCSTAT_PERCENTILE_ARR_NR && j < result_len; ++i) {
+		num_points += histogram[i];
+		while (num_points >= result[j].fraction * samples_count) {
+			result[j].value = procstat_percentile_idx_to_val(i);
+			if (++j == result_len)
+				break;
+		}
+	}
+}
+
+static void scalar_merge(uint32_t *dst, const uint32_t *src)
+{
+	for (unsigned i = 0; i < PROCSTAT_PERCENTILE_ARR_NR; ++i)
+		dst[i] += src[i];
+}
+
+static void scalar_block_prefix_sum(const uint32_t *histogram, uint64_t *prefix)
+{
+	uint64_t sum = 0;
+
+	for (unsigned i = 0; i < PROCSTAT_PERCENTILE_ARR_NR; ++i) {
+		sum += histogram[i];
+		if (i % PROCSTAT_BUCKET_VALUES == PROCSTAT_BUCKET_VALUES - 1)
+			prefix[i / PROCSTAT_BUCKET_VALUES] = sum;
+	}
+}
+
+/* returns ns per call of @body, averaged over @iterations */
+static double time_ns(unsigned iterations, const std::function<void()> &body)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned i = 0; i < iterations; ++i)
+		body();
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void bench_percentile_kernels()
+{
+	static const unsigned iterations = 200000;
+	std::vector<uint32_t> histogram(PROCSTAT_PERCENTILE_ARR_NR), merged(PROCSTAT_PERCENTILE_ARR_NR);
+	struct procstat_percentile_result scalar[4] = {{0.5f}, {0.9f}, {0.99f}, {0.999f}};
+	struct procstat_percentile_result simd[4];
+	uint64_t prefix[PROCSTAT_GROUP_NR];
+	uint64_t samples = 1000000;
+	uint64_t seed = 1;
+
+	/* roughly log-normal latencies, spread over most of the groups */
+	for (uint64_t i = 0; i < samples; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		procstat_hist_add_point(histogram.data(), (uint32_t)(1ULL << ((seed >> 33) % 24)) + (seed >> 40) % 1000);
+	}
+	memcpy(simd, scalar, sizeof(simd));
+
+	printf("\nhistogram kernels, ns per call (%u buckets)\n", PROCSTAT_PERCENTILE_ARR_NR);
+	printf("%-24s %12s %12s\n", "operation", "scalar", "procstat");
+	printf("%-24s %12.1f %12.1f\n", "percentiles (4 ranks)",
+	       time_ns(iterations, [&]() { scalar_percentile_calculate(histogram.data(), samples, scalar, 4); }),
+	       time_ns(iterations, [&]() { procstat_percentile_calculate(histogram.data(), samples, simd, 4); }));
+	printf("%-24s %12.1f %12.1f\n", "block prefix sum",
+	       time_ns(iterations, [&]() { scalar_block_prefix_sum(histogram.data(), prefix); }),
+	       time_ns(iterations, [&]() { procstat_hist_block_prefix_sum(histogram.data(), prefix); }));
+	printf("%-24s %12.1f %12.1f\n", "merge",
+	       time_ns(iterations, [&]() { scalar_merge(merged.data(), histogram.data()); }),
+	       time_ns(iterations, [&]() { procstat_hist_merge(merged.data(), histogram.data()); }));
+
+	for (int i = 0; i < 4; ++i) {
+		if (scalar[i].value != simd[i].value)
+			printf("percentile %.4g mismatch: %u != %u\n", scalar[i].fraction, scalar[i].value, simd[i].value);
+	}
+}
+
+static void bench_histogram_footprint()
+{
+	struct procstat_hist_sparse sparse = {};
+	uint64_t seed = 1;
+
+	/* latencies around 200us, touching a couple of bucket groups */
+	for (int i = 0; i < 1000000; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		procstat_hist_sparse_add_point(&sparse, 150000 + (seed >> 33) % 100000);
+	}
+	printf("\nhistogram bucket footprint, bytes: dense %zu sparse %zu + %zu index\n",
+	       PROCSTAT_PERCENTILE_ARR_NR * sizeof(uint32_t), procstat_hist_sparse_size(&sparse), sizeof(sparse));
+	procstat_hist_sparse_free(&sparse);
+}
+
+static void bench_batch_ingest(struct procstat_context *ctx)
+{
+	static const unsigned batch = 64;
+	static const unsigned rounds = 20;
+	std::vector<uint64_t> values64(points_per_thread);
+	std::vector<uint32_t> values32(points_per_thread);
+	struct procstat_series_u64 series;
+	struct procstat_histogram_u32 hist;
+	uint64_t seed = 1;
+
+	for (uint64_t i = 0; i < points_per_thread; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		values32[i] = 100000 + (seed >> 33) % 100000;
+		values64[i] = values32[i];
+	}
+
+	memset(&series, 0, sizeof(series));
+	memset(&hist, 0, sizeof(hist));
+	procstat_create_u64_series(ctx, NULL, "series", &series);
+	procstat_create_histogram_u32_series(ctx, NULL, "histogram", &hist);
+
+	printf("\nbatch ingest, ns per value (batches of %u)\n", batch);
+	printf("%-12s %12s %12s\n", "", "add_point", "add_points");
+	printf("%-12s %12.2f %12.2f\n", "series",
+	       time_ns(rounds, [&]() {
+		       for (uint64_t i = 0; i < points_per_thread; ++i)
+			       procstat_u64_series_add_point(&series, values64[i]);
+	       }) / points_per_thread,
+	       time_ns(rounds, [&]() {
+		       for (uint64_t i = 0; i < points_per_thread; i += batch)
+			       procstat_u64_series_add_points(&series, &values64[i],
+							      std::min<uint64_t>(batch, points_per_thread - i));
+	       }) / points_per_thread);
+	printf("%-12s %12.2f %12.2f\n", "histogram",
+	       time_ns(rounds, [&]() {
+		       for (uint64_t i = 0; i < points_per_thread; ++i)
+			       procstat_histogram_u32_add_point(&hist, values32[i]);
+	       }) / points_per_thread,
+	       time_ns(rounds, [&]() {
+		       for (uint64_t i = 0; i < points_per_thread; i += batch)
+			       procstat_histogram_u32_add_points(&hist, &values32[i],
+								 std::min<uint64_t>(batch, points_per_thread - i));
+	       }) / points_per_thread);
+
+	procstat_remove_by_name(ctx, NULL, "series");
+	procstat_remove_by_name(ctx, NULL, "histogram");
+}
+
+static void bench_fast_series(struct procstat_context *ctx)
+{
+	static const unsigned rounds = 20;
+	std::vector<uint64_t> values(points_per_thread);
+	struct procstat_series_u64 series;
+	struct procstat_series_u64_fast fast;
+	uint64_t seed = 1;
+
+	for (uint64_t i = 0; i < points_per_thread; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		values[i] = 100000 + (seed >> 33) % 100000;
+	}
+
+	memset(&series, 0, sizeof(series));
+	memset(&fast, 0, sizeof(fast));
+	procstat_create_u64_series(ctx, NULL, "series", &series);
+	procstat_create_u64_fast_series(ctx, NULL, "fast", &fast);
+
+	printf("\nseries add_point, ns per value\n");
+	printf("%-12s %12.2f\n", "welford",
+	       time_ns(rounds, [&]() {
+		       for (uint64_t i = 0; i < points_per_thread; ++i)
+			       procstat_u64_series_add_point(&series, values[i]);
+	       }) / points_per_thread);
+	printf("%-12s %12.2f\n", "fast",
+	       time_ns(rounds, [&]() {
+		       for (uint64_t i = 0; i < points_per_thread; ++i)
+			       procstat_u64_fast_series_add_point(&fast, values[i]);
+	       }) / points_per_thread);
+
+	procstat_remove_by_name(ctx, NULL, "series");
+	procstat_remove_by_name(ctx, NULL, "fast");
+}
+
+static void bench_directory_registration(struct procstat_context *ctx)
+{
+	static const unsigned directories = 200000;
+	struct procstat_item *parent;
+	double ns;
+
+	parent = procstat_create_directory(ctx, NULL, "volumes");
+	printf("\nregistration of %u directories under one parent\n", directories);
+	ns = time_ns(1, [&]() {
+		for (unsigned i = 0; i < directories; ++i)
+			procstat_create_directory(ctx, parent, ("volume-" + std::to_string(i)).c_str());
+	});
+	printf("%-12s %12.2f ns per directory\n", "register", ns / directories);
+	ns = time_ns(1, [&]() {
+		for (unsigned i = 0; i < directories; ++i)
+			procstat_refput(ctx, procstat_lookup_item(ctx, parent, ("volume-" + std::to_string(i)).c_str()));
+	});
+	printf("%-12s %12.2f ns per directory\n", "lookup", ns / directories);
+
+	procstat_remove(ctx, parent);
+}
+
+int main(int argc, char **argv)
+{
+	struct procstat_context *ctx;
+
+	ctx = argc > 1 ? procstat_create(argv[1]) : procstat_create_headless();
+	if (!ctx) {
+		perror("procstat_create");
+		return 1;
+	}
+
+	bench_sharded_scaling(ctx);
+	bench_percpu_counter(ctx);
+	bench_percentile_kernels();
+	bench_histogram_footprint();
+	bench_batch_ingest(ctx);
+	bench_fast_series(ctx);
+	bench_directory_registration(ctx);
+
+	procstat_destroy(ctx);
+	return 0;
+}
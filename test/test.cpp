@@ -35,6 +35,19 @@ TEST(CppTest, stop_start_with_registered_value)
 }
 
 
+TEST(CppTest, headless_then_mount)
+{
+	procstat::context ctx;
+	int stat1 = 4;
+	ctx.root().create("stat1", stat1);
+	EXPECT_EQ("4\n", ctx.read("stat1"));
+	EXPECT_THROW(ctx.read("missing"), std::system_error);
+
+	ctx.mount(mount_name());
+	EXPECT_EQ(4, read_stat_file<int>(mount_name() + "/stat1"));
+	ctx.stop();
+}
+
 TEST(procstat, test_simple_value_read)
 {
 	procstat::context ctx(mount_name());
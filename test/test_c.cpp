@@ -6,13 +6,32 @@
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem.hpp>
 #include <unordered_map>
+#include <map>
+#include <future>
 #include "utils.hpp"
 #include <boost/format.hpp>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <sstream>
+#include <random>
 
 void* fuse_loop(void *arg)
 {
 	struct procstat_context *ctx = (struct procstat_context *)arg;
-	procstat_loop(ctx);
+	procstat_loop_mt(ctx);
 	return NULL;
 }
 
@@ -222,6 +241,39 @@ TEST_F (ProcstatTest, test_create_custom_getter_and_formatter) {
 	ASSERT_EQ(1, read_stat_file<uint16_t >(mount_name() + "/val16_special"));
 }
 
+static ssize_t format_table(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	size_t total = 0;
+
+	++*(int *)object;
+	for (uint64_t row = 0; row < arg; ++row) {
+		size_t offset = std::min(total, length);
+		int len = snprintf(buffer + offset, length - offset, "row %05lu\n", row);
+
+		total += len;
+	}
+	return total;
+}
+
+TEST_F (ProcstatTest, test_large_value)
+{
+	int calls = 0;
+	struct procstat_simple_handle descriptor = {"table", &calls, 3000, format_table};
+	std::string content;
+	int error;
+
+	error = procstat_create_simple(context, NULL, &descriptor, 1);
+	ASSERT_FALSE(error);
+
+	/* 30000 bytes are served in several reads, formatted once more only to grow the buffer */
+	fs::ifstream file(mount_name() + "/table");
+	content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	ASSERT_EQ(30000, content.size());
+	EXPECT_EQ("row 00000\n", content.substr(0, 10));
+	EXPECT_EQ("row 02999\n", content.substr(29990));
+	EXPECT_EQ(2, calls);
+}
+
 
 
 TEST_F (ProcstatTest, test_create_multiple_start_end_stats)
@@ -443,6 +495,403 @@ TEST_F (ProcstatTest, test_histogram)
 
 }
 
+TEST_F (ProcstatTest, test_histogram_reset_under_writer)
+{
+	struct procstat_histogram_u32 series = {};
+	std::atomic<bool> stop{false};
+	uint64_t buckets = 0;
+	int error;
+
+	series.percentile[0].fraction = 0.5f;
+	series.npercentile = 1;
+	error = procstat_create_histogram_u32_series(context, NULL, "swap", &series);
+	ASSERT_FALSE(error);
+
+	std::thread writer([&]() {
+		uint32_t value = 0;
+
+		while (!stop)
+			procstat_histogram_u32_add_point(&series, value++ % 1000);
+	});
+	for (int i = 0; i < 20; ++i) {
+		write_to_stat_file(mount_name() + "/swap/reset", 1);
+		read_histogram(mount_name() + "/swap", {"50"});
+	}
+	stop = true;
+	writer.join();
+
+	/* no sample is lost or left over from the values before the last reset */
+	std::vector<uint32_t> dense(PROCSTAT_PERCENTILE_ARR_NR);
+	uint64_t count;
+	procstat_histogram_u32_get(&series, NULL, &count, NULL, dense.data());
+	for (auto bucket : dense)
+		buckets += bucket;
+	EXPECT_EQ(count, buckets);
+
+	write_to_stat_file(mount_name() + "/swap/reset", 1);
+	procstat_histogram_u32_add_point(&series, 3);
+	auto values = read_histogram(mount_name() + "/swap", {"50"});
+	EXPECT_EQ(values["count"], 1);
+	EXPECT_EQ(values["sum"], 3);
+
+	procstat_remove_by_name(context, NULL, "swap");
+}
+
+static std::atomic<int> percentile_computations;
+
+static void counting_percentile_calculate(uint32_t *histogram, uint64_t samples_count,
+					  struct procstat_percentile_result *result, unsigned result_len)
+{
+	++percentile_computations;
+	procstat_percentile_calculate(histogram, samples_count, result, result_len);
+}
+
+TEST_F (ProcstatTest, test_histogram_percentile_cache)
+{
+	struct procstat_histogram_u32 series = {};
+	int error;
+
+	series.percentile[0].fraction = 0.5f;
+	series.percentile[1].fraction = 0.9f;
+	series.percentile[2].fraction = 0.99f;
+	series.npercentile = 3;
+	series.compute_cb = counting_percentile_calculate;
+	error = procstat_create_histogram_u32_series(context, NULL, "cached", &series);
+	ASSERT_FALSE(error);
+
+	for (int i = 0; i < 1000; ++i)
+		procstat_histogram_u32_add_point(&series, i);
+
+	/* all percentile files of one scrape share a single computation */
+	percentile_computations = 0;
+	auto values = read_histogram(mount_name() + "/cached", {"50", "90", "99"});
+	EXPECT_EQ(1, percentile_computations);
+	EXPECT_EQ(values["90"], 900);
+
+	/* no new samples, nothing to recompute */
+	usleep(200000);
+	read_histogram(mount_name() + "/cached", {"50", "90", "99"});
+	EXPECT_EQ(1, percentile_computations);
+
+	write_to_stat_file(mount_name() + "/cached/reset", 1);
+	procstat_histogram_u32_add_point(&series, 5);
+	values = read_histogram(mount_name() + "/cached", {"50", "90", "99"});
+	EXPECT_EQ(2, percentile_computations);
+	EXPECT_EQ(values["99"], 5);
+
+	procstat_remove_by_name(context, NULL, "cached");
+}
+
+TEST_F (ProcstatTest, test_histogram_u64)
+{
+	struct procstat_histogram_u64 series = {};
+	struct procstat_histogram_u64 coarse = {};
+	int error;
+
+	series.percentile[0].fraction = 0.5f;
+	series.percentile[1].fraction = 0.99f;
+	series.npercentile = 2;
+	series.precision_bits = 7;
+	error = procstat_create_histogram_u64_series(context, NULL, "hist64", &series);
+	ASSERT_FALSE(error);
+
+	/* latencies of 1ms to 1s in ns, far above the range of the u32 histogram */
+	for (uint64_t i = 1; i <= 1000; ++i)
+		procstat_histogram_u64_add_point(&series, i * 1000000);
+
+	auto values = read_histogram(mount_name() + "/hist64", {"50", "99"});
+	EXPECT_EQ(values["count"], 1000);
+	EXPECT_EQ(values["sum"], 500500000000);
+	EXPECT_EQ(values["last"], 1000000000);
+	EXPECT_NEAR(values["50"], 500000000, 500000000 / 256);
+	EXPECT_NEAR(values["99"], 990000000, 990000000 / 256);
+
+	write_to_stat_file(mount_name() + "/hist64/reset", 1);
+	procstat_histogram_u64_add_point(&series, UINT64_MAX);
+	values = read_histogram(mount_name() + "/hist64", {"50", "99"});
+	EXPECT_EQ(values["count"], 1);
+	EXPECT_NEAR((double)values["99"], (double)UINT64_MAX, (double)UINT64_MAX / 256);
+
+	coarse.percentile[0].fraction = 0.5f;
+	coarse.npercentile = 1;
+	coarse.precision_bits = PROCSTAT_U64_BUCKET_BITS_MAX + 1;
+	EXPECT_EQ(-1, procstat_create_histogram_u64_series(context, NULL, "coarse", &coarse));
+	EXPECT_EQ(EINVAL, errno);
+
+	procstat_remove_by_name(context, NULL, "hist64");
+}
+
+TEST_F (ProcstatTest, test_histogram_counter_widening)
+{
+	struct procstat_histogram_u32 series = {};
+	int error;
+
+	series.percentile[0].fraction = 0.5f;
+	series.percentile[1].fraction = 0.99f;
+	series.npercentile = 2;
+	error = procstat_create_histogram_u32_series(context, NULL, "wide", &series);
+	ASSERT_FALSE(error);
+
+	/* overflow the 8 and 16 bit counters of a single bucket */
+	for (int i = 0; i < 70000; ++i)
+		procstat_histogram_u32_add_point(&series, 5);
+	procstat_histogram_u32_add_point(&series, 1000);
+
+	auto values = read_histogram(mount_name() + "/wide", {"50", "99"});
+	EXPECT_EQ(values["count"], 70001);
+	EXPECT_EQ(values["50"], 5);
+	EXPECT_EQ(values["99"], 5);
+
+	/* only the touched groups are allocated */
+	EXPECT_GE(procstat_histogram_u32_size(&series), 64 * sizeof(uint32_t));
+	EXPECT_LT(procstat_histogram_u32_size(&series), PROCSTAT_PERCENTILE_ARR_NR * sizeof(uint32_t));
+
+	procstat_remove_by_name(context, NULL, "wide");
+}
+
+TEST_F (ProcstatTest, test_batch_ingest)
+{
+	struct procstat_series_u64 series = {};
+	struct procstat_histogram_u32 batch = {};
+	struct procstat_histogram_u32 single = {};
+	std::vector<uint64_t> points64;
+	std::vector<uint32_t> points32;
+	int error;
+
+	for (uint32_t i = 0; i < 1000; ++i) {
+		points64.push_back((i * 7919) % 100000);
+		points32.push_back((i * 7919) % 100000);
+	}
+
+	error = procstat_create_u64_series(context, NULL, "series", &series);
+	ASSERT_FALSE(error);
+	procstat_u64_series_add_points(&series, points64.data(), points64.size());
+	procstat_u64_series_add_point_n(&series, 42, 10);
+
+	auto values = read_series(mount_name() + "/series");
+	EXPECT_EQ(values["count"], 1010);
+	EXPECT_EQ(values["sum"], std::accumulate(points64.begin(), points64.end(), (uint64_t)0) + 420);
+	EXPECT_EQ(values["min"], *std::min_element(points64.begin(), points64.end()));
+	EXPECT_EQ(values["max"], *std::max_element(points64.begin(), points64.end()));
+	EXPECT_EQ(values["last"], 42);
+
+	batch.percentile[0].fraction = single.percentile[0].fraction = 0.5f;
+	batch.percentile[1].fraction = single.percentile[1].fraction = 0.99f;
+	batch.npercentile = single.npercentile = 2;
+	error = procstat_create_histogram_u32_series(context, NULL, "batch", &batch);
+	ASSERT_FALSE(error);
+	error = procstat_create_histogram_u32_series(context, NULL, "single", &single);
+	ASSERT_FALSE(error);
+
+	/* batched and weighted points must land in the same buckets as single points */
+	procstat_histogram_u32_add_points(&batch, points32.data(), points32.size());
+	procstat_histogram_u32_add_point_n(&batch, 300, 300);
+	for (auto point : points32)
+		procstat_histogram_u32_add_point(&single, point);
+	for (int i = 0; i < 300; ++i)
+		procstat_histogram_u32_add_point(&single, 300);
+
+	auto batch_values = read_histogram(mount_name() + "/batch", {"50", "99"});
+	auto single_values = read_histogram(mount_name() + "/single", {"50", "99"});
+	EXPECT_EQ(batch_values["count"], 1300);
+	EXPECT_EQ(batch_values, single_values);
+
+	procstat_remove_by_name(context, NULL, "series");
+	procstat_remove_by_name(context, NULL, "batch");
+	procstat_remove_by_name(context, NULL, "single");
+}
+
+TEST_F (ProcstatTest, test_fast_series)
+{
+	struct procstat_series_u64_fast series = {};
+	int error;
+
+	error = procstat_create_u64_fast_series(context, NULL, "fast", &series);
+	ASSERT_FALSE(error);
+
+	/* mean 1000000005.5 and sample variance 9.17, truncated by the Welford series */
+	for (uint64_t i = 1; i <= 10; ++i)
+		procstat_u64_fast_series_add_point(&series, 1000000000 + i);
+
+	auto values = read_series(mount_name() + "/fast");
+	EXPECT_EQ(values["count"], 10);
+	EXPECT_EQ(values["sum"], 10000000055);
+	EXPECT_EQ(values["min"], 1000000001);
+	EXPECT_EQ(values["max"], 1000000010);
+	EXPECT_EQ(values["last"], 1000000010);
+	EXPECT_EQ(values["avg"], 1000000005);
+	EXPECT_EQ(values["mean"], 1000000006);
+	EXPECT_EQ(values["stddev"], 9);
+
+	write_to_stat_file(mount_name() + "/fast/reset", 1);
+	values = read_series(mount_name() + "/fast");
+	EXPECT_EQ(values["count"], 0);
+
+	procstat_u64_fast_series_add_point(&series, 7);
+	values = read_series(mount_name() + "/fast");
+	EXPECT_EQ(values["min"], 7);
+	EXPECT_EQ(values["mean"], 7);
+	EXPECT_EQ(values["stddev"], 0);
+
+	procstat_remove_by_name(context, NULL, "fast");
+}
+
+TEST_F (ProcstatTest, test_series_reset_interval)
+{
+	struct procstat_series_u64 series;
+	int error;
+
+	memset(&series, 0, sizeof(series));
+	error = procstat_create_u64_series(context, NULL, "interval", &series);
+	ASSERT_FALSE(error);
+
+	write_to_stat_file(mount_name() + "/interval/reset_interval_sec", 1);
+	EXPECT_EQ(1, read_stat_file<uint64_t>(mount_name() + "/interval/get_reset_interval_sec"));
+
+	for (int i = 0; i < 10; ++i)
+		procstat_u64_series_add_point(&series, i);
+	EXPECT_EQ(10, series.count);
+
+	/* the expiry is noticed by the writer without any read in between */
+	sleep(3);
+	procstat_u64_series_add_point(&series, 7);
+	EXPECT_EQ(1, series.count);
+	EXPECT_EQ(7, series.min);
+
+	procstat_remove_by_name(context, NULL, "interval");
+}
+
+TEST_F (ProcstatTest, test_series_consistent_read)
+{
+	struct procstat_series_u64 series;
+	std::atomic<bool> stop{false};
+	int error;
+
+	memset(&series, 0, sizeof(series));
+	error = procstat_create_u64_series(context, NULL, "consistent", &series);
+	ASSERT_FALSE(error);
+
+	procstat_u64_series_add_point(&series, 5);
+	std::thread writer([&]() {
+		while (!stop)
+			procstat_u64_series_add_point(&series, 5);
+	});
+
+	/* sum and count are read from one snapshot, so avg never spikes */
+	for (int i = 0; i < 1000; ++i) {
+		EXPECT_EQ(5, read_stat_file<uint64_t>(mount_name() + "/consistent/avg"));
+		EXPECT_EQ(0, read_stat_file<uint64_t>(mount_name() + "/consistent/stddev"));
+	}
+
+	stop = true;
+	writer.join();
+	procstat_remove_by_name(context, NULL, "consistent");
+}
+
+TEST_F (ProcstatTest, test_sharded_series)
+{
+	struct procstat_series_u64_sharded series = {};
+	std::vector<std::thread> writers;
+	int error;
+
+	error = procstat_create_u64_series_sharded(context, NULL, "sharded", &series);
+	ASSERT_FALSE(error);
+
+	for (int t = 0; t < 8; ++t) {
+		writers.emplace_back([&series]() {
+			for (int i = 1; i <= 10000; ++i)
+				procstat_u64_series_sharded_add_point(&series, i);
+		});
+	}
+	for (auto &writer : writers)
+		writer.join();
+
+	auto values = read_series(mount_name() + "/sharded");
+	EXPECT_EQ(values["count"], 80000);
+	EXPECT_EQ(values["sum"], 8 * 50005000UL);
+	EXPECT_EQ(values["min"], 1);
+	EXPECT_EQ(values["max"], 10000);
+	EXPECT_EQ(values["last"], 10000);
+	EXPECT_EQ(values["avg"], 5000);
+
+	write_to_stat_file(mount_name() + "/sharded/reset", 1);
+	values = read_series(mount_name() + "/sharded");
+	EXPECT_EQ(values["count"], 0);
+
+	procstat_u64_series_sharded_add_point(&series, 7);
+	values = read_series(mount_name() + "/sharded");
+	EXPECT_EQ(values["count"], 1);
+	EXPECT_EQ(values["min"], 7);
+	EXPECT_EQ(values["max"], 7);
+
+	procstat_remove_by_name(context, NULL, "sharded");
+	ASSERT_FALSE(boost::filesystem::exists(mount_name() + "/sharded"));
+}
+
+TEST_F (ProcstatTest, test_sharded_histogram)
+{
+	struct procstat_histogram_u32_sharded series = {};
+	std::vector<std::thread> writers;
+	int error;
+
+	series.percentile[0].fraction = 0.5f;
+	series.percentile[1].fraction = 0.99f;
+	series.npercentile = 2;
+
+	error = procstat_create_histogram_u32_sharded(context, NULL, "sharded_hist", &series);
+	ASSERT_FALSE(error);
+
+	for (int t = 0; t < 4; ++t) {
+		writers.emplace_back([&series]() {
+			for (int i = 0; i < 100; ++i)
+				procstat_histogram_u32_sharded_add_point(&series, i);
+		});
+	}
+	for (auto &writer : writers)
+		writer.join();
+
+	auto values = read_histogram(mount_name() + "/sharded_hist", {"50", "99"});
+	EXPECT_EQ(values["count"], 400);
+	EXPECT_EQ(values["sum"], 4 * 4950);
+	EXPECT_EQ(values["last"], 99);
+	EXPECT_EQ(values["50"], 49);
+	EXPECT_EQ(values["99"], 98);
+
+	write_to_stat_file(mount_name() + "/sharded_hist/reset", 1);
+	values = read_histogram(mount_name() + "/sharded_hist", {"50", "99"});
+	EXPECT_EQ(values["count"], 0);
+	EXPECT_EQ(values["50"], 0);
+
+	procstat_remove_by_name(context, NULL, "sharded_hist");
+}
+
+TEST_F (ProcstatTest, test_percpu_counter)
+{
+	struct procstat_percpu_u64 counter = {};
+	std::vector<std::thread> writers;
+	int error;
+
+	error = procstat_create_percpu_u64(context, NULL, "percpu", &counter);
+	ASSERT_FALSE(error);
+	ASSERT_EQ(0, read_stat_file<uint64_t>(mount_name() + "/percpu"));
+
+	for (int t = 0; t < 8; ++t) {
+		writers.emplace_back([&counter]() {
+			for (int i = 0; i < 100000; ++i)
+				procstat_percpu_u64_inc(&counter);
+		});
+	}
+	for (auto &writer : writers)
+		writer.join();
+
+	procstat_percpu_u64_add(&counter, 5);
+	ASSERT_EQ(800005, procstat_percpu_u64_read(&counter));
+	ASSERT_EQ(800005, read_stat_file<uint64_t>(mount_name() + "/percpu"));
+
+	procstat_remove_by_name(context, NULL, "percpu");
+	ASSERT_FALSE(boost::filesystem::exists(mount_name() + "/percpu"));
+}
+
 static ssize_t procstat_control_set_u64(void *object, uint64_t arg, char *buffer, size_t length)
 {
 	uint64_t *ptr = (uint64_t *)object;
@@ -504,6 +953,939 @@ TEST_F (ProcstatTest, test_delete_stat_after_open)
 }
 
 
+TEST_F (ProcstatTest, test_concurrent_readers_and_registration)
+{
+	std::atomic<bool> done(false);
+	std::atomic<int> bad_reads(0);
+	std::vector<std::thread> readers;
+	int value = 42;
+	int error;
+
+	error = procstat_create_int_parameter(context, NULL, "stable", &value);
+	ASSERT_FALSE(error);
+
+	for (int i = 0; i < 4; ++i) {
+		readers.emplace_back([&]() {
+			while (!done) {
+				if (read_stat_file<int>(mount_name() + "/stable") != 42)
+					++bad_reads;
+				boost::system::error_code ec;
+				for (boost::filesystem::directory_iterator it(mount_name(), ec), end; !ec && it != end; it.increment(ec))
+					;
+			}
+		});
+	}
+
+	/* registration and removal must not break concurrent lookups and directory listings */
+	for (int i = 0; i < 200; ++i) {
+		std::string name = "churn-" + std::to_string(i % 8);
+		struct procstat_item *dir = procstat_create_directory(context, NULL, name.c_str());
+
+		ASSERT_TRUE(dir);
+		error = procstat_create_int_parameter(context, dir, "value", &value);
+		ASSERT_FALSE(error);
+		procstat_remove_by_name(context, NULL, name.c_str());
+	}
+
+	done = true;
+	for (auto &reader : readers)
+		reader.join();
+	EXPECT_EQ(0, bad_reads);
+	procstat_remove_by_name(context, NULL, "stable");
+}
+
+TEST_F (ProcstatTest, test_large_directory)
+{
+	struct procstat_item *parent;
+	std::vector<std::string> listed;
+
+	parent = procstat_create_directory(context, NULL, "volumes");
+	ASSERT_TRUE(parent);
+
+	/* well past the threshold where lookups switch to the hash index */
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_TRUE(procstat_create_directory(context, parent, ("volume-" + std::to_string(i)).c_str()));
+	ASSERT_FALSE(procstat_create_directory(context, parent, "volume-500"));
+	ASSERT_EQ(EEXIST, errno);
+
+	for (int i = 0; i < 1000; i += 2)
+		procstat_remove_by_name(context, parent, ("volume-" + std::to_string(i)).c_str());
+	for (int i = 0; i < 1000; ++i) {
+		struct procstat_item *item = procstat_lookup_item(context, parent, ("volume-" + std::to_string(i)).c_str());
+
+		EXPECT_EQ(i % 2 == 1, item != NULL);
+		if (item)
+			procstat_refput(context, item);
+	}
+	EXPECT_TRUE(boost::filesystem::exists(mount_name() + "/volumes/volume-999"));
+	EXPECT_FALSE(boost::filesystem::exists(mount_name() + "/volumes/volume-998"));
+
+	/* listing keeps the registration order */
+	for (boost::filesystem::directory_iterator it(mount_name() + "/volumes"), end; it != end; ++it)
+		listed.push_back(it->path().filename().string());
+	ASSERT_EQ(500, listed.size());
+	for (int i = 0; i < 500; ++i)
+		EXPECT_EQ("volume-" + std::to_string(2 * i + 1), listed[i]);
+
+	procstat_remove_subtree(context, parent);
+	EXPECT_FALSE(procstat_lookup_item(context, parent, "volume-1"));
+	ASSERT_TRUE(procstat_create_directory(context, parent, "volume-1"));
+	procstat_remove(context, parent);
+}
+
+TEST_F (ProcstatTest, test_readdir_snapshot)
+{
+	struct procstat_item *parent;
+	struct dirent *entry;
+	int entries = 0;
+	DIR *dir;
+
+	parent = procstat_create_directory(context, NULL, "snapshot");
+	ASSERT_TRUE(parent);
+	for (int i = 0; i < 3; ++i)
+		ASSERT_TRUE(procstat_create_directory(context, parent, ("entry-" + std::to_string(i)).c_str()));
+
+	/* the listing is taken on opendir, later changes show up on the next opendir */
+	dir = opendir((mount_name() + "/snapshot").c_str());
+	ASSERT_TRUE(dir);
+	procstat_remove_by_name(context, parent, "entry-1");
+	while ((entry = readdir(dir)))
+		entries += strncmp(entry->d_name, "entry-", 6) == 0;
+	closedir(dir);
+	EXPECT_EQ(3, entries);
+
+	entries = 0;
+	for (boost::filesystem::directory_iterator it(mount_name() + "/snapshot"), end; it != end; ++it)
+		++entries;
+	EXPECT_EQ(2, entries);
+
+	procstat_remove(context, parent);
+}
+
+TEST_F (ProcstatTest, test_cacheable_file)
+{
+	uint64_t limit = 1000;
+	struct procstat_simple_handle handle = {"limit", &limit, 0, procstat_format_u64_decimal,
+						procstat_write_u64_decimal};
+	struct procstat_item *item;
+	int error;
+
+	error = procstat_create_cacheable(context, NULL, &handle, 1);
+	ASSERT_FALSE(error);
+	EXPECT_EQ(5, boost::filesystem::file_size(mount_name() + "/limit"));
+	EXPECT_EQ(1000, read_stat_file<uint64_t>(mount_name() + "/limit"));
+
+	/* writes through the filesystem drop the cached value themselves, shortly after replying */
+	write_to_stat_file(mount_name() + "/limit", 20);
+	EXPECT_EQ(20, limit);
+	for (int i = 0; i < 100 && boost::filesystem::file_size(mount_name() + "/limit") != 3; ++i)
+		usleep(10 * 1000);
+	EXPECT_EQ(3, boost::filesystem::file_size(mount_name() + "/limit"));
+	EXPECT_EQ(20, read_stat_file<uint64_t>(mount_name() + "/limit"));
+
+	/* changes made by the application are published by invalidating the item */
+	item = procstat_lookup_item(context, NULL, "limit");
+	ASSERT_TRUE(item);
+	limit = 123456;
+	procstat_invalidate(context, item);
+	EXPECT_EQ(123456, read_stat_file<uint64_t>(mount_name() + "/limit"));
+	procstat_refput(context, item);
+
+	/* removal drops the cached entry right away */
+	procstat_remove_by_name(context, NULL, "limit");
+	EXPECT_FALSE(boost::filesystem::exists(mount_name() + "/limit"));
+}
+
+TEST_F (ProcstatTest, test_aggregator_snapshot)
+{
+	struct procstat_item *parent;
+	uint64_t values[100];
+	std::string expected;
+	char buffer[256];
+	int error;
+	int fd;
+
+	parent = procstat_create_directory(context, NULL, "aggregated");
+	ASSERT_TRUE(parent);
+	for (int i = 0; i < 100; ++i) {
+		std::string name = "value-" + std::to_string(i);
+
+		values[i] = i;
+		error = procstat_create_u64(context, parent, name.c_str(), &values[i]);
+		ASSERT_FALSE(error);
+		expected += "/" + name + ":" + std::to_string(i) + "\n";
+	}
+	error = procstat_create_aggregator_ex(context, parent, "all", PROCSTAT_AGGREGATOR_SNAPSHOT, PROCSTAT_FORMAT_TEXT);
+	ASSERT_FALSE(error);
+
+	fd = open((mount_name() + "/aggregated/all").c_str(), O_RDONLY);
+	ASSERT_LE(0, fd);
+	/* the values are taken on open, later updates are seen by the next open only */
+	values[99] = 1000;
+
+	/* reads can come at any offset, backwards included */
+	for (off_t off = expected.size() / 100 * 100; off >= 0; off -= 100) {
+		ssize_t size = pread(fd, buffer, 100, off);
+
+		ASSERT_EQ(std::min<size_t>(100, expected.size() - off), size);
+		EXPECT_EQ(expected.substr(off, size), std::string(buffer, size));
+	}
+	EXPECT_EQ(0, pread(fd, buffer, sizeof(buffer), expected.size()));
+	close(fd);
+
+	fs::ifstream file(mount_name() + "/aggregated/all");
+	std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	EXPECT_NE(std::string::npos, content.find("/value-99:1000\n"));
+
+	procstat_remove(context, parent);
+}
+
+static std::string read_whole_file(const std::string &path)
+{
+	fs::ifstream file(path);
+
+	return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+TEST_F (ProcstatTest, test_aggregator_changes)
+{
+	struct procstat_item *parent;
+	uint64_t values[100];
+	char buffer[16];
+	int error;
+	int fd;
+
+	parent = procstat_create_directory(context, NULL, "changing");
+	ASSERT_TRUE(parent);
+	for (int i = 0; i < 100; ++i) {
+		values[i] = i;
+		error = procstat_create_u64(context, parent, ("value-" + std::to_string(i)).c_str(), &values[i]);
+		ASSERT_FALSE(error);
+	}
+	error = procstat_create_aggregator_ex(context, parent, "changes", PROCSTAT_AGGREGATOR_CHANGES,
+					      PROCSTAT_FORMAT_TEXT);
+	ASSERT_FALSE(error);
+
+	/* the first read outputs everything, the next ones only what changed in between */
+	EXPECT_NE(std::string::npos, read_whole_file(mount_name() + "/changing/changes").find("/value-99:99\n"));
+	EXPECT_EQ("", read_whole_file(mount_name() + "/changing/changes"));
+	values[7] = 700;
+	values[42] = 4200;
+	EXPECT_EQ("/value-7:700\n/value-42:4200\n", read_whole_file(mount_name() + "/changing/changes"));
+
+	/* a read that stops before the end does not move the cursor */
+	values[13] = 1300;
+	fd = open((mount_name() + "/changing/changes").c_str(), O_RDONLY);
+	ASSERT_LE(0, fd);
+	ASSERT_EQ(5, read(fd, buffer, 5));
+	close(fd);
+	EXPECT_EQ("/value-13:1300\n", read_whole_file(mount_name() + "/changing/changes"));
+
+	error = procstat_create_u64(context, parent, "added", &values[0]);
+	ASSERT_FALSE(error);
+	EXPECT_EQ("/added:0\n", read_whole_file(mount_name() + "/changing/changes"));
+
+	procstat_remove(context, parent);
+}
+
+static ssize_t format_state(void *object, uint64_t arg, char *buffer, size_t length)
+{
+	return snprintf(buffer, length, "up \"1\"\n");
+}
+
+TEST_F (ProcstatTest, test_aggregator_formats)
+{
+	struct procstat_histogram_u32 series = {};
+	struct procstat_item *parent;
+	struct procstat_item *server;
+	uint64_t requests = 5;
+	struct procstat_simple_handle state = {"state", NULL, 0, format_state};
+	int error;
+
+	parent = procstat_create_directory(context, NULL, "exported");
+	ASSERT_TRUE(parent);
+	server = procstat_create_directory(context, parent, "http-server");
+	ASSERT_TRUE(server);
+	ASSERT_FALSE(procstat_create_u64(context, server, "requests", &requests));
+	ASSERT_FALSE(procstat_create_simple(context, server, &state, 1));
+	ASSERT_FALSE(procstat_create_histogram_u32_series(context, parent, "latency", &series));
+	procstat_histogram_u32_add_point(&series, 1);
+	procstat_histogram_u32_add_point(&series, 1);
+	procstat_histogram_u32_add_point(&series, 100);
+	/* 200 and 201 share a bucket */
+	procstat_histogram_u32_add_point(&series, 200);
+
+	error = procstat_create_aggregator_ex(context, parent, "json", PROCSTAT_AGGREGATOR_SNAPSHOT, PROCSTAT_FORMAT_JSON);
+	ASSERT_FALSE(error);
+	error = procstat_create_aggregator_ex(context, parent, "metrics", PROCSTAT_AGGREGATOR_SNAPSHOT,
+					      PROCSTAT_FORMAT_PROMETHEUS);
+	ASSERT_FALSE(error);
+	/* streaming aggregators only output text */
+	error = procstat_create_aggregator_ex(context, parent, "stream", PROCSTAT_AGGREGATOR_STREAM, PROCSTAT_FORMAT_JSON);
+	EXPECT_EQ(-1, error);
+	EXPECT_EQ(EINVAL, errno);
+
+	/* every bucket up to the highest non empty one is output, so the bucket bounds stay stable */
+	std::string json_buckets;
+	std::string prometheus_buckets;
+	for (unsigned idx = 0;; ++idx) {
+		uint32_t le = procstat_percentile_idx_to_max(idx);
+		unsigned count = (le >= 1) * 2 + (le >= 100) + (le >= 201);
+
+		json_buckets += (idx ? ",[" : "[") + std::to_string(le) + "," + std::to_string(count) + "]";
+		prometheus_buckets += "latency_bucket{le=\"" + std::to_string(le) + "\"} " + std::to_string(count) + "\n";
+		if (le == 201)
+			break;
+	}
+
+	EXPECT_EQ("{\n"
+		  "\"http-server/requests\":5,\n"
+		  "\"http-server/state\":\"up \\\"1\\\"\",\n"
+		  "\"latency\":{\"count\":4,\"sum\":302,\"buckets\":[" + json_buckets + "]}\n"
+		  "}\n", read_whole_file(mount_name() + "/exported/json"));
+
+	EXPECT_EQ("# TYPE http_server_requests gauge\n"
+		  "http_server_requests 5\n"
+		  "# TYPE latency histogram\n" +
+		  prometheus_buckets +
+		  "latency_bucket{le=\"+Inf\"} 4\n"
+		  "latency_sum 302\n"
+		  "latency_count 4\n", read_whole_file(mount_name() + "/exported/metrics"));
+
+	procstat_remove(context, parent);
+}
+
+/* copies the exported segment under its sequence counter and returns the values by path */
+static std::map<std::string, std::string> read_shm_export(const char *name, uint64_t *generation)
+{
+	std::map<std::string, std::string> values;
+	struct procstat_shm_header *header;
+	std::vector<char> copy;
+	struct stat st;
+	uint32_t seq;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st))
+		return values;
+	header = (struct procstat_shm_header *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED)
+		return values;
+
+	do {
+		seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+		copy.assign((char *)header, (char *)header + std::min<uint64_t>(header->size, st.st_size));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&header->seq, __ATOMIC_RELAXED));
+	munmap(header, st.st_size);
+
+	header = (struct procstat_shm_header *)copy.data();
+	EXPECT_EQ(PROCSTAT_SHM_MAGIC, header->magic);
+	*generation = header->generation;
+	for (uint32_t i = 0; i < header->nentries; ++i) {
+		struct procstat_shm_entry *entry = &header->entries[i];
+
+		if (entry->type == PROCSTAT_SHM_U64) {
+			EXPECT_EQ(std::to_string(entry->value.u), &copy[entry->text]);
+		}
+		values[&copy[entry->path]] = &copy[entry->text];
+	}
+	return values;
+}
+
+TEST_F (ProcstatTest, test_shm_export)
+{
+	struct procstat_item *parent;
+	uint64_t values[2] = {1, 2};
+	uint64_t generation;
+	int error;
+
+	parent = procstat_create_directory(context, NULL, "shared");
+	ASSERT_TRUE(parent);
+	ASSERT_FALSE(procstat_create_u64(context, parent, "first", &values[0]));
+	ASSERT_FALSE(procstat_create_u64(context, NULL, "second", &values[1]));
+
+	error = procstat_shm_export(context, "procstat-test", 0);
+	ASSERT_FALSE(error);
+	/* a context has a single export */
+	EXPECT_EQ(-1, procstat_shm_export(context, "procstat-test-2", 0));
+	EXPECT_EQ(EEXIST, errno);
+
+	auto exported = read_shm_export("/procstat-test", &generation);
+	EXPECT_EQ(1, generation);
+	EXPECT_EQ("1", exported["shared/first"]);
+	EXPECT_EQ("2", exported["second"]);
+
+	/* values are updated on publish only */
+	values[0] = 100;
+	procstat_remove_by_name(context, NULL, "second");
+	EXPECT_EQ("1", read_shm_export("/procstat-test", &generation)["shared/first"]);
+	ASSERT_FALSE(procstat_shm_publish(context));
+	exported = read_shm_export("/procstat-test", &generation);
+	EXPECT_EQ(2, generation);
+	EXPECT_EQ("100", exported["shared/first"]);
+	EXPECT_EQ(0, exported.count("second"));
+
+	procstat_shm_close(context);
+	EXPECT_EQ(-1, shm_open("/procstat-test", O_RDONLY, 0));
+	procstat_remove(context, parent);
+}
+
+TEST (ProcstatHeadlessTest, test_read_and_snapshot_without_mount)
+{
+	struct procstat_context *headless = procstat_create_headless();
+	struct procstat_item *parent;
+	uint64_t values[2] = {42, 7};
+	char buffer[64];
+	size_t size;
+	char *snapshot;
+
+	ASSERT_TRUE(headless);
+	parent = procstat_create_directory(headless, NULL, "dir");
+	ASSERT_TRUE(parent);
+	ASSERT_FALSE(procstat_create_u64(headless, parent, "first", &values[0]));
+	ASSERT_FALSE(procstat_create_u64(headless, NULL, "second", &values[1]));
+
+	ASSERT_EQ(3, procstat_read_path(headless, "dir/first", buffer, sizeof(buffer)));
+	EXPECT_EQ("42\n", std::string(buffer, 3));
+	EXPECT_EQ(-1, procstat_read_path(headless, "dir/missing", buffer, sizeof(buffer)));
+	EXPECT_EQ(ENOENT, errno);
+	EXPECT_EQ(-1, procstat_read_path(headless, "dir", buffer, sizeof(buffer)));
+	EXPECT_EQ(EISDIR, errno);
+
+	snapshot = procstat_snapshot(headless, NULL, PROCSTAT_FORMAT_TEXT, &size);
+	ASSERT_TRUE(snapshot);
+	EXPECT_EQ("dir/first:42\n/second:7\n", std::string(snapshot, size));
+	free(snapshot);
+
+	snapshot = procstat_snapshot(headless, parent, PROCSTAT_FORMAT_JSON, NULL);
+	ASSERT_TRUE(snapshot);
+	EXPECT_STREQ("{\n\"first\":42\n}\n", snapshot);
+	free(snapshot);
+
+	/* nothing to serve */
+	procstat_loop(headless);
+	procstat_destroy(headless);
+}
+
+TEST (ProcstatHeadlessTest, test_histogram_reset_without_reads)
+{
+	struct procstat_context *headless = procstat_create_headless();
+	struct procstat_histogram_u32 narrow = {};
+	struct procstat_histogram_u64 wide = {};
+	uint64_t sum, count;
+	char buffer[64];
+
+	ASSERT_TRUE(headless);
+	ASSERT_FALSE(procstat_create_histogram_u32_series(headless, NULL, "narrow", &narrow));
+	ASSERT_FALSE(procstat_create_histogram_u64_series(headless, NULL, "wide", &wide));
+	procstat_histogram_u32_series_set_reset_interval(&narrow, 1);
+	procstat_histogram_u64_series_set_reset_interval(&wide, 1);
+
+	/* nothing reads the values across two intervals, each interval still starts from zero */
+	for (uint32_t value = 1; value <= 3; ++value) {
+		procstat_histogram_u32_add_point(&narrow, value);
+		procstat_histogram_u64_add_point(&wide, value);
+		sleep(3);
+	}
+	procstat_histogram_u32_add_point(&narrow, 10);
+	procstat_histogram_u32_add_point(&narrow, 20);
+	procstat_histogram_u64_add_point(&wide, 10);
+	procstat_histogram_u64_add_point(&wide, 20);
+
+	procstat_histogram_u32_get(&narrow, &sum, &count, NULL, NULL);
+	EXPECT_EQ(2, count);
+	EXPECT_EQ(30, sum);
+	ASSERT_EQ(3, procstat_read_path(headless, "wide/sum", buffer, sizeof(buffer)));
+	EXPECT_EQ("30\n", std::string(buffer, 3));
+	ASSERT_EQ(2, procstat_read_path(headless, "wide/count", buffer, sizeof(buffer)));
+	EXPECT_EQ("2\n", std::string(buffer, 2));
+	procstat_destroy(headless);
+}
+
+TEST (ProcstatKernelsTest, test_sparse_add_points_edges)
+{
+	const uint32_t edges[] = {0, 127, 128, 1U << 23, 1U << 24, 1U << 31, UINT32_MAX};
+	struct procstat_hist_sparse batched = {};
+	struct procstat_hist_sparse single = {};
+	std::vector<uint32_t> values;
+	uint64_t sum = 0;
+
+	/* edges and their neighbours, spread over full SIMD batches and the scalar tail */
+	for (int round = 0; round < 3; ++round)
+		for (auto edge : edges)
+			for (uint32_t value : {edge - 1, edge, edge + 1})
+				values.push_back(value);
+	for (auto value : values) {
+		procstat_hist_sparse_add_point(&single, value);
+		sum += value;
+	}
+	EXPECT_EQ(sum, procstat_hist_sparse_add_points(&batched, values.data(), values.size()));
+
+	std::vector<uint32_t> expected(PROCSTAT_PERCENTILE_ARR_NR), actual(PROCSTAT_PERCENTILE_ARR_NR);
+	procstat_hist_sparse_read(&single, expected.data());
+	procstat_hist_sparse_read(&batched, actual.data());
+	for (unsigned i = 0; i < PROCSTAT_PERCENTILE_ARR_NR; ++i)
+		EXPECT_EQ(expected[i], actual[i]) << "bucket " << i;
+	EXPECT_EQ(values.size(), std::accumulate(actual.begin(), actual.end(), 0ULL));
+	procstat_hist_sparse_free(&single);
+	procstat_hist_sparse_free(&batched);
+}
+
+struct kernel_results {
+	std::vector<uint64_t> prefix;
+	std::vector<uint32_t> merged;
+	std::vector<uint32_t> indexed;
+	uint64_t sum, min, max;
+	double squared_deviations;
+};
+
+static kernel_results run_kernels(const std::vector<std::vector<uint32_t>> &histograms,
+				  const std::vector<uint32_t> &values32, const std::vector<uint64_t> &values64)
+{
+	kernel_results results;
+	struct procstat_hist_sparse sparse = {};
+
+	for (auto &histogram : histograms) {
+		std::vector<uint64_t> prefix(PROCSTAT_GROUP_NR);
+
+		procstat_hist_block_prefix_sum(histogram.data(), prefix.data());
+		results.prefix.insert(results.prefix.end(), prefix.begin(), prefix.end());
+	}
+	results.merged = histograms[0];
+	for (size_t i = 1; i < histograms.size(); ++i)
+		procstat_hist_merge(results.merged.data(), histograms[i].data());
+
+	results.indexed.resize(PROCSTAT_PERCENTILE_ARR_NR);
+	procstat_hist_sparse_add_points(&sparse, values32.data(), values32.size());
+	procstat_hist_sparse_read(&sparse, results.indexed.data());
+	procstat_hist_sparse_free(&sparse);
+
+	results.min = UINT64_MAX;
+	results.max = 0;
+	results.sum = procstat_u64_min_max_sum(values64.data(), values64.size(), &results.min, &results.max);
+	results.squared_deviations = procstat_u64_squared_deviations(values64.data(), values64.size(),
+								     (double)results.sum / values64.size());
+	return results;
+}
+
+TEST (ProcstatKernelsTest, test_simd_kernels_match_generic)
+{
+	std::vector<std::vector<uint32_t>> histograms(8, std::vector<uint32_t>(PROCSTAT_PERCENTILE_ARR_NR));
+	std::vector<uint32_t> values32(1001);
+	std::vector<uint64_t> values64(1001);
+	std::mt19937_64 random(42);
+
+	/* the first histograms hold counts close to UINT32_MAX, so group sums and merges overflow u32 */
+	for (size_t h = 0; h < histograms.size(); ++h)
+		for (auto &bucket : histograms[h])
+			bucket = h < 3 ? UINT32_MAX - random() % 16 : random() % 1000;
+	for (auto &value : values32)
+		value = random() >> (random() % 64);
+	for (auto &value : values64)
+		value = random() >> (random() % 64);
+
+	ASSERT_EQ(0, procstat_select_kernels(PROCSTAT_KERNELS_GENERIC));
+	auto expected = run_kernels(histograms, values32, values64);
+	for (auto type : {PROCSTAT_KERNELS_SSE4, PROCSTAT_KERNELS_AVX2}) {
+		if (procstat_select_kernels(type))
+			continue;
+		auto actual = run_kernels(histograms, values32, values64);
+		EXPECT_EQ(expected.prefix, actual.prefix) << "kernels " << type;
+		EXPECT_EQ(expected.merged, actual.merged) << "kernels " << type;
+		EXPECT_EQ(expected.indexed, actual.indexed) << "kernels " << type;
+		EXPECT_EQ(expected.sum, actual.sum) << "kernels " << type;
+		EXPECT_EQ(expected.min, actual.min) << "kernels " << type;
+		EXPECT_EQ(expected.max, actual.max) << "kernels " << type;
+		/* lanes sum the deviations in another order */
+		EXPECT_NEAR(expected.squared_deviations, actual.squared_deviations,
+			    expected.squared_deviations * 1e-12) << "kernels " << type;
+	}
+	ASSERT_EQ(0, procstat_select_kernels(PROCSTAT_KERNELS_AUTO));
+}
+
+static void mount_done(struct procstat_context *context, int error, void *arg)
+{
+	static_cast<std::promise<int> *>(arg)->set_value(error);
+}
+
+TEST (ProcstatAsyncTest, test_registration_before_mount)
+{
+	std::promise<int> mounted;
+	std::future<int> result = mounted.get_future();
+	struct procstat_context *async;
+	uint64_t value = 5;
+	pthread_t looper;
+
+	async = procstat_create_async(mount_name().c_str(), mount_done, &mounted);
+	ASSERT_TRUE(async);
+	ASSERT_FALSE(procstat_create_u64(async, NULL, "early", &value));
+
+	pthread_create(&looper, NULL, fuse_loop, async);
+	ASSERT_EQ(std::future_status::ready, result.wait_for(std::chrono::seconds(10)));
+	ASSERT_EQ(0, result.get());
+	EXPECT_EQ(5, read_stat_file<uint64_t>(mount_name() + "/early"));
+
+	procstat_stop(async);
+	pthread_join(looper, NULL);
+	procstat_destroy(async);
+}
+
+TEST (ProcstatAsyncTest, test_stop_before_loop)
+{
+	std::promise<int> mounted;
+	std::future<int> result = mounted.get_future();
+	struct procstat_context *async;
+	pthread_t looper;
+
+	async = procstat_create_async(mount_name().c_str(), mount_done, &mounted);
+	ASSERT_TRUE(async);
+	procstat_stop(async);
+
+	/* the loop mounts, but does not serve a stopped context */
+	pthread_create(&looper, NULL, fuse_loop, async);
+	pthread_join(looper, NULL);
+	EXPECT_EQ(0, result.get());
+	procstat_stop(async);
+	procstat_destroy(async);
+}
+
+TEST (ProcstatAsyncTest, test_failed_mount)
+{
+	std::promise<int> mounted;
+	std::future<int> result = mounted.get_future();
+	struct procstat_context *async;
+	pthread_t looper;
+
+	async = procstat_create_async("/nonexistent/procstat", mount_done, &mounted);
+	ASSERT_TRUE(async);
+
+	/* the loop returns once the mount failed */
+	pthread_create(&looper, NULL, fuse_loop, async);
+	pthread_join(looper, NULL);
+	EXPECT_EQ(ENOENT, result.get());
+	procstat_destroy(async);
+}
+
+static void put_varint(std::string &out, uint64_t value)
+{
+	for (; value >= 0x80; value >>= 7)
+		out.push_back((value & 0x7f) | 0x80);
+	out.push_back(value);
+}
+
+static uint64_t get_varint(const char *&pos)
+{
+	uint64_t value = 0;
+	unsigned shift = 0;
+
+	for (;; shift += 7) {
+		unsigned char byte = *pos++;
+
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+}
+
+static std::string query_request(const std::vector<std::pair<procstat_query_kind, std::string>> &queries)
+{
+	std::string body;
+	std::string frame;
+
+	put_varint(body, queries.size());
+	for (auto &query : queries) {
+		body.push_back(query.first);
+		put_varint(body, query.second.size());
+		body += query.second;
+	}
+	put_varint(frame, body.size());
+	return frame + body;
+}
+
+/* reads one response frame and returns the values by path, histograms as "sum le:count..." */
+static std::map<std::string, std::string> query_response(int fd, uint64_t *status)
+{
+	std::map<std::string, std::string> values;
+	std::vector<char> body;
+	uint64_t size = 0;
+	unsigned shift = 0;
+	unsigned char byte;
+	size_t got = 0;
+
+	do {
+		if (read(fd, &byte, 1) != 1)
+			return values;
+		size |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	body.resize(size);
+	while (got < size) {
+		ssize_t len = read(fd, &body[got], size - got);
+
+		if (len <= 0)
+			return values;
+		got += len;
+	}
+
+	const char *pos = body.data();
+	*status = get_varint(pos);
+	uint64_t nentries = get_varint(pos);
+	for (uint64_t i = 0; i < nentries; ++i) {
+		std::ostringstream value;
+		uint64_t len = get_varint(pos);
+		std::string path(pos, len);
+		uint64_t bits = 0;
+		double real;
+
+		pos += len;
+		switch (*pos++) {
+		case PROCSTAT_QUERY_U64:
+			value << get_varint(pos);
+			break;
+		case PROCSTAT_QUERY_S64:
+			bits = get_varint(pos);
+			value << (int64_t)((bits >> 1) ^ -(bits & 1));
+			break;
+		case PROCSTAT_QUERY_DOUBLE:
+			for (int j = 0; j < 8; ++j)
+				bits |= (uint64_t)(unsigned char)*pos++ << (8 * j);
+			memcpy(&real, &bits, sizeof(real));
+			value << real;
+			break;
+		case PROCSTAT_QUERY_TEXT:
+			len = get_varint(pos);
+			value << std::string(pos, len);
+			pos += len;
+			break;
+		case PROCSTAT_QUERY_HISTOGRAM: {
+			uint64_t le = 0;
+
+			value << get_varint(pos);
+			len = get_varint(pos);
+			for (uint64_t j = 0; j < len; ++j) {
+				le += get_varint(pos);
+				value << " " << le << ":" << get_varint(pos);
+			}
+			break;
+		}
+		}
+		values[path] = value.str();
+	}
+	EXPECT_EQ(body.data() + body.size(), pos);
+	return values;
+}
+
+static ssize_t format_query_ratio(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return snprintf(buffer, len, "0.25\n");
+}
+
+static ssize_t format_query_state(void *object, uint64_t arg, char *buffer, size_t len)
+{
+	return snprintf(buffer, len, "running\n");
+}
+
+TEST (ProcstatQueryTest, test_unix_queries)
+{
+	struct procstat_context *headless = procstat_create_headless();
+	struct procstat_simple_handle handles[] = {
+		{"ratio", NULL, 0, format_query_ratio, NULL},
+		{"state", NULL, 0, format_query_state, NULL},
+	};
+	std::string path = "/tmp/procstat-query-" + std::to_string(getpid());
+	std::map<std::string, std::string> values;
+	struct procstat_histogram_u32 latency = {};
+	struct procstat_item *parent;
+	struct sockaddr_un addr = {};
+	uint64_t requests = 42;
+	uint64_t status = -1;
+	int delta = -5;
+	int fd;
+
+	ASSERT_TRUE(headless);
+	parent = procstat_create_directory(headless, NULL, "server");
+	ASSERT_TRUE(parent);
+	ASSERT_FALSE(procstat_create_u64(headless, parent, "requests", &requests));
+	ASSERT_FALSE(procstat_create_int(headless, NULL, "delta", &delta));
+	ASSERT_FALSE(procstat_create_simple(headless, parent, handles, 2));
+	ASSERT_FALSE(procstat_create_histogram_u32_series(headless, parent, "latency", &latency));
+	procstat_histogram_u32_add_point(&latency, 5);
+	procstat_histogram_u32_add_point(&latency, 5);
+	procstat_histogram_u32_add_point(&latency, 1000);
+
+	ASSERT_FALSE(procstat_serve_unix(headless, path.c_str()));
+	EXPECT_EQ(-1, procstat_serve_unix(headless, path.c_str()));
+	EXPECT_EQ(EEXIST, errno);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	ASSERT_LE(0, fd);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	ASSERT_FALSE(connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+	std::string request = query_request({});
+	ASSERT_EQ((ssize_t)request.size(), write(fd, request.data(), request.size()));
+	values = query_response(fd, &status);
+	EXPECT_EQ(0, status);
+	EXPECT_EQ(5, values.size());
+	EXPECT_EQ("42", values["server/requests"]);
+	EXPECT_EQ("-5", values["delta"]);
+	EXPECT_EQ("0.25", values["server/ratio"]);
+	EXPECT_EQ("running", values["server/state"]);
+	EXPECT_EQ("1010 5:2 1007:1", values["server/latency"]);
+
+	/* two requests in one write */
+	request = query_request({{PROCSTAT_QUERY_PREFIX, "server/r"}}) +
+		  query_request({{PROCSTAT_QUERY_GLOB, "*"}, {PROCSTAT_QUERY_GLOB, "*/s*"}});
+	ASSERT_EQ((ssize_t)request.size(), write(fd, request.data(), request.size()));
+	values = query_response(fd, &status);
+	EXPECT_EQ(2, values.size());
+	EXPECT_EQ(1, values.count("server/requests"));
+	EXPECT_EQ(1, values.count("server/ratio"));
+	values = query_response(fd, &status);
+	EXPECT_EQ(2, values.size());
+	EXPECT_EQ(1, values.count("delta"));
+	EXPECT_EQ(1, values.count("server/state"));
+
+	/* unknown query kind */
+	request = std::string("\x03\x01\x07\x00", 4);
+	ASSERT_EQ(4, write(fd, request.data(), request.size()));
+	values = query_response(fd, &status);
+	EXPECT_EQ(EINVAL, status);
+	EXPECT_TRUE(values.empty());
+
+	/* a partial request before the end of the stream is dropped, the complete one is answered */
+	request = query_request({{PROCSTAT_QUERY_PREFIX, "delta"}}) + std::string("\x05\x01", 2);
+	ASSERT_EQ((ssize_t)request.size(), write(fd, request.data(), request.size()));
+	ASSERT_FALSE(shutdown(fd, SHUT_WR));
+	values = query_response(fd, &status);
+	EXPECT_EQ(0, status);
+	EXPECT_EQ("-5", values["delta"]);
+	char byte;
+	EXPECT_EQ(0, read(fd, &byte, 1));
+
+	close(fd);
+	procstat_unix_close(headless);
+	EXPECT_EQ(-1, access(path.c_str(), F_OK));
+	procstat_destroy(headless);
+}
+
+/* sends @request and reads one response, @return the head and sets @body */
+static std::string http_exchange(int fd, const std::string &request, std::string *body)
+{
+	std::string response;
+	size_t head_end;
+	size_t length;
+	char buffer[4096];
+	ssize_t len;
+
+	if (write(fd, request.data(), request.size()) != (ssize_t)request.size())
+		return "";
+	while ((head_end = response.find("\r\n\r\n")) == std::string::npos) {
+		len = read(fd, buffer, sizeof(buffer));
+		if (len <= 0)
+			return "";
+		response.append(buffer, len);
+	}
+	std::string head = response.substr(0, head_end + 4);
+	size_t field = head.find("Content-Length: ");
+	length = field == std::string::npos ? 0 : std::stoul(head.substr(field + 16));
+	if (request.compare(0, 4, "HEAD") == 0)
+		length = 0;
+	*body = response.substr(head_end + 4);
+	while (body->size() < length) {
+		len = read(fd, buffer, sizeof(buffer));
+		if (len <= 0)
+			break;
+		body->append(buffer, len);
+	}
+	return head;
+}
+
+static std::string gunzip(const std::string &compressed)
+{
+	std::string plain;
+	z_stream stream = {};
+	char buffer[4096];
+	int error = Z_OK;
+
+	inflateInit2(&stream, 15 + 16);
+	stream.next_in = (Bytef *)compressed.data();
+	stream.avail_in = compressed.size();
+	while (error == Z_OK) {
+		stream.next_out = (Bytef *)buffer;
+		stream.avail_out = sizeof(buffer);
+		error = inflate(&stream, Z_NO_FLUSH);
+		plain.append(buffer, sizeof(buffer) - stream.avail_out);
+	}
+	inflateEnd(&stream);
+	EXPECT_EQ(Z_STREAM_END, error);
+	return plain;
+}
+
+TEST (ProcstatHttpTest, test_metrics_endpoint)
+{
+	struct procstat_context *headless = procstat_create_headless();
+	struct procstat_histogram_u32 latency = {};
+	struct procstat_item *parent;
+	struct sockaddr_in addr = {};
+	uint64_t requests = 42;
+	std::string body;
+	std::string head;
+	char byte;
+	int port;
+	int fd;
+
+	ASSERT_TRUE(headless);
+	parent = procstat_create_directory(headless, NULL, "server");
+	ASSERT_TRUE(parent);
+	ASSERT_FALSE(procstat_create_u64(headless, parent, "requests", &requests));
+	ASSERT_FALSE(procstat_create_histogram_u32_series(headless, parent, "latency", &latency));
+	procstat_histogram_u32_add_point(&latency, 5);
+
+	port = procstat_serve_http(headless, NULL, 0);
+	ASSERT_LT(0, port);
+	EXPECT_EQ(-1, procstat_serve_http(headless, NULL, 0));
+	EXPECT_EQ(EEXIST, errno);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_LE(0, fd);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ASSERT_FALSE(connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+	head = http_exchange(fd, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n", &body);
+	EXPECT_EQ(0, head.find("HTTP/1.1 200 OK\r\n"));
+	EXPECT_NE(std::string::npos, body.find("# TYPE server_requests gauge\nserver_requests 42\n"));
+	EXPECT_NE(std::string::npos, body.find("# TYPE server_latency histogram\n"));
+	EXPECT_NE(std::string::npos, body.find("server_latency_count 1\n"));
+
+	/* the same connection serves the next requests */
+	std::string plain = body;
+	head = http_exchange(fd, "GET /metrics HTTP/1.1\r\nAccept-Encoding: deflate, gzip\r\n\r\n", &body);
+	EXPECT_NE(std::string::npos, head.find("Content-Encoding: gzip\r\n"));
+	EXPECT_EQ(plain, gunzip(body));
+
+	head = http_exchange(fd, "HEAD /metrics HTTP/1.1\r\nAccept-Encoding: gzip;q=0\r\n\r\n", &body);
+	EXPECT_EQ(std::string::npos, head.find("Content-Encoding"));
+	EXPECT_NE(std::string::npos, head.find("Content-Length: " + std::to_string(plain.size()) + "\r\n"));
+	EXPECT_TRUE(body.empty());
+
+	head = http_exchange(fd, "GET /other HTTP/1.1\r\n\r\n", &body);
+	EXPECT_EQ(0, head.find("HTTP/1.1 404 Not Found\r\n"));
+	head = http_exchange(fd, "DELETE /metrics HTTP/1.1\r\nConnection: close\r\n\r\n", &body);
+	EXPECT_EQ(0, head.find("HTTP/1.1 405 Method Not Allowed\r\n"));
+	EXPECT_NE(std::string::npos, head.find("Connection: close\r\n"));
+	EXPECT_EQ(0, read(fd, &byte, 1));
+	close(fd);
+
+	procstat_http_close(headless);
+	procstat_destroy(headless);
+}
+
 TEST_F (ProcstatTest, test_delete_via_root_dir_after_open)
 {
 	ifstream read_try;